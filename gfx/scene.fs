@@ -1,4 +1,6 @@
 uniform sampler2DShadow shadowMap ;
+// static casters, only redrawn when needed
+uniform sampler2DShadow staticShadowMap ;
 
 // This define the value to move one pixel left or right
 uniform vec2 pixelOffset;// = vec2(1.0 / 1024, 1.0 / 1024);
@@ -54,11 +56,13 @@ float rand(vec2 co){
 float lookup( vec2 offSet)
 {
 	// Values are multiplied by ShadowCoord.w because shadow2DProj does a W division for us.
-	return shadow2DProj(shadowMap, 
-				ShadowCoord + vec4(
+	vec4 coord = ShadowCoord + vec4(
 						offSet.x * pixelOffset.x * ShadowCoord.w, 
 						offSet.y * pixelOffset.y * ShadowCoord.w, 
-						0.05, 0.0) ).w;
+						0.05, 0.0);
+	// in the shadow if either map says so
+	return min(shadow2DProj(shadowMap, coord).w,
+				shadow2DProj(staticShadowMap, coord).w);
 }
 
 void main()
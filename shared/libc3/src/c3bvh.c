@@ -0,0 +1,204 @@
+/*
+	c3bvh.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of libc3.
+
+	libc3 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	libc3 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libc3.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "c3bvh.h"
+
+#define C3BVH_LEAF	4		// geometries per leaf, at most
+
+static int qsort_axis;
+
+static int
+_c3bvh_sorter(
+		const void *_p1,
+		const void *_p2)
+{
+	c3geometry_p g1 = *(c3geometry_p*)_p1;
+	c3geometry_p g2 = *(c3geometry_p*)_p2;
+	c3f c1 = g1->wbbox.min.n[qsort_axis] + g1->wbbox.max.n[qsort_axis];
+	c3f c2 = g2->wbbox.min.n[qsort_axis] + g2->wbbox.max.n[qsort_axis];
+
+	return c1 < c2 ? -1 : c1 > c2 ? 1 : 0;
+}
+
+static void
+_c3bvh_node_box(
+		c3bvh_p b,
+		c3bvh_node_t * n)
+{
+	for (uint32_t i = 0; i < n->count; i++) {
+		c3geometry_p g = b->geometry.e[n->first + i];
+		if (i == 0)
+			n->box = g->wbbox;
+		else {
+			n->box.min = c3vec3_min(n->box.min, g->wbbox.min);
+			n->box.max = c3vec3_max(n->box.max, g->wbbox.max);
+		}
+	}
+}
+
+static void
+_c3bvh_split(
+		c3bvh_p b,
+		uint32_t ni)
+{
+	c3bvh_node_t * n = &b->nodes.e[ni];
+	_c3bvh_node_box(b, n);
+	if (n->count <= C3BVH_LEAF)
+		return;
+
+	// split at the median, along the axis the centers are most spread on
+	c3vec3 min, max;
+	for (uint32_t i = 0; i < n->count; i++) {
+		c3geometry_p g = b->geometry.e[n->first + i];
+		c3vec3 c = c3vec3_add(g->wbbox.min, g->wbbox.max);
+		if (i == 0)
+			min = max = c;
+		else {
+			min = c3vec3_min(min, c);
+			max = c3vec3_max(max, c);
+		}
+	}
+	c3vec3 spread = c3vec3_sub(max, min);
+	qsort_axis = spread.x > spread.y ?
+			(spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+	qsort(b->geometry.e + n->first, n->count, sizeof(b->geometry.e[0]),
+			_c3bvh_sorter);
+
+	uint32_t half = n->count / 2;
+	c3bvh_node_t l = { .first = n->first, .count = half };
+	c3bvh_node_t r = { .first = n->first + half, .count = n->count - half };
+	uint32_t child = b->nodes.count;
+	// 'n' is not valid after that, the array might move
+	c3bvh_node_array_add(&b->nodes, l);
+	c3bvh_node_array_add(&b->nodes, r);
+	b->nodes.e[ni].child = child;
+
+	_c3bvh_split(b, child);
+	_c3bvh_split(b, child + 1);
+}
+
+void
+c3bvh_build(
+		c3bvh_p b,
+		c3geometry_array_p geometry )
+{
+	c3bvh_node_array_clear(&b->nodes);
+	c3geometry_array_clear(&b->geometry);
+	if (!geometry->count)
+		return;
+	c3geometry_array_realloc(&b->geometry, geometry->count + 1);
+	memcpy(b->geometry.e, geometry->e, geometry->count * sizeof(geometry->e[0]));
+	b->geometry.count = geometry->count;
+	// a binary tree with leaves of at least one has less than 2n nodes
+	c3bvh_node_array_realloc(&b->nodes, 2 * geometry->count + 1);
+
+	c3bvh_node_t root = { .first = 0, .count = geometry->count };
+	c3bvh_node_array_add(&b->nodes, root);
+	_c3bvh_split(b, 0);
+}
+
+void
+c3bvh_refit(
+		c3bvh_p b )
+{
+	// children always come after their parent
+	for (int ni = b->nodes.count - 1; ni >= 0; ni--) {
+		c3bvh_node_t * n = &b->nodes.e[ni];
+		if (!n->child)
+			_c3bvh_node_box(b, n);
+		else {
+			c3bvh_node_t * l = &b->nodes.e[n->child];
+			c3bvh_node_t * r = l + 1;
+			n->box.min = c3vec3_min(l->box.min, r->box.min);
+			n->box.max = c3vec3_max(l->box.max, r->box.max);
+		}
+	}
+}
+
+/*
+ * Returns -1 if the box is fully outside one of the planes, 1 if it's
+ * inside all of them, 0 if it's across
+ */
+static int
+_c3bvh_classify(
+		const c3bbox_t * box,
+		const c3vec4 * planes,
+		int count)
+{
+	int res = 1;
+	for (int pi = 0; pi < count; pi++) {
+		const c3vec4 * p = &planes[pi];
+		// corners the furthest along, and against, the normal
+		c3vec3 far, near;
+		for (int i = 0; i < 3; i++) {
+			far.n[i] = p->n[i] >= 0 ? box->max.n[i] : box->min.n[i];
+			near.n[i] = p->n[i] >= 0 ? box->min.n[i] : box->max.n[i];
+		}
+		if (c3vec3_dot(p->v3, far) + p->w < 0)
+			return -1;
+		if (c3vec3_dot(p->v3, near) + p->w < 0)
+			res = 0;
+	}
+	return res;
+}
+
+void
+c3bvh_cull(
+		c3bvh_p b,
+		const c3vec4 * planes,
+		int count,
+		c3bvh_visit_p visit,
+		void * param )
+{
+	if (!b->nodes.count)
+		return;
+	uint32_t stack[64];	// the tree is balanced, that's plenty
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp) {
+		c3bvh_node_t * n = &b->nodes.e[stack[--sp]];
+		int in = _c3bvh_classify(&n->box, planes, count);
+		if (in < 0)
+			continue;
+		if (in > 0) {
+			for (uint32_t i = 0; i < n->count; i++)
+				visit(b->geometry.e[n->first + i], param);
+		} else if (n->child) {
+			stack[sp++] = n->child;
+			stack[sp++] = n->child + 1;
+		} else {
+			for (uint32_t i = 0; i < n->count; i++) {
+				c3geometry_p g = b->geometry.e[n->first + i];
+				if (_c3bvh_classify(&g->wbbox, planes, count) >= 0)
+					visit(g, param);
+			}
+		}
+	}
+}
+
+void
+c3bvh_free(
+		c3bvh_p b )
+{
+	c3bvh_node_array_free(&b->nodes);
+	c3geometry_array_free(&b->geometry);
+}
@@ -0,0 +1,87 @@
+/*
+	c3bvh.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of libc3.
+
+	libc3 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	libc3 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libc3.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __C3BVH_H___
+#define __C3BVH_H___
+
+#include "c3geometry.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounding volume hierarchy over the world bounding boxes of a set of
+ * geometries. Every node covers a contiguous run of the (reordered)
+ * 'geometry' array, so a node that is all inside can be taken whole.
+ */
+typedef struct c3bvh_node_t {
+	c3bbox_t	box;
+	uint32_t	first, count;	// run in 'geometry'
+	uint32_t	child;			// left child, right is child+1. 0 for leaves
+} c3bvh_node_t;
+
+DECLARE_C_ARRAY(c3bvh_node_t, c3bvh_node_array, 64);
+
+typedef struct c3bvh_t {
+	c3bvh_node_array_t	nodes;		// nodes[0] is the root
+	c3geometry_array_t	geometry;
+} c3bvh_t, *c3bvh_p;
+
+//! (re)builds 'b' from the world boxes of 'geometry'
+void
+c3bvh_build(
+		c3bvh_p b,
+		c3geometry_array_p geometry );
+
+//! Recalculates the node boxes, when the geometries moved, but are the same
+void
+c3bvh_refit(
+		c3bvh_p b );
+
+typedef void (*c3bvh_visit_p)(
+		c3geometry_p g,
+		void * param );
+
+//! Calls 'visit' for every geometry not fully outside one of the planes
+/*!
+ * 'planes' are a,b,c,d with the normal pointing inside
+ */
+void
+c3bvh_cull(
+		c3bvh_p b,
+		const c3vec4 * planes,
+		int count,
+		c3bvh_visit_p visit,
+		void * param );
+
+void
+c3bvh_free(
+		c3bvh_p b );
+
+IMPLEMENT_C_ARRAY(c3bvh_node_array);
+
+#if __cplusplus
+}
+#endif
+
+#endif /* __C3BVH_H___ */
@@ -0,0 +1,418 @@
+/*
+	c3cache.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of libc3.
+
+	libc3 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	libc3 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libc3.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "c3cache.h"
+#include "c3lines.h"
+
+enum {
+	C3CACHE_OBJECT = 1,
+	C3CACHE_PIXELS,
+};
+
+typedef struct c3cache_header_t {
+	uint32_t	magic;		// C3_TYPE('c','3','c','a')
+	uint32_t	version;
+	uint32_t	kind;		// C3CACHE_OBJECT etc
+	uint32_t	count;		// geometries, for objects
+	uint64_t	hash;		// of the source file
+	uint64_t	size;		// of the source file
+	int64_t		mtime;		// of the source file, in ns
+} c3cache_header_t;
+
+typedef struct c3cache_geometry_t {
+	uint32_t	type;
+	c3colorf_t	color;
+	c3f			shininess;
+	c3f			width;		// for lines
+	c3bbox_t	bbox;
+	uint32_t	vertice, textures, normals, colorf, indices;
+	uint32_t	name;		// length of the name that follows
+} c3cache_geometry_t;
+
+typedef struct c3cache_pixels_t {
+	uint32_t	w, h, row, psize, format;
+} c3cache_pixels_t;
+
+#define C3CACHE_MAGIC	C3_TYPE('c','3','c','a')
+#define C3CACHE_PAD(_s)	(((_s) + 3) & ~3)
+
+typedef struct c3cache_map_t {
+	const uint8_t *	base;
+	size_t			size;
+	const uint8_t *	p;			// read cursor
+} c3cache_map_t;
+
+static int
+_c3cache_map(
+		const char * filename,
+		c3cache_map_t * m)
+{
+	memset(m, 0, sizeof(*m));
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		m->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m->base == MAP_FAILED)
+			m->base = NULL;
+		else
+			m->size = st.st_size;
+	}
+	close(fd);
+	m->p = m->base;
+	return m->base ? 0 : -1;
+}
+
+static void
+_c3cache_unmap(
+		c3cache_map_t * m)
+{
+	if (m->base)
+		munmap((void*)m->base, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+//! Returns 'size' bytes from the cursor and skips them, or NULL if short
+static const void *
+_c3cache_get(
+		c3cache_map_t * m,
+		size_t size)
+{
+	if (!m->p || (size_t)(m->base + m->size - m->p) < size) {
+		m->p = NULL;
+		return NULL;
+	}
+	const void * r = m->p;
+	size = C3CACHE_PAD(size);
+	m->p = (size_t)(m->base + m->size - m->p) < size ?
+			m->base + m->size : m->p + size;
+	return r;
+}
+
+// FNV-1a
+static uint64_t
+_c3cache_hash(
+		const uint8_t * b,
+		size_t size)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	while (size--) {
+		h ^= *b++;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static int
+_c3cache_source(
+		const char * source,
+		c3cache_header_t * h,
+		int with_hash)
+{
+	struct stat st;
+	if (stat(source, &st))
+		return -1;
+	h->size = st.st_size;
+	// in ns, an edit in the same second as the save would be missed
+#if __APPLE__
+	h->mtime = st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#else
+	h->mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#endif
+	h->hash = 0;
+	if (!with_hash)
+		return 0;
+	if (!st.st_size)
+		return 0;
+	c3cache_map_t m;
+	if (_c3cache_map(source, &m))
+		return -1;
+	h->hash = _c3cache_hash(m.base, m.size);
+	_c3cache_unmap(&m);
+	return 0;
+}
+
+/*
+ * Maps 'cache' and checks it's a valid one for 'source', the cursor
+ * is left after the header
+ */
+static const c3cache_header_t *
+_c3cache_open(
+		const char * cache,
+		const char * source,
+		uint32_t kind,
+		c3cache_map_t * m)
+{
+	if (_c3cache_map(cache, m))
+		return NULL;
+	const c3cache_header_t * h = _c3cache_get(m, sizeof(*h));
+	if (!h || h->magic != C3CACHE_MAGIC || h->version != C3CACHE_VERSION ||
+			h->kind != kind)
+		goto stale;
+	c3cache_header_t now;
+	if (_c3cache_source(source, &now, 0))
+		goto stale;
+	if (now.size == h->size && now.mtime == h->mtime)
+		return h;
+	// touched, but perhaps not changed
+	if (now.size == h->size && !_c3cache_source(source, &now, 1) &&
+			now.hash == h->hash)
+		return h;
+stale:
+	_c3cache_unmap(m);
+	return NULL;
+}
+
+str_p
+c3cache_name(
+		const char * source )
+{
+	str_p r = str_alloc(strlen(source) + 8);
+	sprintf(r->str, "%s.c3cache", source);
+	return r;
+}
+
+c3object_p
+c3cache_load_object(
+		const char * cache,
+		const char * source,
+		c3object_p parent )
+{
+	c3cache_map_t m;
+	const c3cache_header_t * h = _c3cache_open(cache, source,
+			C3CACHE_OBJECT, &m);
+	if (!h)
+		return NULL;
+	uint32_t count = h->count;
+
+	c3object_p o = c3object_new(parent);
+	const uint32_t * nl = _c3cache_get(&m, sizeof(uint32_t));
+	const char * name = nl ? _c3cache_get(&m, *nl) : NULL;
+	if (name) {
+		o->name = str_alloc(*nl);
+		memcpy(o->name->str, name, *nl);
+		o->name->str[*nl] = 0;
+	}
+	for (uint32_t gi = 0; gi < count && m.p; gi++) {
+		const c3cache_geometry_t * cg = _c3cache_get(&m, sizeof(*cg));
+		if (!cg)
+			break;
+		c3geometry_p g = c3geometry_new(c3geometry_type(cg->type, 0), o);
+		g->mat.color = cg->color;
+		g->mat.shininess = cg->shininess;
+		if (cg->type == C3_LINES_TYPE)
+			g->line.width = cg->width;
+		g->bbox = cg->bbox;
+		if (cg->name && (name = _c3cache_get(&m, cg->name))) {
+			g->name = str_alloc(cg->name);
+			memcpy(g->name->str, name, cg->name);
+			g->name->str[cg->name] = 0;
+		}
+		const void * e;
+		if ((e = _c3cache_get(&m, cg->vertice * sizeof(c3vertex_t))))
+			c3vertex_array_insert(&g->vertice, 0, (c3vertex_p)e, cg->vertice);
+		if ((e = _c3cache_get(&m, cg->textures * sizeof(c3tex_t))))
+			c3tex_array_insert(&g->textures, 0, (c3tex_p)e, cg->textures);
+		if ((e = _c3cache_get(&m, cg->normals * sizeof(c3vertex_t))))
+			c3vertex_array_insert(&g->normals, 0, (c3vertex_p)e, cg->normals);
+		if ((e = _c3cache_get(&m, cg->colorf * sizeof(c3colorf_t))))
+			c3colorf_array_insert(&g->colorf, 0, (c3colorf_p)e, cg->colorf);
+		if ((e = _c3cache_get(&m, cg->indices * sizeof(c3index_t))))
+			c3indices_array_insert(&g->indices, 0, (c3index_p)e, cg->indices);
+	}
+	int ok = m.p != NULL;
+	_c3cache_unmap(&m);
+	if (!ok) {
+		fprintf(stderr, "%s: %s is truncated\n", __func__, cache);
+		c3object_dispose(o);
+		return NULL;
+	}
+	return o;
+}
+
+/*
+ * Writes to a temporary file, then renames it, a reader never sees a
+ * partial cache
+ */
+static FILE *
+_c3cache_create(
+		const char * cache,
+		const char * source,
+		uint32_t kind,
+		uint32_t count,
+		str_p * tmp)
+{
+	c3cache_header_t h = {
+		.magic = C3CACHE_MAGIC,
+		.version = C3CACHE_VERSION,
+		.kind = kind,
+		.count = count,
+	};
+	if (_c3cache_source(source, &h, 1))
+		return NULL;
+	*tmp = str_alloc(strlen(cache) + 16);
+	sprintf((*tmp)->str, "%s.%d", cache, (int)getpid());
+	FILE * f = fopen((*tmp)->str, "wb");
+	if (!f) {
+		perror((*tmp)->str);
+		str_free(*tmp);
+		*tmp = NULL;
+		return NULL;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	return f;
+}
+
+static void
+_c3cache_write(
+		FILE * f,
+		const void * b,
+		size_t size)
+{
+	static const uint8_t pad[4];
+	if (size)
+		fwrite(b, size, 1, f);
+	if (C3CACHE_PAD(size) != size)
+		fwrite(pad, C3CACHE_PAD(size) - size, 1, f);
+}
+
+static int
+_c3cache_close(
+		FILE * f,
+		const char * cache,
+		str_p tmp)
+{
+	int res = ferror(f) ? -1 : 0;
+	if (fclose(f))
+		res = -1;
+	if (!res && rename(tmp->str, cache))
+		res = -1;
+	if (res) {
+		perror(cache);
+		unlink(tmp->str);
+	}
+	str_free(tmp);
+	return res;
+}
+
+int
+c3cache_save_object(
+		const char * cache,
+		const char * source,
+		c3object_p o )
+{
+	/*
+	 * The driver purges the arrays once they are uploaded, so this has
+	 * to be called before the first draw
+	 */
+	for (int gi = 0; gi < o->geometry.count; gi++) {
+		c3geometry_p g = o->geometry.e[gi];
+		if ((g->vertice.count && !g->vertice.e) ||
+				(g->indices.count && !g->indices.e)) {
+			fprintf(stderr, "%s %s: geometry already purged\n", __func__, cache);
+			return -1;
+		}
+	}
+	str_p tmp;
+	FILE * f = _c3cache_create(cache, source, C3CACHE_OBJECT,
+			o->geometry.count, &tmp);
+	if (!f)
+		return -1;
+	uint32_t nl = o->name ? o->name->len : 0;
+	_c3cache_write(f, &nl, sizeof(nl));
+	_c3cache_write(f, nl ? o->name->str : NULL, nl);
+
+	for (int gi = 0; gi < o->geometry.count; gi++) {
+		c3geometry_p g = o->geometry.e[gi];
+		c3cache_geometry_t cg = {
+			.type = g->type.type,
+			.color = g->mat.color,
+			.shininess = g->mat.shininess,
+			.width = g->type.type == C3_LINES_TYPE ? g->line.width : 0,
+			.bbox = g->bbox,
+			.vertice = g->vertice.count,
+			// arrays that were freed after upload have no count either
+			.textures = g->textures.e ? g->textures.count : 0,
+			.normals = g->normals.e ? g->normals.count : 0,
+			.colorf = g->colorf.e ? g->colorf.count : 0,
+			.indices = g->indices.count,
+			.name = g->name ? g->name->len : 0,
+		};
+		_c3cache_write(f, &cg, sizeof(cg));
+		_c3cache_write(f, cg.name ? g->name->str : NULL, cg.name);
+		_c3cache_write(f, g->vertice.e, cg.vertice * sizeof(c3vertex_t));
+		_c3cache_write(f, g->textures.e, cg.textures * sizeof(c3tex_t));
+		_c3cache_write(f, g->normals.e, cg.normals * sizeof(c3vertex_t));
+		_c3cache_write(f, g->colorf.e, cg.colorf * sizeof(c3colorf_t));
+		_c3cache_write(f, g->indices.e, cg.indices * sizeof(c3index_t));
+	}
+	return _c3cache_close(f, cache, tmp);
+}
+
+c3pixels_p
+c3cache_load_pixels(
+		const char * cache,
+		const char * source,
+		int format )
+{
+	c3cache_map_t m;
+	if (!_c3cache_open(cache, source, C3CACHE_PIXELS, &m))
+		return NULL;
+	c3pixels_p p = NULL;
+	const c3cache_pixels_t * cp = _c3cache_get(&m, sizeof(*cp));
+	const void * base = cp && cp->format == format ?
+			_c3cache_get(&m, (size_t)cp->row * cp->h) : NULL;
+	if (base) {
+		p = c3pixels_new(cp->w, cp->h, cp->psize, cp->row, NULL);
+		memcpy(p->base, base, (size_t)cp->row * cp->h);
+		p->format = cp->format;
+		p->name = str_new(source);
+	}
+	_c3cache_unmap(&m);
+	return p;
+}
+
+int
+c3cache_save_pixels(
+		const char * cache,
+		const char * source,
+		c3pixels_p p )
+{
+	if (!p->base)
+		return -1;
+	str_p tmp;
+	FILE * f = _c3cache_create(cache, source, C3CACHE_PIXELS, 0, &tmp);
+	if (!f)
+		return -1;
+	c3cache_pixels_t cp = {
+		.w = p->w, .h = p->h, .row = p->row,
+		.psize = p->psize, .format = p->format,
+	};
+	_c3cache_write(f, &cp, sizeof(cp));
+	_c3cache_write(f, p->base, (size_t)p->row * p->h);
+	return _c3cache_close(f, cache, tmp);
+}
@@ -0,0 +1,82 @@
+/*
+	c3cache.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of libc3.
+
+	libc3 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	libc3 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libc3.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __C3CACHE_H___
+#define __C3CACHE_H___
+
+#include "c3object.h"
+#include "c3pixels.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary cache of what was made out of a source file: the geometries of
+ * an object (already welded, etc) or the decoded pixels of an image.
+ * The arrays are stored as they are in memory, so loading is one mmap
+ * and one copy per array; the driver uploads them as usual.
+ *
+ * A cache is valid if the source has the same size and mtime as when it
+ * was saved, or failing that, the same hash (after a checkout, say).
+ * The cache is native endian, it's not meant to be moved around.
+ * If the way the source is processed changes, delete the cache.
+ */
+#define C3CACHE_VERSION		1
+
+//! Returns the default cache file name for 'source', to str_free()
+str_p
+c3cache_name(
+		const char * source );
+
+//! Loads the geometries cached for 'source' in a new object, or NULL
+c3object_p
+c3cache_load_object(
+		const char * cache,
+		const char * source,
+		c3object_p parent );
+
+//! Saves the geometries of 'o' (not the sub-objects) as made from 'source'
+int
+c3cache_save_object(
+		const char * cache,
+		const char * source,
+		c3object_p o );
+
+//! Loads the pixels cached for 'source', or NULL. 'format' must match
+c3pixels_p
+c3cache_load_pixels(
+		const char * cache,
+		const char * source,
+		int format );
+
+int
+c3cache_save_pixels(
+		const char * cache,
+		const char * source,
+		c3pixels_p p );
+
+#if __cplusplus
+}
+#endif
+
+#endif /* __C3CACHE_H___ */
@@ -46,6 +46,7 @@ c3context_init(
 			.type = C3_CONTEXT_VIEW_EYE,
 			.size = c3vec2f(w, h),
 			.dirty = 1,
+			.stale = 1,
 			.index = c->views.count,
 	};
 	c3cam_init(&v.cam);
@@ -61,8 +62,14 @@ c3context_dispose(
 		c3context_p c)
 {
 	c3object_dispose(c->root);
-	for (int i = 0; i < c->views.count; i++)
-		c3geometry_array_free(&c->views.e[i].projected);
+	for (int i = 0; i < c->views.count; i++) {
+		c3context_view_p v = &c->views.e[i];
+		c3geometry_array_free(&v->gathered);
+		c3geometry_array_free(&v->sorted);
+		c3bvh_free(&v->bvh);
+		c3geometry_array_free(&v->projected);
+		c3geometry_array_free(&v->scratch);
+	}
 	free(c);
 }
 
@@ -90,54 +97,184 @@ _c3_minmax_distance2(
 		c3vec3 pt,
 		c3f * min, c3f * max)
 {
-	for (int i = 0; i < count; i++) {
+	*min = *max = count ? c3vec3_length2(c3vec3_sub(in[0], pt)) : 0;
+	for (int i = 1; i < count; i++) {
 		c3f d = c3vec3_length2(c3vec3_sub(in[i], pt));
-		if (i == 0 || d < *min)
+		if (d < *min)
 			*min = d;
-		if (i == 0 || d > *max)
+		if (d > *max)
 			*max = d;
 	}
 }
 
 /*
- * Computes the distance from the 'eye' of the camera, sort by this value
+ * Drawing order: lights first, they need to be set before anything is lit,
+ * then the opaque geometry grouped by material, the depth buffer takes care
+ * of the rest, and the transparent geometry last, back to front.
  */
 static int
-_c3_z_sorter(
+_c3_draw_class(
+		c3geometry_p g)
+{
+	if (g->type.type == C3_LIGHT_TYPE)
+		return 0;
+	return g->mat.color.n[3] < 1 ? 2 : 1;
+}
+
+static int
+_c3_draw_order(
+		c3context_view_p v,
+		c3geometry_p g1,
+		c3geometry_p g2)
+{
+	int c1 = _c3_draw_class(g1);
+	int c2 = _c3_draw_class(g2);
+	if (c1 != c2)
+		return c1 < c2 ? -1 : 1;
+	switch (c1) {
+		case 0: {
+			intptr_t l1 = (intptr_t)((c3light_p)g1)->light_id;
+			intptr_t l2 = (intptr_t)((c3light_p)g2)->light_id;
+			return l1 < l2 ? -1 : l1 > l2 ? 1 : 0;
+		}
+		case 1: {
+			uintptr_t m1 = (uintptr_t)g1->mat.program;
+			uintptr_t m2 = (uintptr_t)g2->mat.program;
+			if (m1 == m2) {
+				m1 = (uintptr_t)g1->mat.texture;
+				m2 = (uintptr_t)g2->mat.texture;
+			}
+			return m1 < m2 ? -1 : m1 > m2 ? 1 : 0;
+		}
+	}
+	// distance from the eye to the center of each box
+	c3vec3 e1 = c3vec3_sub(
+			c3vec3_mulf(c3vec3_add(g1->wbbox.min, g1->wbbox.max), 0.5), v->cam.eye);
+	c3vec3 e2 = c3vec3_sub(
+			c3vec3_mulf(c3vec3_add(g2->wbbox.min, g2->wbbox.max), 0.5), v->cam.eye);
+	c3f d1 = c3vec3_length2(e1);
+	c3f d2 = c3vec3_length2(e2);
+	return d1 > d2 ? -1 : d1 < d2 ? 1 : 0;
+}
+
+static int
+_c3_draw_sorter(
 		const void *_p1,
 		const void *_p2)
 {
-	c3geometry_p g1 = *(c3geometry_p*)_p1;
-	c3geometry_p g2 = *(c3geometry_p*)_p2;
-	c3cam_p cam = &qsort_view->cam;
+	return _c3_draw_order(qsort_view,
+			*(c3geometry_p*)_p1, *(c3geometry_p*)_p2);
+}
 
-	c3vec3	v1[8], v2[8];
-	c3_bbox_vertices(&g1->wbbox, v1);
-	c3_bbox_vertices(&g2->wbbox, v2);
+static void
+_c3_array_copy(
+		c3geometry_array_p dst,
+		c3geometry_array_p src)
+{
+	c3geometry_array_realloc(dst, src->count + 1);
+	memcpy(dst->e, src->e, src->count * sizeof(src->e[0]));
+	dst->count = src->count;
+}
 
-	c3f 	d1min, d1max;
-	c3f 	d2min, d2max;
+/*
+ * Regather the geometry of a view after the tree changed. If it's the same
+ * set, it just moved, the tree is refitted and the order kept; otherwise
+ * both are rebuilt from scratch
+ */
+static void
+_c3context_view_gather(
+		c3context_p c,
+		c3context_view_p v)
+{
+	c3geometry_array_p all = &v->scratch;
 
-	_c3_minmax_distance2(v1, 8, cam->eye, &d1min, &d1max);
-	_c3_minmax_distance2(v2, 8, cam->eye, &d2min, &d2max);
+	c3geometry_array_clear(all);
+	c3object_get_geometry(c->root, all);
+	v->stale = 0;
 
-	if (d1max > qsort_view->z.max) qsort_view->z.max = d1max;
-	if (d1min < qsort_view->z.min) qsort_view->z.min = d1min;
-	if (d2max > qsort_view->z.max) qsort_view->z.max = d2max;
-	if (d2min < qsort_view->z.min) qsort_view->z.min = d2min;
-	/*
-	 * make sure transparent items are drawn after everyone else
-	 */
-	if (g1->mat.color.n[3] < 1)
-		d1min -= 100000.0;
-	if (g2->mat.color.n[3] < 1)
-		d2min -= 100000.0;
-	if (g1->type.type == C3_LIGHT_TYPE)
-		d1min = -200000 + (int)((intptr_t)((c3light_p)g1)->light_id);
-	if (g2->type.type == C3_LIGHT_TYPE)
-		d2min = -200000 + (int)((intptr_t)((c3light_p)g2)->light_id);
-
-	return d1min < d2min ? -1 : d1min > d2min ? 1 : 0;
+	if (all->count == v->gathered.count &&
+			!memcmp(all->e, v->gathered.e, all->count * sizeof(all->e[0]))) {
+		c3bvh_refit(&v->bvh);
+		return;
+	}
+	_c3_array_copy(&v->gathered, all);
+
+	// lights are never culled, keep them out of the tree
+	c3geometry_array_clear(all);
+	for (int i = 0; i < v->gathered.count; i++)
+		if (v->gathered.e[i]->type.type != C3_LIGHT_TYPE)
+			all->e[all->count++] = v->gathered.e[i];
+	c3bvh_build(&v->bvh, all);
+
+	_c3_array_copy(&v->sorted, &v->gathered);
+	qsort(v->sorted.e, v->sorted.count, sizeof(v->sorted.e[0]),
+			_c3_draw_sorter);
+}
+
+/*
+ * The order barely changes from one frame to the next (only the
+ * transparent geometry depends on the camera) so an insertion sort is
+ * about linear
+ */
+static void
+_c3context_view_sort(
+		c3context_view_p v)
+{
+	c3geometry_p * e = v->sorted.e;
+	for (int i = 1; i < v->sorted.count; i++) {
+		c3geometry_p g = e[i];
+		int j = i;
+		while (j > 0 && _c3_draw_order(v, e[j - 1], g) > 0) {
+			e[j] = e[j - 1];
+			j--;
+		}
+		e[j] = g;
+	}
+}
+
+static void
+_c3_cull_visit(
+		c3geometry_p g,
+		void * param)
+{
+	g->visible |= 1 << ((c3context_view_p)param)->index;
+}
+
+static void
+_c3context_view_cull(
+		c3context_view_p v)
+{
+	const int mask = 1 << v->index;
+
+	for (int i = 0; i < v->sorted.count; i++) {
+		c3geometry_p g = v->sorted.e[i];
+		if (v->cam.fov > 0 && g->type.type != C3_LIGHT_TYPE)
+			g->visible &= ~mask;
+		else
+			g->visible |= mask;
+	}
+	if (v->cam.fov > 0) {
+		c3cam_update_matrix(&v->cam);
+		/*
+		 * Only the side planes; they don't depend on near and far, which
+		 * are calculated afterward from what is visible
+		 */
+		c3mat4 p = perspective3D(v->cam.fov, v->size.x / v->size.y, 1, 2);
+		c3mat4 m = c3mat4_mul(&p, &v->cam.mtx);
+		c3vec4 planes[4];
+		for (int i = 0; i < 4; i++) {
+			int row = i / 2;
+			c3f sign = i & 1 ? -1 : 1;
+			for (int col = 0; col < 4; col++)
+				planes[i].n[col] = m.v[col].n[3] + sign * m.v[col].n[row];
+		}
+		c3bvh_cull(&v->bvh, planes, 4, _c3_cull_visit, v);
+	}
+	c3geometry_array_clear(&v->projected);
+	c3geometry_array_realloc(&v->projected, v->sorted.count + 1);
+	for (int i = 0; i < v->sorted.count; i++)
+		if (v->sorted.e[i]->visible & mask)
+			v->projected.e[v->projected.count++] = v->sorted.e[i];
 }
 
 int
@@ -153,32 +290,38 @@ c3context_project(
 	 */
 	if (c->root->dirty) {
 		for (int ci = 0; ci < c->views.count; ci++)
-			c->views.e[ci].dirty = 1;
+			c->views.e[ci].dirty = c->views.e[ci].stale = 1;
 		c3mat4 m = identity3D();
 		c3object_project(c->root, &m);
 		res++;
 	}
 
 	/*
-	 * if the current view is dirty, gather all the geometry
-	 * and Z sort it in a basic way
+	 * if the current view is dirty, regather the geometry if it moved,
+	 * resort it and cull what's out of view
 	 */
 	c3context_view_p v = qsort_view = c3context_view_get(c);
 	if (v->dirty) {
 		res++;
 
-		c3geometry_array_p  array = &c3context_view_get(c)->projected;
-		c3geometry_array_clear(array);
-		c3object_get_geometry(c->root, array);
+		if (v->stale)
+			_c3context_view_gather(c, v);
+		_c3context_view_sort(v);
+		_c3context_view_cull(v);
 
-		v->z.min = 1000000000;
-		v->z.max = -1000000000;
-
-		qsort(v->projected.e,
-				v->projected.count, sizeof(v->projected.e[0]),
-		        _c3_z_sorter);
-		v->z.min = sqrt(v->z.min) * 0.8f;
-		v->z.max = sqrt(v->z.max);
+		c3f zmin = 1000000000, zmax = -1000000000;
+		for (int i = 0; i < v->projected.count; i++) {
+			c3vec3	b[8];
+			c3f		dmin, dmax;
+			c3_bbox_vertices(&v->projected.e[i]->wbbox, b);
+			_c3_minmax_distance2(b, 8, v->cam.eye, &dmin, &dmax);
+			if (dmin < zmin) zmin = dmin;
+			if (dmax > zmax) zmax = dmax;
+		}
+		if (v->projected.count) {
+			v->z.min = sqrt(zmin) * 0.8f;
+			v->z.max = sqrt(zmax);
+		}
 
 		/*
 		 * Recalculate the perspective view using the new Z values
@@ -210,5 +353,6 @@ c3context_draw(
 		c3geometry_p g = array->e[gi];
 		c3geometry_draw(g);
 	}
+	C3_DRIVER(c, context_view_draw_done, v);
 }
 
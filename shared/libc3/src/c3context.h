@@ -28,6 +28,7 @@
 #include "c3pixels.h"
 #include "c3program.h"
 #include "c3camera.h"
+#include "c3bvh.h"
 
 #if __cplusplus
 extern "C" {
@@ -42,13 +43,18 @@ enum {
 typedef struct c3context_view_t {
 	int			type : 4,			// C3_CONTEXT_VIEW_EYE...
 				dirty : 1,
+				stale : 1,			// geometry moved, regather
 				index : 4;			// index in context array
 	c3apiobject_t	bid;			// buffer id (fbo, texture...)
 	c3vec2		size;				// in pixels. for fbo/textures/window
 	c3cam_t 	cam;
 	c3mat4		projection;			// projection matrix
 
-	c3geometry_array_t	projected;
+	c3geometry_array_t	gathered;	// all the geometry of this view, tree order
+	c3geometry_array_t	sorted;		// same, in drawing order
+	c3bvh_t				bvh;		// of 'gathered', for culling
+	c3geometry_array_t	projected;	// 'sorted', minus what's out of view
+	c3geometry_array_t	scratch;	// for regathering, keeps it's size
 	struct {
 		c3f min, max;
 	} z;
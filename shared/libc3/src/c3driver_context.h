@@ -55,6 +55,14 @@ typedef struct c3driver_context_t {
 			struct c3context_t * c,
 			const struct c3driver_context_t *d,
 			struct c3context_view_t * ctx);
+	/*
+	 * Called when done drawing a context view, to restore any state
+	 * kept across the geometries
+	 */
+	void (*context_view_draw_done)(
+			struct c3context_t * c,
+			const struct c3driver_context_t *d,
+			struct c3context_view_t * ctx);
 
 	/*
 	 * called when a geometry is disposed of, let the application
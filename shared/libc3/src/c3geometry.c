@@ -21,6 +21,8 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "c3object.h"
 #include "c3context.h"
@@ -78,8 +80,19 @@ _c3geometry_project(
 	}
 	/* else -- do not clear bbox on purged arrays */
 
-	g->wbbox.max = c3mat4_mulv3(m, g->bbox.max);
-	g->wbbox.min = c3mat4_mulv3(m, g->bbox.min);
+	/* all the corners, once rotated min and max are not the extremes */
+	for (int i = 0; i < 8; i++) {
+		c3vec3 c = c3mat4_mulv3(m, c3vec3f(
+				i & 1 ? g->bbox.max.x : g->bbox.min.x,
+				i & 2 ? g->bbox.max.y : g->bbox.min.y,
+				i & 4 ? g->bbox.max.z : g->bbox.min.z));
+		if (i == 0)
+			g->wbbox.min = g->wbbox.max = c;
+		else {
+			g->wbbox.min = c3vec3_min(g->wbbox.min, c);
+			g->wbbox.max = c3vec3_max(g->wbbox.max, c);
+		}
+	}
 
 	if (g->object && g->object->context)
 		C3_DRIVER(g->object->context, geometry_project, g, m);
@@ -130,6 +143,46 @@ c3geometry_init(
 	return g;
 }
 
+int
+c3geometry_merge(
+		c3geometry_p dst,
+		c3geometry_p src )
+{
+	if (dst->bid || src->bid ||
+			!dst->textures.count != !src->textures.count ||
+			!dst->normals.count != !src->normals.count ||
+			!dst->colorf.count != !src->colorf.count)
+		return -1;
+	int indexed = dst->indices.count || src->indices.count;
+	// check in 32 bits, the sum can wrap a c3index_t
+	uint32_t total = (uint32_t)dst->vertice.count + src->vertice.count;
+	if (indexed && total > (c3index_t)~0)
+		return -1;
+	uint32_t base = dst->vertice.count;
+
+	// if only one was indexed, the other needs them too
+	if (indexed && !dst->indices.count)
+		for (uint32_t i = 0; i < base; i++)
+			c3indices_array_add(&dst->indices, i);
+	if (src->indices.count) {
+		for (int i = 0; i < src->indices.count; i++)
+			c3indices_array_add(&dst->indices, base + src->indices.e[i]);
+	} else if (indexed)
+		for (int i = 0; i < src->vertice.count; i++)
+			c3indices_array_add(&dst->indices, base + i);
+
+	c3vertex_array_insert(&dst->vertice, dst->vertice.count,
+			src->vertice.e, src->vertice.count);
+	c3tex_array_insert(&dst->textures, dst->textures.count,
+			src->textures.e, src->textures.count);
+	c3vertex_array_insert(&dst->normals, dst->normals.count,
+			src->normals.e, src->normals.count);
+	c3colorf_array_insert(&dst->colorf, dst->colorf.count,
+			src->colorf.e, src->colorf.count);
+	c3geometry_set_dirty(dst, 1);
+	return 0;
+}
+
 c3driver_geometry_p
 c3geometry_get_custom(
 		c3geometry_p g )
@@ -172,6 +225,46 @@ c3geometry_draw(
 	C3_DRIVER(g, draw);
 }
 
+/*
+ * Spatial hash for c3geometry_factor; the cells are 'tolerance' wide so
+ * a vertex can only match the output vertices in its cell and the 26
+ * around it. Cells that collide in a bucket are just more candidates.
+ */
+typedef struct c3weld_t {
+	c3f			cell;
+	uint32_t	mask;
+	int *		bucket;		// first output vertex in the bucket, or -1
+	int *		next;		// next output vertex in the same bucket
+} c3weld_t;
+
+static inline uint32_t
+_c3weld_hash(
+		c3weld_t * w,
+		int x, int y, int z)
+{
+	return ((x * 73856093u) ^ (y * 19349663u) ^ (z * 83492791u)) & w->mask;
+}
+
+static inline int
+_c3weld_cell(
+		c3weld_t * w,
+		c3f v)
+{
+	return (int)floorf(v / w->cell);
+}
+
+static void
+_c3weld_add(
+		c3weld_t * w,
+		c3vec3 v,
+		int index)
+{
+	uint32_t h = _c3weld_hash(w,
+			_c3weld_cell(w, v.x), _c3weld_cell(w, v.y), _c3weld_cell(w, v.z));
+	w->next[index] = w->bucket[h];
+	w->bucket[h] = index;
+}
+
 void
 c3geometry_factor(
 		c3geometry_p g,
@@ -188,35 +281,61 @@ c3geometry_factor(
 	int vcount = in_index ? in_index : g->vertice.count;
 	int input = 0;
 	int output = 0;
+
+	c3weld_t w = { .cell = tolerance > 0 ? tolerance : 1 };
+	uint32_t buckets = 64;
+	while (buckets < 2 * vcount)
+		buckets <<= 1;
+	w.mask = buckets - 1;
+	w.bucket = malloc(buckets * sizeof(w.bucket[0]));
+	w.next = malloc((vcount + 1) * sizeof(w.next[0]));
+	memset(w.bucket, 0xff, buckets * sizeof(w.bucket[0]));
+
 	g->indices.count = 0;
+	if (g->indices.size <= vcount)
+		c3indices_array_realloc(&g->indices, vcount + 1);
 	while (input < vcount) {
 		int current = in_index ? g->indices.e[input] : input;
 		c3vec3 v = g->vertice.e[current];
 		c3vec3 n = g->normals.count ? g->normals.e[current] : c3vec3f(0,0,0);
 		c3vec3 np = c3vec3_polar(n);	// normal in polar coord
 
+		/*
+		 * Keep the lowest matching index, the buckets aren't in order,
+		 * so that it gives the same result as looking at all of them
+		 */
 		int oi = -1;
-		for (int ci = 0; ci < output && oi == -1; ci++)
-			if (c3vec3_length2(c3vec3_sub(g->vertice.e[ci], v)) < tolerance2) {
+		int cx = _c3weld_cell(&w, v.x), cy = _c3weld_cell(&w, v.y),
+			cz = _c3weld_cell(&w, v.z);
+		for (int dz = -1; dz <= 1; dz++)
+		for (int dy = -1; dy <= 1; dy++)
+		for (int dx = -1; dx <= 1; dx++) {
+			uint32_t h = _c3weld_hash(&w, cx + dx, cy + dy, cz + dz);
+			for (int ci = w.bucket[h]; ci != -1; ci = w.next[ci]) {
+				if (oi != -1 && ci >= oi)
+					continue;
+				if (c3vec3_length2(c3vec3_sub(g->vertice.e[ci], v)) >= tolerance2)
+					continue;
 				if (g->normals.count) {
-					c3vec3 nc = g->normals.e[ci];
-					c3vec3 pc = c3vec3_polar(nc);
+					c3vec3 pc = c3vec3_polar(g->normals.e[ci]);
 
 					c3vec3 d = c3vec3_sub(np, pc);
 					while (d.n[0] <= -M_PI) d.n[0] += (2*M_PI);
 					while (d.n[1] <= -M_PI) d.n[1] += (2*M_PI);
 
 					if (fabs(d.n[0]) < normaltolerance &&
-							fabs(d.n[1]) < normaltolerance) {
+							fabs(d.n[1]) < normaltolerance)
 						oi = ci;
-						// replace the compared normal with the 'merged' one
-						// that should hopefully trim it to the right direction
-						// somehow. Not perfect obviously
-						g->normals.e[ci] = c3vec3_add(n, nc);
-					}
 				} else
 					oi = ci;
 			}
+		}
+		if (oi != -1 && g->normals.count) {
+			// replace the compared normal with the 'merged' one
+			// that should hopefully trim it to the right direction
+			// somehow. Not perfect obviously
+			g->normals.e[oi] = c3vec3_add(n, g->normals.e[oi]);
+		}
 		if (oi == -1) {
 			oi = output;
 			g->vertice.e[output] = g->vertice.e[current];
@@ -226,11 +345,14 @@ c3geometry_factor(
 				g->normals.e[output] = n;
 			if (g->colorf.count)
 				g->colorf.e[output] = g->colorf.e[current];
+			_c3weld_add(&w, v, output);
 			output++;
 		}
 		c3indices_array_add(&g->indices, oi);
 		input++;
 	}
+	free(w.bucket);
+	free(w.next);
 	g->vertice.count = output;
 	c3vertex_array_realloc(&g->vertice, output);
 	if (g->textures.count) {
@@ -100,7 +100,8 @@ typedef struct c3geometry_t {
 	int					dirty : 1,
 						debug : 1,
 						custom : 1,		// has a custom driver
-						hidden : 8;		// hidden from context_view, bitfield
+						hidden : 8,		// hidden from context_view, bitfield
+						visible : 8;	// in context_view frustum, bitfield
 	str_p 				name;	// optional
 	c3apiobject_t 		bid;	// buffer id for opengl
 
@@ -185,6 +186,8 @@ c3geometry_set_dirty(
  * are averaged.
  * This code allows smooth rendering of STL files generated by
  * CAD programs that generate only triangle normals.
+ * The candidates are found with a spatial hash, so it's linear with the
+ * number of vertices.
  */
 void
 c3geometry_factor(
@@ -192,6 +195,18 @@ c3geometry_factor(
 		c3f tolerance,
 		c3f normaltolerance);
 
+//! Appends the vertices (and the rest) of 'src' to 'dst'
+/*!
+ * Both have to be in the same space, and not uploaded yet. Returns -1
+ * (and leaves 'dst' alone) if they don't have the same attributes, or if
+ * the result would not fit the indices.
+ * 'src' is left as is, it's up to the caller to dispose of it.
+ */
+int
+c3geometry_merge(
+		c3geometry_p dst,
+		c3geometry_p src );
+
 //! allocate (if not there) and return a custom driver for this geometry
 /*!
  * Geometries come with a default, read only driver stack.. It is a constant
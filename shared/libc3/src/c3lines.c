@@ -114,9 +114,13 @@ c3lines_init(
 		size_t		count,
 		c3f 		lineWidth)
 {
-	c3mat4 i = identity3D();
-	c3lines_prepare(vertices, count, &g->vertice, &g->textures, lineWidth, &i);
+	c3vertex_array_clear(&g->vertice);
+	c3vertex_array_insert(&g->vertice, 0, vertices, count & ~1);
+	c3tex_array_clear(&g->textures);
+	g->line.width = lineWidth;
 	g->type.type = C3_LINES_TYPE;
+	g->vertice.buffer.dirty = 1;
+	c3geometry_set_dirty(g, 1);
 }
 
 #if 0
@@ -47,6 +47,12 @@ c3lines_prepare(
 		c3f lineWidth,
 		c3mat4p m);
 
+/*
+ * Sets the lines of 'g'. The A,B pairs are kept as they are, the driver
+ * expands them when drawing (the GL one does it in a vertex shader, one
+ * instance per segment). Can be called again to replace the lines; make
+ * the vertices 'mutable' if that happens often.
+ */
 void
 c3lines_init(
 		c3geometry_p g,
@@ -21,21 +21,385 @@
 
 
 #include <stdio.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "c3algebra.h"
 #include "c3geometry.h"
 #include "c3object.h"
 #include "c3model_obj.h"
 
+/*
+ * The file is mapped, and parsed in three passes over chunks of it:
+ * the first one counts what's there, so the arrays are allocated once,
+ * the second one reads the v/vt/vn and the last one the faces, once all
+ * the vertices they can refer to are there. Big files have their chunks
+ * parsed in parallel, each chunk knows where its output goes.
+ * The offsets also are the v/vt/vn counts at the start of the chunk, so
+ * the faces pass can keep them up to date line by line, for the negative
+ * (relative) indices.
+ */
+#define C3OBJ_CHUNK_MIN		(1 << 20)	// bytes, per thread
+#define C3OBJ_THREADS_MAX	8
+
+typedef struct c3obj_chunk_t {
+	const char *	start, * end;
+	struct c3obj_parse_t * p;
+	// counts, then offsets in the arrays after the first pass
+	uint32_t		v, vt, vn, tri;
+	uint32_t		unknown;
+	unsigned int	has_t : 1, has_n : 1, zero_n : 1;
+	const char *	g_name, * o_name;	// last of them, if any
+	c3bbox_t		bbox;
+} c3obj_chunk_t;
+
+typedef struct c3obj_parse_t {
+	c3geometry_p	store, g;
+	int				has_t, has_n;
+	int				n_base;		// first normal index, see below
+	int				count;
+	c3obj_chunk_t	chunk[C3OBJ_THREADS_MAX];
+} c3obj_parse_t;
+
+static const char *
+_c3obj_skip(
+		const char * s,
+		const char * e)
+{
+	while (s < e && *s <= ' ')
+		s++;
+	return s;
+}
+
+static const char *
+_c3obj_float(
+		const char * s,
+		const char * e,
+		c3f * out)
+{
+	static const double p10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+		1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+	};
+	s = _c3obj_skip(s, e);
+	int neg = 0;
+	if (s < e && (*s == '-' || *s == '+'))
+		neg = *s++ == '-';
+	uint64_t m = 0;
+	int digits = 0, exp = 0;
+	for (; s < e && *s >= '0' && *s <= '9'; s++)
+		if (digits < 18) {
+			m = m * 10 + (*s - '0');
+			if (m) digits++;
+		} else
+			exp++;
+	if (s < e && *s == '.')
+		for (s++; s < e && *s >= '0' && *s <= '9'; s++)
+			if (digits < 18) {
+				m = m * 10 + (*s - '0');
+				if (m) digits++;
+				exp--;
+			}
+	if (s < e && (*s == 'e' || *s == 'E')) {
+		int eneg = 0, ev = 0;
+		s++;
+		if (s < e && (*s == '-' || *s == '+'))
+			eneg = *s++ == '-';
+		for (; s < e && *s >= '0' && *s <= '9'; s++)
+			if (ev < 1000)
+				ev = ev * 10 + (*s - '0');
+		exp += eneg ? -ev : ev;
+	}
+	double r = m;
+	if (exp < 0)
+		r = exp < -18 ? r / pow(10, -exp) : r / p10[-exp];
+	else if (exp > 0)
+		r = exp > 18 ? r * pow(10, exp) : r * p10[exp];
+	*out = neg ? -r : r;
+	return s;
+}
+
+static const char *
+_c3obj_int(
+		const char * s,
+		const char * e,
+		int * out)
+{
+	int neg = 0, r = 0;
+	if (s < e && *s == '-') {
+		neg = 1;
+		s++;
+	}
+	for (; s < e && *s >= '0' && *s <= '9'; s++)
+		r = r * 10 + (*s - '0');
+	*out = neg ? -r : r;
+	return s;
+}
+
+/*
+ * Splits the next line of 'c' out of '*l'; 'kw' is the keyword, 's' is
+ * just after it, and 'e' is the end of the line
+ */
+static int
+_c3obj_line(
+		c3obj_chunk_t * c,
+		const char ** l,
+		const char ** kw,
+		const char ** s,
+		const char ** e)
+{
+	if (*l >= c->end)
+		return 0;
+	*e = memchr(*l, '\n', c->end - *l);
+	if (!*e)
+		*e = c->end;
+	*kw = *s = _c3obj_skip(*l, *e);
+	while (*s < *e && **s > ' ')
+		(*s)++;
+	*l = *e < c->end ? *e + 1 : c->end;
+	return 1;
+}
+
+static int
+_c3obj_is(
+		const char * kw,
+		const char * s,
+		const char * k)
+{
+	int l = strlen(k);
+	return s - kw == l && !memcmp(kw, k, l);
+}
+
+static void
+_c3obj_count(
+		c3obj_chunk_t * c)
+{
+	const char * l = c->start;
+	const char * kw, * s, * e;
+	while (_c3obj_line(c, &l, &kw, &s, &e)) {
+		if (s == kw || *kw == '#')
+			;
+		else if (_c3obj_is(kw, s, "v"))
+			c->v++;
+		else if (_c3obj_is(kw, s, "vt"))
+			c->vt++;
+		else if (_c3obj_is(kw, s, "vn"))
+			c->vn++;
+		else if (_c3obj_is(kw, s, "f")) {
+			int corners = 0;
+			for (s = _c3obj_skip(s, e); s < e; s = _c3obj_skip(s, e)) {
+				int slash = 0;
+				const char * ns = NULL;
+				for (; s < e && *s > ' '; s++)
+					if (*s == '/') {
+						slash++;
+						if (slash == 1 && s + 1 < e && s[1] > ' ' && s[1] != '/')
+							c->has_t = 1;
+						if (slash == 2)
+							ns = s + 1;
+					}
+				if (ns && ns < s) {
+					c->has_n = 1;
+					if (*ns == '0' && ns + 1 == s)
+						c->zero_n = 1;
+				}
+				corners++;
+			}
+			if (corners >= 3)
+				c->tri += corners - 2;
+		} else if (_c3obj_is(kw, s, "g"))
+			c->g_name = _c3obj_skip(s, e);
+		else if (_c3obj_is(kw, s, "o"))
+			c->o_name = _c3obj_skip(s, e);
+		else
+			c->unknown++;
+	}
+}
+
+static void
+_c3obj_read_vertices(
+		c3obj_chunk_t * c)
+{
+	c3obj_parse_t * p = c->p;
+	uint32_t v = c->v, vt = c->vt, vn = c->vn;
+	const char * l = c->start;
+	const char * kw, * s, * e;
+	while (_c3obj_line(c, &l, &kw, &s, &e)) {
+		if (s == kw || s - kw > 2 || *kw != 'v')
+			continue;
+
+		char type = s - kw > 1 ? kw[1] : 0;
+		c3vec3 r = c3vec3f(0, 0, 0);
+		for (int ci = 0; ci < 3; ci++)
+			s = _c3obj_float(s, e, &r.n[ci]);
+		switch (type) {
+			case 0:
+				if (v == c->v)
+					c->bbox.min = c->bbox.max = r;
+				else {
+					c->bbox.min = c3vec3_min(c->bbox.min, r);
+					c->bbox.max = c3vec3_max(c->bbox.max, r);
+				}
+				p->store->vertice.e[v++] = r;
+				break;
+			case 'n':
+				p->store->normals.e[vn++] = r;
+				break;
+			case 't':
+				p->store->textures.e[vt++] = c3vec2f(r.x, r.y);
+				break;
+		}
+	}
+}
+
+/*
+ * Resolves a 'base' based index to one of the 'count' elements. Negative
+ * ones are relative to 'seen', the number of them defined before the
+ * line. Bad ones are clamped.
+ */
+static inline uint32_t
+_c3obj_index(
+		int i,
+		int base,
+		uint32_t seen,
+		uint32_t count)
+{
+	int r = i < 0 ? (int)seen + i : i - base;
+	return r < 0 ? 0 : r >= (int)count ? count - 1 : r;
+}
+
+static void
+_c3obj_read_faces(
+		c3obj_chunk_t * c)
+{
+	c3obj_parse_t * p = c->p;
+	c3geometry_p g = p->g, store = p->store;
+	uint32_t o = c->tri * 3;
+	uint32_t v_seen = c->v, vt_seen = c->vt, vn_seen = c->vn;
+	const char * l = c->start;
+	const char * kw, * s, * e;
+	while (_c3obj_line(c, &l, &kw, &s, &e)) {
+		if (_c3obj_is(kw, s, "v"))
+			v_seen++;
+		else if (_c3obj_is(kw, s, "vt"))
+			vt_seen++;
+		else if (_c3obj_is(kw, s, "vn"))
+			vn_seen++;
+		if (!_c3obj_is(kw, s, "f"))
+			continue;
+
+		struct { int v, t, n; } corner[3];
+		int ci = 0;
+		for (s = _c3obj_skip(s, e); s < e; s = _c3obj_skip(s, e)) {
+			int v = 0, t = 0, n = 0;
+			s = _c3obj_int(s, e, &v);
+			if (s < e && *s == '/') {
+				s = _c3obj_int(s + 1, e, &t);
+				if (s < e && *s == '/')
+					s = _c3obj_int(s + 1, e, &n);
+			}
+			while (s < e && *s > ' ')
+				s++;
+			// polygons are made into a fan of triangles
+			if (ci == 3) {
+				corner[1] = corner[2];
+				ci = 2;
+			}
+			corner[ci].v = v; corner[ci].t = t; corner[ci].n = n;
+			if (++ci < 3)
+				continue;
+			for (int i = 0; i < 3; i++, o++) {
+				g->vertice.e[o] = store->vertice.e[_c3obj_index(corner[i].v, 1,
+						v_seen, store->vertice.count)];
+				if (p->has_t)
+					g->textures.e[o] = store->textures.count ?
+						store->textures.e[_c3obj_index(corner[i].t, 1,
+								vt_seen, store->textures.count)] : c3vec2f(0, 0);
+				if (p->has_n)
+					g->normals.e[o] = store->normals.count ?
+						store->normals.e[_c3obj_index(corner[i].n, p->n_base,
+								vn_seen, store->normals.count)] : c3vec3f(0, 0, 1);
+			}
+		}
+	}
+}
+
+static void *
+_c3obj_thread(
+		void * param)
+{
+	void (*pass)(c3obj_chunk_t *) = ((void **)param)[0];
+	pass(((void **)param)[1]);
+	return NULL;
+}
+
+static void
+_c3obj_pass(
+		c3obj_parse_t * p,
+		void (*pass)(c3obj_chunk_t *))
+{
+	if (p->count == 1) {
+		pass(&p->chunk[0]);
+		return;
+	}
+	pthread_t	thread[C3OBJ_THREADS_MAX];
+	void *		param[C3OBJ_THREADS_MAX][2];
+	int started = 0;
+	for (int ci = 1; ci < p->count; ci++) {
+		param[ci][0] = pass;
+		param[ci][1] = &p->chunk[ci];
+		if (pthread_create(&thread[ci], NULL, _c3obj_thread, param[ci]))
+			break;
+		started = ci;
+	}
+	// this one does the first chunk, and any that didn't get a thread
+	pass(&p->chunk[0]);
+	for (int ci = started + 1; ci < p->count; ci++)
+		pass(&p->chunk[ci]);
+	for (int ci = 1; ci <= started; ci++)
+		pthread_join(thread[ci], NULL);
+}
+
+static str_p
+_c3obj_name(
+		const char * s,
+		const char * end)
+{
+	const char * e = s;
+	while (e < end && *e > ' ')
+		e++;
+	str_p r = str_alloc(e - s);
+	memcpy(r->str, s, e - s);
+	r->str[e - s] = 0;
+	return r;
+}
+
 struct c3object_t *
 c3obj_load(
 		const char * filename,
 		struct c3object_t * parent)
 {
-	FILE *f = fopen(filename, "r");
-	if (!f) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
 		perror(filename);
 		return NULL;
 	}
+	struct stat st;
+	const char * base = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED) {
+			perror(filename);
+			base = NULL;
+		}
+	}
+	close(fd);
+	if (!base)
+		return NULL;
+	const char * end = base + st.st_size;
 
 	c3object_p		o = c3object_new(parent);
 	c3geometry_p	store = c3geometry_new(c3geometry_type(0, 0), NULL);
@@ -43,78 +407,101 @@ c3obj_load(
 
 	o->name = str_new(filename);
 
-	while (!feof(f)) {
-		char line[256];
+	c3obj_parse_t p = { .store = store, .g = g, .n_base = 1 };
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	p.count = st.st_size / C3OBJ_CHUNK_MIN;
+	if (p.count > cpus)
+		p.count = cpus;
+	if (p.count > C3OBJ_THREADS_MAX)
+		p.count = C3OBJ_THREADS_MAX;
+	if (p.count < 1)
+		p.count = 1;
+	// cut at line boundaries
+	const char * s = base;
+	for (int ci = 0; ci < p.count; ci++) {
+		c3obj_chunk_t * c = &p.chunk[ci];
+		const char * e = ci == p.count - 1 ? end :
+				base + (st.st_size / p.count) * (ci + 1);
+		if (e < s)
+			e = s;
+		const char * nl = e < end ? memchr(e, '\n', end - e) : NULL;
+		c->start = s;
+		c->end = nl ? nl + 1 : end;
+		c->p = &p;
+		s = c->end;
+	}
 
-		fgets(line, sizeof(line), f);
+	_c3obj_pass(&p, _c3obj_count);
 
-		int l = strlen(line);
-		while (l && line[l-1] < ' ')
-			line[--l] = 0;
-		if (!l)
-			continue;
-		char * base = line;
-		while (*base && *base <= ' ')
-			base++;
-		if (*base == '#')
+	uint32_t v = 0, vt = 0, vn = 0, tri = 0, unknown = 0;
+	const char * g_name = NULL, * o_name = NULL;
+	for (int ci = 0; ci < p.count; ci++) {
+		c3obj_chunk_t * c = &p.chunk[ci];
+		uint32_t n;
+		n = c->v;	c->v = v;	v += n;
+		n = c->vt;	c->vt = vt;	vt += n;
+		n = c->vn;	c->vn = vn;	vn += n;
+		n = c->tri;	c->tri = tri;	tri += n;
+		unknown += c->unknown;
+		p.has_t |= c->has_t;
+		p.has_n |= c->has_n;
+		/*
+		 * Some exporters (RoadKill, that made the nozzle) count the
+		 * normals from 0, one '0' normal index is enough to tell
+		 */
+		if (c->zero_n)
+			p.n_base = 0;
+		if (c->g_name)
+			g_name = c->g_name;
+		if (c->o_name)
+			o_name = c->o_name;
+	}
+	if (unknown)
+		printf("%s %s ignored %d lines with unknown keywords\n",
+				__func__, filename, unknown);
+
+	c3vertex_array_realloc(&store->vertice, v + 1);
+	store->vertice.count = v;
+	c3tex_array_realloc(&store->textures, vt + 1);
+	store->textures.count = vt;
+	c3vertex_array_realloc(&store->normals, vn + 1);
+	store->normals.count = vn;
+	_c3obj_pass(&p, _c3obj_read_vertices);
+
+	for (int ci = 0, first = 1; ci < p.count; ci++) {
+		c3obj_chunk_t * c = &p.chunk[ci];
+		uint32_t next = ci < p.count - 1 ? p.chunk[ci+1].v : v;
+		if (c->v == next)
 			continue;
-		l = strlen(base);
-
-		char * keyword = strsep(&base, " ");
-
-		if (!strcmp(keyword, "v") || !strcmp(keyword, "vn") || !strcmp(keyword, "vt")) {
-			c3vec3 v;
-			int ci = 0;
-			char * cs;
-			while ((cs = strsep(&base, " ")) != NULL && ci < 3)
-				sscanf(cs, "%f", &v.n[ci++]);
-
-			switch (keyword[1]) {
-				case 0:
-					c3vertex_array_add(&store->vertice, v);
-					if (store->vertice.count == 0)
-						g->bbox.min = g->bbox.max = v;
-					else {
-						g->bbox.min = c3vec3_min(g->bbox.min, v);
-						g->bbox.max = c3vec3_max(g->bbox.max, v);
-					}
-					break;
-				case 'n':
-					c3vertex_array_add(&store->normals, v);
-					break;
-				case 't':
-					c3tex_array_add(&store->textures, c3vec2f(v.x, v.y));
-					break;
-			}
-		} else if (!strcmp(keyword, "f")) {
-			char * cs;
-			while ((cs = strsep(&base, " ")) != NULL) {
-				int vi, ti, ni;
-				if (sscanf(cs, "%d/%d/%d", &vi, &ti, &ni) == 3) {
-					c3vertex_array_add(&g->vertice, store->vertice.e[vi - 1]);
-					c3tex_array_add(&g->textures, store->textures.e[ti - 1]);
-					c3vertex_array_add(&g->normals, store->normals.e[ni]);
-				} else if (sscanf(cs, "%d/%d", &vi,&ti) == 2) {
-					c3vertex_array_add(&g->vertice, store->vertice.e[vi - 1]);
-					c3tex_array_add(&g->textures, store->textures.e[ti - 1]);
-				} else if (sscanf(cs, "%d//%d", &vi,&ni) == 2) {
-					c3vertex_array_add(&g->vertice, store->vertice.e[vi - 1]);
-					c3vertex_array_add(&g->normals, store->normals.e[ni]);
-				} else if (*cs){
-					printf("%s: unknown facet format '%s'\n", filename, cs);
-				}
-			}
-		} else if (!strcmp(keyword, "g")) {
-			char * cs = strsep(&base, " ");
-			g->name = str_new(cs);
-		} else if (!strcmp(keyword, "o")) {
-			char * cs = strsep(&base, " ");
-			o->name = str_new(cs);
-		} else {
-			printf("%s %s unknpwn keyword '%s'\n", __func__, filename, keyword);
+		if (first)
+			g->bbox = c->bbox;
+		else {
+			g->bbox.min = c3vec3_min(g->bbox.min, c->bbox.min);
+			g->bbox.max = c3vec3_max(g->bbox.max, c->bbox.max);
 		}
+		first = 0;
+	}
+
+	if (v) {
+		c3vertex_array_realloc(&g->vertice, tri * 3 + 1);
+		g->vertice.count = tri * 3;
+		if (p.has_t) {
+			c3tex_array_realloc(&g->textures, tri * 3 + 1);
+			g->textures.count = tri * 3;
+		}
+		if (p.has_n) {
+			c3vertex_array_realloc(&g->normals, tri * 3 + 1);
+			g->normals.count = tri * 3;
+		}
+		_c3obj_pass(&p, _c3obj_read_faces);
+	}
+	if (g_name)
+		g->name = _c3obj_name(g_name, end);
+	if (o_name) {
+		str_free(o->name);
+		o->name = _c3obj_name(o_name, end);
 	}
-	fclose(f);
+	munmap((void*)base, st.st_size);
 	c3geometry_dispose(store);
 
 	printf("%s %s(%p) bbox = %.2f %.2f %.2f - %.2f %.2f %.2f\n",
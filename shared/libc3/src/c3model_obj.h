@@ -29,7 +29,9 @@ extern "C" {
 
 /*
  * Loads a OBJ file as a c3object with
- * a set of c3geometries with the triangles
+ * a set of c3geometries with the triangles. Polygons are made into
+ * triangle fans. The file is mapped, and big ones are parsed by
+ * several threads.
  */
 struct c3object_t *
 c3obj_load(
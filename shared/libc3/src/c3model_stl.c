@@ -20,6 +20,10 @@
  */
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "c3algebra.h"
 #include "c3geometry.h"
 #include "c3object.h"
@@ -51,8 +55,8 @@ _c3stl_read_vertex(
 	return res;
 }
 
-struct c3object_t *
-c3stl_load(
+static c3object_p
+_c3stl_load_ascii(
 		const char * filename,
 		c3object_p parent)
 {
@@ -137,3 +141,143 @@ c3stl_load(
 	fclose(f);
 	return o;
 }
+
+/*
+ * c3index_t is 16 bits, so when welding, the triangles are split in
+ * geometries that can't have more vertices than that, even unwelded
+ */
+#define C3STL_WELD_TRIANGLES	(0xffff / 3)
+
+/*
+ * Binary STL: 80 bytes of header, a 32 bits triangle count, then 50
+ * bytes per triangle; the normal, the 3 vertices, and 16 bits of
+ * 'attribute'. All little endian, like the machines we run on.
+ */
+static c3object_p
+_c3stl_load_binary(
+		const char * filename,
+		const uint8_t * base,
+		uint32_t count,
+		c3object_p parent,
+		int weld)
+{
+	c3object_p		o = c3object_new(parent);
+	c3geometry_p	g = NULL;
+	o->name = str_new(filename);
+
+	// the header is often "solid <name>", or garbage
+	char name[81];
+	int nl = 0;
+	while (nl < 80 && base[nl] >= ' ' && base[nl] < 0x7f)
+		name[nl] = base[nl], nl++;
+	while (nl && name[nl-1] == ' ')
+		nl--;
+	name[nl] = 0;
+
+	const uint8_t * t = base + 84;
+	for (uint32_t ti = 0; ti < count; ti++, t += 50) {
+		if (!g) {
+			uint32_t left = count - ti;
+			if (weld && left > C3STL_WELD_TRIANGLES)
+				left = C3STL_WELD_TRIANGLES;
+			g = c3geometry_new(c3geometry_type(C3_TRIANGLE_TYPE, 0), o);
+			if (nl)
+				g->name = str_new(name);
+			g->dirty = 1;
+			c3vertex_array_realloc(&g->vertice, left * 3 + 1);
+			c3vertex_array_realloc(&g->normals, left * 3 + 1);
+		}
+		float f[12];
+		memcpy(f, t, sizeof(f));
+		c3vec3 v[3] = {
+			c3vec3f(f[3], f[4], f[5]),
+			c3vec3f(f[6], f[7], f[8]),
+			c3vec3f(f[9], f[10], f[11]),
+		};
+		c3vec3 normal = c3vec3f(f[0], f[1], f[2]);
+		// plenty of exporters don't bother with the normal
+		if (c3vec3_length2(normal) == 0) {
+			normal = c3vec3_cross(
+					c3vec3_sub(v[1], v[0]), c3vec3_sub(v[2], v[0]));
+			// zero area facets have no normal either, don't make a NaN
+			normal = c3vec3_length2(normal) == 0 ?
+					c3vec3f(0, 0, 1) : c3vec3_normalize(normal);
+		}
+		for (int i = 0; i < 3; i++) {
+			if (g->vertice.count == 0)
+				g->bbox.min = g->bbox.max = v[i];
+			else {
+				g->bbox.min = c3vec3_min(g->bbox.min, v[i]);
+				g->bbox.max = c3vec3_max(g->bbox.max, v[i]);
+			}
+			g->vertice.e[g->vertice.count++] = v[i];
+			g->normals.e[g->normals.count++] = normal;
+		}
+		if (g->vertice.count == g->vertice.size - 1)
+			g = NULL;
+	}
+	printf("%s loaded %d triangles in %d geometries\n",
+			filename, count, o->geometry.count);
+	return o;
+}
+
+struct c3object_t *
+c3stl_load_factor(
+		const char * filename,
+		c3object_p parent,
+		c3f tolerance,
+		c3f normaltolerance)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		perror(filename);
+		return NULL;
+	}
+	struct stat st;
+	const uint8_t * base = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size >= 84) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+			base = NULL;
+	}
+	close(fd);
+
+	/*
+	 * ASCII files start with "solid", but so do plenty of binary ones,
+	 * the size is a better tell
+	 */
+	c3object_p o = NULL;
+	if (base) {
+		uint32_t count;
+		memcpy(&count, base + 80, sizeof(count));
+		if (84 + (uint64_t)count * 50 == (uint64_t)st.st_size) {
+			madvise((void*)base, st.st_size, MADV_SEQUENTIAL);
+			o = _c3stl_load_binary(filename, base, count, parent,
+					tolerance > 0);
+		}
+		munmap((void*)base, st.st_size);
+	}
+	if (!o)
+		o = _c3stl_load_ascii(filename, parent);
+	if (!o || tolerance <= 0)
+		return o;
+
+	for (int gi = 0; gi < o->geometry.count; gi++) {
+		c3geometry_p g = o->geometry.e[gi];
+		if (g->vertice.count > C3STL_WELD_TRIANGLES * 3) {
+			printf("%s %s: too many vertices to weld (%d)\n", __func__,
+					filename, g->vertice.count);
+			continue;
+		}
+		c3geometry_factor(g, tolerance, normaltolerance);
+	}
+	return o;
+}
+
+struct c3object_t *
+c3stl_load(
+		const char * filename,
+		c3object_p parent)
+{
+	return c3stl_load_factor(filename, parent, 0, 0);
+}
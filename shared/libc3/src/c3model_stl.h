@@ -23,19 +23,34 @@
 #ifndef __C3STL_H___
 #define __C3STL_H___
 
+#include "c3algebra.h"
+
 #if __cplusplus
 extern "C" {
 #endif
 
 /*
- * Loads an ASCII (TODO: Load STL Binary?) STL file as a c3object with
- * a set of c3geometries with the triangles
+ * Loads an ASCII or binary STL file as a c3object with
+ * a set of c3geometries with the triangles. Binary files are mapped and
+ * read straight into the arrays.
  */
 struct c3object_t *
 c3stl_load(
 		const char * filename,
 		struct c3object_t * parent);
 
+/*
+ * Same as c3stl_load, then welds the vertices into indexed geometries
+ * with c3geometry_factor() if 'tolerance' is > 0. Binary files are split
+ * in geometries small enough for 16 bits indexes.
+ */
+struct c3object_t *
+c3stl_load_factor(
+		const char * filename,
+		struct c3object_t * parent,
+		c3f tolerance,
+		c3f normaltolerance);
+
 #if __cplusplus
 }
 #endif
@@ -23,6 +23,9 @@
 #include "c3object.h"
 #include "c3context.h"
 #include "c3driver_object.h"
+#include "c3light.h"
+#include "c3lines.h"
+#include "c3texture.h"
 
 void
 _c3object_clear(
@@ -229,6 +232,59 @@ c3object_add_geometry(
 	}
 }
 
+static int
+_c3object_batchable(
+		c3geometry_p g)
+{
+	return !g->bid && !g->custom && !g->debug &&
+			g->type.type != C3_LIGHT_TYPE &&
+			g->type.type != C3_TEXTURE_TYPE &&
+			!g->vertice.buffer.mutable && !g->indices.buffer.mutable &&
+			g->vertice.count && g->vertice.e;
+}
+
+static int
+_c3object_batch_same(
+		c3geometry_p g1,
+		c3geometry_p g2)
+{
+	return g1->type.type == g2->type.type &&
+			g1->driver == g2->driver &&
+			g1->hidden == g2->hidden &&
+			c3vec4_equal(g1->mat.color, g2->mat.color) &&
+			g1->mat.shininess == g2->mat.shininess &&
+			g1->mat.texture == g2->mat.texture &&
+			g1->mat.program == g2->mat.program &&
+			g1->mat.blend.src == g2->mat.blend.src &&
+			g1->mat.blend.dst == g2->mat.blend.dst &&
+			(g1->type.type != C3_LINES_TYPE || g1->line.width == g2->line.width);
+}
+
+int
+c3object_batch(
+		c3object_p o )
+{
+	int res = 0;
+	for (int i = 0; i < o->geometry.count; i++) {
+		c3geometry_p g = o->geometry.e[i];
+		if (!_c3object_batchable(g))
+			continue;
+		for (int j = i + 1; j < o->geometry.count; j++) {
+			c3geometry_p s = o->geometry.e[j];
+			if (!_c3object_batchable(s) || !_c3object_batch_same(g, s) ||
+					c3geometry_merge(g, s))
+				continue;
+			// disposing detaches it from 'o'
+			c3vertex_array_free(&s->normals);
+			c3indices_array_free(&s->indices);
+			c3geometry_dispose(s);
+			j--;
+			res++;
+		}
+	}
+	return res;
+}
+
 void
 c3object_get_geometry(
 		c3object_p o,
@@ -103,6 +103,16 @@ c3object_add_object(
 c3transform_p
 c3object_add_transform(
 		c3object_p o );
+//! Merges the geometries of 'o' that share a type and a material
+/*!
+ * Only the geometries of 'o' itself, they share the same transform.
+ * Call it once they are all there, before the first projection; it turns
+ * many small draw calls into a few big ones. Returns how many geometries
+ * were merged away.
+ */
+int
+c3object_batch(
+		c3object_p o );
 //! Iterates all the sub-objects and collects all the geometries
 /*!
  * This call iterates the sub-objects and collects all their 'projected'
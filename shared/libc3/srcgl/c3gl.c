@@ -320,6 +320,182 @@ _c3_load_vbo(
 	}
 }
 
+/*
+ * Lines are kept as A,B pairs, and drawn as one instance of a small
+ * triangle strip per segment; the vertex shader moves the strip corners
+ * to make a ribbon 'width' wide facing the camera, with round-ish caps.
+ * gl_Vertex is the corner: x picks A or B, y is along the segment (for
+ * the caps) and z is across.
+ */
+static const char * _c3lines_vs =
+	"#version 120\n"
+	"attribute vec3 a;\n"
+	"attribute vec3 b;\n"
+	"uniform float width;\n"
+	"varying vec2 uv;\n"
+	"void main() {\n"
+	"	vec3 pa = (gl_ModelViewMatrix * vec4(a, 1.0)).xyz;\n"
+	"	vec3 pb = (gl_ModelViewMatrix * vec4(b, 1.0)).xyz;\n"
+	"	vec3 p = mix(pa, pb, gl_Vertex.x);\n"
+	"	vec3 dir = pb - pa;\n"
+	"	dir = length(dir) > 0.0 ? normalize(dir) : vec3(1.0, 0.0, 0.0);\n"
+	"	vec3 view = gl_ProjectionMatrix[3][3] == 1.0 ?\n"
+	"			vec3(0.0, 0.0, 1.0) : normalize(-p);\n"
+	"	vec3 side = cross(dir, view);\n"
+	"	side = length(side) > 0.0 ? normalize(side) : vec3(-dir.y, dir.x, 0.0);\n"
+	"	p += (dir * gl_Vertex.y + side * gl_Vertex.z) * width;\n"
+	"	uv = vec2(0.5 + gl_Vertex.y * 0.5, 0.5 + gl_Vertex.z * 0.5);\n"
+	"	gl_FrontColor = gl_Color;\n"
+	"	gl_Position = gl_ProjectionMatrix * vec4(p, 1.0);\n"
+	"}\n";
+
+static const char * _c3lines_fs =
+	"#version 120\n"
+	"uniform sampler2D tex;\n"
+	"uniform int textured;\n"
+	"varying vec2 uv;\n"
+	"void main() {\n"
+	"	vec4 t = textured != 0 ? texture2D(tex, uv) :\n"
+	"			vec4(1.0, 1.0, 1.0,\n"
+	"				1.0 - smoothstep(0.6, 1.0, length(uv * 2.0 - 1.0)));\n"
+	"	gl_FragColor = vec4(gl_Color.rgb, gl_Color.a * t.a);\n"
+	"}\n";
+
+static const GLfloat _c3lines_corners[8][3] = {
+	{ 0, -1, -1 }, { 0, -1, 1 },	// A cap
+	{ 0,  0, -1 }, { 0,  0, 1 },
+	{ 1,  0, -1 }, { 1,  0, 1 },
+	{ 1,  1, -1 }, { 1,  1, 1 },	// B cap
+};
+
+static struct {
+	int			tried;
+	c3program_p	program;	// NULL if it failed, lines are expanded on the CPU
+	GLint		a, b;		// attributes
+	GLint		width, textured;	// uniforms
+	GLuint		corners;	// buffer, shared by all the lines
+} lines;
+
+static c3program_p
+_c3_lines_program(void)
+{
+	if (lines.tried)
+		return lines.program;
+	lines.tried = 1;
+
+	static const char * uniforms[] = { "width", "textured", NULL };
+	c3program_p p = c3program_new("c3lines", uniforms);
+	c3shader_t vs = {
+		.type = GL_VERTEX_SHADER,
+		.name = str_new("c3lines.vs"),
+		.shader = str_new(_c3lines_vs),
+	};
+	c3shader_t fs = {
+		.type = GL_FRAGMENT_SHADER,
+		.name = str_new("c3lines.fs"),
+		.shader = str_new(_c3lines_fs),
+	};
+	c3shader_array_add(&p->shaders, vs);
+	c3shader_array_add(&p->shaders, fs);
+	if (c3gl_program_load(p) < 0) {
+		fprintf(stderr, "%s: expanding lines on the CPU\n", __func__);
+		c3program_dispose(p);
+		return NULL;
+	}
+	GLuint pid = C3APIO_INT(p->pid);
+	lines.a = glGetAttribLocation(pid, "a");
+	lines.b = glGetAttribLocation(pid, "b");
+	lines.width = C3APIO_INT(c3program_locate_param(p, "width")->pid);
+	lines.textured = C3APIO_INT(c3program_locate_param(p, "textured")->pid);
+
+	glGenBuffers(1, &lines.corners);
+	glBindBuffer(GL_ARRAY_BUFFER, lines.corners);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(_c3lines_corners),
+			_c3lines_corners, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	lines.program = p;
+	return p;
+}
+
+/*
+ * Lines with their own program get the CPU expansion, that program
+ * would not know about the a,b attributes. The others are drawn with the
+ * c3lines program, not with whatever the application had bound, so they
+ * don't get it's lighting or shadows; give them that program to keep them
+ */
+static int
+_c3_lines_instanced(
+		c3geometry_p g)
+{
+	return g->type.type == C3_LINES_TYPE && !g->mat.program &&
+			_c3_lines_program();
+}
+
+static void
+_c3_load_lines(
+		c3geometry_p g)
+{
+	if (!g->vertice.count)
+		return;
+	if (!g->bid) {
+		GLuint	vao;
+		glGenVertexArrays(1, &vao);
+		g->bid = C3APIO(vao);
+	}
+	glBindVertexArray(C3APIO_INT(g->bid));
+
+	if (!g->vertice.buffer.bid) {
+		GLuint bid;
+		glGenBuffers(1, &bid);
+		g->vertice.buffer.bid = C3APIO(bid);
+		glBindBuffer(GL_ARRAY_BUFFER, bid);
+		// one A,B pair per instance
+		const GLsizei stride = 2 * sizeof(c3vertex_t);
+		glVertexAttribPointer(lines.a, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+		glVertexAttribDivisorARB(lines.a, 1);
+		glEnableVertexAttribArray(lines.a);
+		glVertexAttribPointer(lines.b, 3, GL_FLOAT, GL_FALSE, stride,
+				(void*)sizeof(c3vertex_t));
+		glVertexAttribDivisorARB(lines.b, 1);
+		glEnableVertexAttribArray(lines.b);
+
+		glBindBuffer(GL_ARRAY_BUFFER, lines.corners);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(3, GL_FLOAT, 0, (void*)0);
+		g->vertice.buffer.dirty = 1;
+	}
+	if (g->vertice.buffer.dirty && g->vertice.e) {
+		GLCHECK(glBindBuffer(GL_ARRAY_BUFFER, C3APIO_INT(g->vertice.buffer.bid)));
+		GLCHECK(glBufferData(GL_ARRAY_BUFFER,
+				g->vertice.count * sizeof(g->vertice.e[0]),
+				g->vertice.e,
+				g->vertice.buffer.mutable ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW));
+		if (!g->vertice.buffer.mutable && !g->debug)
+			c3vertex_array_realloc(&g->vertice, 0);
+		g->vertice.buffer.dirty = 0;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+ * No shader; turn the pairs into triangles once, before the upload
+ */
+static void
+_c3_expand_lines(
+		c3geometry_p g)
+{
+	if (g->vertice.buffer.bid || !g->vertice.e)
+		return;
+	c3mat4 i = identity3D();
+	c3vertex_array_t tri = {0};
+	c3lines_prepare(g->vertice.e, g->vertice.count,
+			&tri, &g->textures, g->line.width, &i);
+	c3vertex_array_clear(&g->vertice);
+	c3vertex_array_insert(&g->vertice, 0, tri.e, tri.count);
+	c3vertex_array_free(&tri);
+}
+
 static void
 _c3_geometry_project(
 		c3context_p c,
@@ -332,10 +508,20 @@ _c3_geometry_project(
 	if (g->mat.program)
 		c3gl_program_load(g->mat.program);
 
+	if (_c3_lines_instanced(g)) {
+		g->type.subtype = (c3apiobject_t)GL_TRIANGLE_STRIP;
+		_c3_load_lines(g);
+		glBindVertexArray(0);
+		C3_DRIVER_INHERITED(c, d, geometry_project, g, m);
+		return;
+	}
 	switch(g->type.type) {
+		case C3_LINES_TYPE:
+			_c3_expand_lines(g);
+			g->type.subtype = (c3apiobject_t)GL_TRIANGLES;
+			break;
 		case C3_SPHERE_TYPE:
 		case C3_TRIANGLE_TYPE:
-		case C3_LINES_TYPE:
 			g->type.subtype = (c3apiobject_t)GL_TRIANGLES;
 			break;
 		case C3_TEXTURE_TYPE: {
@@ -367,6 +553,66 @@ c3_bbox_vertices(
 		c3bbox_t * b,
 		c3vec3 out[8]);
 
+/*
+ * What is bound between context_view_draw and context_view_draw_done;
+ * the geometries are sorted by program and texture, so most of them don't
+ * need to rebind anything. Outside of these, every geometry restores the
+ * state after itself, like it always did.
+ */
+static struct {
+	int			active;
+	c3pixels_p	texture;
+	c3program_p	program;
+	GLint		outer;		// program bound by the application
+} bound;
+
+static void
+_c3_texture_enable(
+		c3pixels_p pix,
+		int enable)
+{
+	GLuint mode = pix->rectangle ? GL_TEXTURE_RECTANGLE_ARB : GL_TEXTURE_2D;
+	if (!enable) {
+		glDisable(mode);
+		return;
+	}
+	glEnable(mode);
+	if (pix->trace)
+		printf("%s uses texture %s(%d)\n",
+				__func__, pix->name ? pix->name->str : "",
+				C3APIO_INT(pix->texture));
+	dumpError("glEnable texture");
+	glBindTexture(mode, C3APIO_INT(pix->texture));
+	dumpError("glBindTexture");
+}
+
+static void
+_c3_context_view_draw(
+		c3context_p c,
+		const struct c3driver_context_t *d,
+		c3context_view_p v)
+{
+	memset(&bound, 0, sizeof(bound));
+	bound.active = 1;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &bound.outer);
+	C3_DRIVER_INHERITED(c, d, context_view_draw, v);
+}
+
+static void
+_c3_context_view_draw_done(
+		c3context_p c,
+		const struct c3driver_context_t *d,
+		c3context_view_p v)
+{
+	glBindVertexArray(0);
+	if (bound.texture)
+		_c3_texture_enable(bound.texture, 0);
+	if (bound.program)
+		glUseProgram(bound.outer);
+	memset(&bound, 0, sizeof(bound));
+	C3_DRIVER_INHERITED(c, d, context_view_draw_done, v);
+}
+
 /*
  * This id the meta function that draws a c3geometry. It looks for normals,
  * indices, textures and so on and call the glDrawArrays
@@ -410,36 +656,43 @@ _c3_geometry_draw(
 
 	GLCHECK(glBindVertexArray(C3APIO_INT(g->bid)));
 
-	//glDisable(GL_TEXTURE_2D);
-	if (g->mat.texture) {
-		GLuint mode = g->mat.texture->rectangle ? GL_TEXTURE_RECTANGLE_ARB : GL_TEXTURE_2D;
-		glEnable(mode);
-		if (g->mat.texture->trace)
-			printf("%s view %d uses texture %s(%d) (%d tex)\n",
-					__func__, c->current, g->mat.texture->name->str,
-					C3APIO_INT(g->mat.texture->texture),
-					g->textures.count);
-	//	printf("tex mode %d texture %d\n", g->mat.mode, g->mat.texture);
-		dumpError("glEnable texture");
-		glBindTexture(mode, C3APIO_INT(g->mat.texture->texture));
-		dumpError("glBindTexture");
+	if (g->mat.texture != bound.texture) {
+		if (bound.texture)
+			_c3_texture_enable(bound.texture, 0);
+		if (g->mat.texture)
+			_c3_texture_enable(g->mat.texture, 1);
+		bound.texture = g->mat.texture;
+	}
+	int instanced = _c3_lines_instanced(g);
+	c3program_p program = instanced ? lines.program : g->mat.program;
+	if (program != bound.program) {
+		GLCHECK(glUseProgram(program ?
+				C3APIO_INT(program->pid) : bound.outer));
+		bound.program = program;
 	}
-	if (g->mat.program)
-		GLCHECK(glUseProgram(C3APIO_INT(g->mat.program->pid)));
 
-	if (g->indices.buffer.bid) {
+	if (instanced) {
+		glUniform1f(lines.width, g->line.width);
+		glUniform1i(lines.textured,
+				g->mat.texture && !g->mat.texture->rectangle);
+		GLCHECK(glDrawArraysInstancedARB(GL_TRIANGLE_STRIP, 0, 8,
+				g->vertice.count / 2));
+	} else if (g->indices.buffer.bid) {
 		GLCHECK(glDrawElements(C3APIO_INT(g->type.subtype),
 				g->indices.count, GL_UNSIGNED_SHORT,
 				(void*)NULL /*g->indices.e*/));
 	} else {
 		glDrawArrays(C3APIO_INT(g->type.subtype), 0, g->vertice.count);
 	}
-	glBindVertexArray(0);
-
-	if (g->mat.texture)
-		glDisable(g->mat.texture->rectangle ? GL_TEXTURE_RECTANGLE_ARB : GL_TEXTURE_2D);
-	if (g->mat.program)
-		glUseProgram(0);
+	if (!bound.active) {
+		glBindVertexArray(0);
+		if (g->mat.texture)
+			_c3_texture_enable(g->mat.texture, 0);
+		if (bound.program)
+			glUseProgram(0);
+		bound.texture = NULL;
+		bound.program = NULL;
+	}
 
 	if (g->debug) {
 		if (g->normals.count) {
@@ -472,6 +725,8 @@ _c3_geometry_draw(
 const c3driver_context_t c3context_driver = {
 		.geometry_project = _c3_geometry_project,
 		.geometry_draw = _c3_geometry_draw,
+		.context_view_draw = _c3_context_view_draw,
+		.context_view_draw_done = _c3_context_view_draw_done,
 };
 
 const struct c3driver_context_t *
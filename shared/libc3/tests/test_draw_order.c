@@ -0,0 +1,85 @@
+/*
+	test_draw_order.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of libc3.
+
+	libc3 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	libc3 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libc3.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Two transparent boxes in line with the eye, they have to be drawn
+ * back to front, whatever order they were added in.
+ */
+#include <stdio.h>
+#include "c3context.h"
+#include "c3object.h"
+#include "c3cube.h"
+
+static c3geometry_p
+_test_box(
+		c3object_p parent,
+		c3vec3 center)
+{
+	c3geometry_p g = c3cube_new(
+			c3vec3_sub(center, c3vec3f(1, 1, 1)), c3vec3f(2, 2, 2),
+			C3CUBE_FACE_ALL, parent);
+	g->mat.color = c3vec4f(1, 1, 1, 0.5);
+	return g;
+}
+
+static int
+_test_order(
+		c3vec3 eye,
+		c3vec3 c1,
+		c3vec3 c2,
+		int first)
+{
+	c3context_p c = c3context_new(800, 600);
+	c3context_view_p v = c3context_view_get(c);
+	v->cam.eye = eye;
+	v->cam.lookat = c3vec3f(0, 0, 0);
+	c3cam_update_matrix(&v->cam);
+
+	c3geometry_p g[2] = {
+		_test_box(c->root, c1),
+		_test_box(c->root, c2),
+	};
+	c3context_project(c);
+
+	int res = v->projected.count == 2 &&
+			v->projected.e[0] == g[first] &&
+			v->projected.e[1] == g[!first];
+	if (!res)
+		printf("%s: eye %g,%g,%g: box %d should be drawn first\n", __func__,
+				eye.x, eye.y, eye.z, first);
+	c3context_dispose(c);
+	return res;
+}
+
+int
+main()
+{
+	int res = 1;
+	// the near box is further from the origin than the eye is from it
+	res &= _test_order(c3vec3f(100, 0, 0),
+			c3vec3f(90, 0, 0), c3vec3f(40, 0, 0), 1);
+	res &= _test_order(c3vec3f(100, 0, 0),
+			c3vec3f(40, 0, 0), c3vec3f(90, 0, 0), 0);
+	res &= _test_order(c3vec3f(0, -50, 20),
+			c3vec3f(0, -40, 16), c3vec3f(0, 30, -12), 1);
+	printf("%s: %s\n", __FILE__, res ? "OK" : "FAILED");
+	return !res;
+}
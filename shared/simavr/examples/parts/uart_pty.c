@@ -27,10 +27,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #ifdef __APPLE__
 #include <util.h>
 #else
 #include <pty.h>
+#include <sys/eventfd.h>
 #endif
 
 #include "uart_pty.h"
@@ -44,6 +46,33 @@ DEFINE_FIFO(uint8_t,uart_pty_fifo);
 #define TRACE(_w)
 #endif
 
+/*
+ * Wake up the pty thread, but only if it told us it was going to sleep.
+ * The thread sets 'sleeping' /then/ re-checks the fifos, we change the
+ * fifos /then/ check 'sleeping', so one of the two always sees the other.
+ * This means there is at most one syscall per burst, not one per byte.
+ */
+static void
+uart_pty_kick(
+		uart_pty_t * p)
+{
+	FIFO_SYNC;
+	if (!p->sleeping)
+		return;
+	p->sleeping = 0;
+	uint64_t one = 1;	// eventfd wants 8 bytes, pipe doesn't care
+	(void)write(p->wakeup[1], &one, sizeof(one));
+}
+
+static void
+uart_pty_drain_kick(
+		uart_pty_t * p)
+{
+	uint8_t buffer[64];	// big enough for an eventfd counter, or a few pipe bytes
+	while (read(p->wakeup[0], buffer, sizeof(buffer)) > 0)
+		;
+}
+
 /*
  * called when a byte is send via the uart on the AVR
  */
@@ -62,6 +91,7 @@ uart_pty_in_hook(
 			uart_pty_fifo_write(&p->tap.in, '\r');
 		uart_pty_fifo_write(&p->tap.in, value);
 	}
+	uart_pty_kick(p);
 }
 
 // try to empty our fifo, the uart_pty_xoff_hook() will be called when
@@ -70,11 +100,13 @@ static void
 uart_pty_flush_incoming(
 		uart_pty_t * p)
 {
+	int done = 0;	// bytes taken out of the fifos, once each
 	while (p->xon && !uart_pty_fifo_isempty(&p->pty.out)) {
 		TRACE(int r = p->pty.out.read;)
 		uint8_t byte = uart_pty_fifo_read(&p->pty.out);
 		TRACE(printf("uart_pty_flush_incoming send r %03d:%02x\n", r, byte);)
 		avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
+		done++;
 
 		if (p->tap.s) {
 			if (p->tap.crlf && byte == '\n')
@@ -85,6 +117,7 @@ uart_pty_flush_incoming(
 	if (p->tap.s) {
 		while (p->xon && !uart_pty_fifo_isempty(&p->tap.out)) {
 			uint8_t byte = uart_pty_fifo_read(&p->tap.out);
+			done++;
 			if (p->tap.crlf && byte == '\r') {
 				uart_pty_fifo_write(&p->tap.in, '\n');
 			}
@@ -94,6 +127,9 @@ uart_pty_flush_incoming(
 			avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
 		}
 	}
+	// there is room in the fifo(s) now, and maybe tap echo to send
+	if (done)
+		uart_pty_kick(p);
 }
 
 /*
@@ -126,6 +162,30 @@ uart_pty_xoff_hook(
 	p->xon = 0;
 }
 
+/*
+ * Returns the largest contiguous block that can be written in the fifo
+ */
+static inline size_t
+uart_pty_fifo_contiguous_write(
+		uart_pty_fifo_t * f)
+{
+	size_t room = uart_pty_fifo_get_write_size(f);
+	size_t end = uart_pty_fifo_fifo_size - f->write;
+	return room < end ? room : end;
+}
+
+/*
+ * Returns the largest contiguous block that can be read from the fifo
+ */
+static inline size_t
+uart_pty_fifo_contiguous_read(
+		uart_pty_fifo_t * f)
+{
+	size_t size = uart_pty_fifo_get_read_size(f);
+	size_t end = uart_pty_fifo_fifo_size - f->read;
+	return size < end ? size : end;
+}
+
 static void *
 uart_pty_thread(
 		void * param)
@@ -134,13 +194,17 @@ uart_pty_thread(
 
 	while (1) {
 		fd_set read_set, write_set;
-		int max = 0;
+		int max = p->wakeup[0];
 		FD_ZERO(&read_set);
 		FD_ZERO(&write_set);
 
+		FD_SET(p->wakeup[0], &read_set);
+		// tell the AVR side to kick us if it changes the fifos from now on
+		p->sleeping = 1;
+		FIFO_SYNC;
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			// read more only if buffer was flushed
-			if (p->port[ti].buffer_len == p->port[ti].buffer_done) {
+			// read more only if there is room in the fifo
+			if (!uart_pty_fifo_isfull(&p->port[ti].out)) {
 				FD_SET(p->port[ti].s, &read_set);
 				max = p->port[ti].s > max ? p->port[ti].s : max;
 			}
@@ -150,43 +214,38 @@ uart_pty_thread(
 			}
 		}
 
-		struct timeval timo = { 0, 500 };	// short, but not too short interval
-		int ret = select(max+1, &read_set, &write_set, NULL, &timo);
+		int ret = select(max+1, &read_set, &write_set, NULL, NULL);
+		p->sleeping = 0;
 
-		if (!ret)
-			continue;
 		if (ret < 0)
 			break;
+		if (FD_ISSET(p->wakeup[0], &read_set))
+			uart_pty_drain_kick(p);
 
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			if (FD_ISSET(p->port[ti].s, &read_set)) {
-				ssize_t r = read(p->port[ti].s, p->port[ti].buffer,
-									sizeof(p->port[ti].buffer)-1);
-				p->port[ti].buffer_len = r;
-				p->port[ti].buffer_done = 0;
-				TRACE(if (!p->port[ti].tap) hdump("pty recv", p->port[ti].buffer, r);)
-			}
-			if (p->port[ti].buffer_done < p->port[ti].buffer_len) {
-				// write them in fifo
-				while (p->port[ti].buffer_done < p->port[ti].buffer_len &&
-						!uart_pty_fifo_isfull(&p->port[ti].out)) {
-					int index = p->port[ti].buffer_done++;
-					TRACE(int wi = p->port[ti].out.write;)
-					uart_pty_fifo_write(&p->port[ti].out,
-							p->port[ti].buffer[index]);
-					TRACE(printf("w %3d:%02x\n", wi, p->port[ti].buffer[index]);)
+			uart_pty_port_p port = &p->port[ti];
+			if (FD_ISSET(port->s, &read_set)) {
+				// read straight in the fifo; the fifo is a single
+				// producer/consumer ring, so we only publish the new
+				// write cursor once the data is in
+				size_t room = uart_pty_fifo_contiguous_write(&port->out);
+				ssize_t r = read(port->s,
+						port->out.buffer + port->out.write, room);
+				if (r > 0) {
+					TRACE(if (!port->tap) hdump("pty recv",
+							port->out.buffer + port->out.write, r);)
+					uart_pty_fifo_write_offset(&port->out, r);
 				}
 			}
-			if (FD_ISSET(p->port[ti].s, &write_set)) {
-				uint8_t buffer[512];
-				// write them in fifo
-				uint8_t * dst = buffer;
-				while (!uart_pty_fifo_isempty(&p->port[ti].in) &&
-						dst < (buffer + sizeof(buffer)))
-					*dst++ = uart_pty_fifo_read(&p->port[ti].in);
-				size_t len = dst - buffer;
-				TRACE(size_t r =) write(p->port[ti].s, buffer, len);
-				TRACE(if (!p->port[ti].tap) hdump("pty send", buffer, r);)
+			if (FD_ISSET(port->s, &write_set)) {
+				size_t len = uart_pty_fifo_contiguous_read(&port->in);
+				ssize_t r = write(port->s,
+						port->in.buffer + port->in.read, len);
+				if (r > 0) {
+					TRACE(if (!port->tap) hdump("pty send",
+							port->in.buffer + port->in.read, r);)
+					uart_pty_fifo_read_offset(&port->in, r);
+				}
 			}
 		}
 		/* DO NOT call this, this create a concurency issue with the
@@ -208,6 +267,7 @@ uart_pty_init(
 		uart_pty_t * p)
 {
 	memset(p, 0, sizeof(*p));
+	p->wakeup[0] = p->wakeup[1] = -1;
 
 	p->avr = avr;
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
@@ -234,8 +294,20 @@ uart_pty_init(
 				ti == 0 ? "bridge" : "tap", p->port[ti].slavename);
 	}
 
-	pthread_create(&p->thread, NULL, uart_pty_thread, p);
-
+#ifdef __linux__
+	p->wakeup[0] = p->wakeup[1] = eventfd(0, EFD_NONBLOCK);
+#else
+	if (pipe(p->wakeup) == 0) {
+		fcntl(p->wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(p->wakeup[1], F_SETFL, O_NONBLOCK);
+	}
+#endif
+	if (p->wakeup[0] < 0) {
+		fprintf(stderr, "%s: Can't create wakeup fd: %s", __FUNCTION__, strerror(errno));
+		return ;
+	}
+	p->thread_started =
+			pthread_create(&p->thread, NULL, uart_pty_thread, p) == 0;
 }
 
 void
@@ -243,12 +315,21 @@ uart_pty_stop(
 		uart_pty_t * p)
 {
 	puts(__func__);
-	pthread_kill(p->thread, SIGINT);
+	if (p->thread_started)
+		pthread_kill(p->thread, SIGINT);
 	for (int ti = 0; ti < 2; ti++)
 		if (p->port[ti].s)
 			close(p->port[ti].s);
-	void * ret;
-	pthread_join(p->thread, &ret);
+	if (p->thread_started) {
+		void * ret;
+		pthread_join(p->thread, &ret);
+		p->thread_started = 0;
+	}
+	if (p->wakeup[0] >= 0)
+		close(p->wakeup[0]);
+	if (p->wakeup[1] >= 0 && p->wakeup[1] != p->wakeup[0])
+		close(p->wakeup[1]);
+	p->wakeup[0] = p->wakeup[1] = -1;
 }
 
 void
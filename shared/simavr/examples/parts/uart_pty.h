@@ -33,7 +33,14 @@ enum {
 	IRQ_UART_PTY_COUNT
 };
 
-DECLARE_FIFO(uint8_t,uart_pty_fifo, 512);
+/*
+ * The fifos are large enough to hold a good chunk of a gcode file, the
+ * pty thread reads/writes straight into them, in as big a block as possible
+ */
+#ifndef UART_PTY_FIFO_SIZE
+#define UART_PTY_FIFO_SIZE	16384
+#endif
+DECLARE_FIFO(uint8_t,uart_pty_fifo, UART_PTY_FIFO_SIZE);
 
 typedef struct uart_pty_port_t {
 	int			tap : 1, crlf : 1;
@@ -41,8 +48,6 @@ typedef struct uart_pty_port_t {
 	char 		slavename[64];
 	uart_pty_fifo_t in;
 	uart_pty_fifo_t out;
-	uint8_t		buffer[512];
-	size_t		buffer_len, buffer_done;
 } uart_pty_port_t, *uart_pty_port_p;
 
 typedef struct uart_pty_t {
@@ -50,7 +55,10 @@ typedef struct uart_pty_t {
 	struct avr_t *avr;		// keep it around so we can pause it
 
 	pthread_t	thread;
+	int			thread_started;
 	int			xon;
+	int			wakeup[2];	// eventfd (or pipe) to kick the thread
+	volatile int	sleeping;	// thread is about to block in select()
 
 	union {
 		struct {
@@ -0,0 +1,443 @@
+/*
+	uart_tcp.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "uart_tcp.h"
+#include "avr_uart.h"
+#include "sim_hex.h"
+
+DEFINE_FIFO(uint8_t,uart_tcp_fifo);
+
+//#define TRACE(_w) _w
+#ifndef TRACE
+#define TRACE(_w)
+#endif
+
+// epoll 'data' for the non-client file descriptors
+#define UART_TCP_EV_LISTEN	(UART_TCP_MAX_CLIENTS)
+#define UART_TCP_EV_WAKEUP	(UART_TCP_MAX_CLIENTS + 1)
+
+/*
+ * Wake up the network thread, but only if it told us it was going to sleep.
+ * See uart_pty.c, same logic.
+ */
+static void
+uart_tcp_kick(
+		uart_tcp_t * p)
+{
+	FIFO_SYNC;
+	if (!p->sleeping)
+		return;
+	p->sleeping = 0;
+	uint64_t one = 1;
+	(void)write(p->wakeup, &one, sizeof(one));
+}
+
+/*
+ * called when a byte is send via the uart on the AVR
+ */
+static void
+uart_tcp_in_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	TRACE(printf("uart_tcp_in_hook %02x\n", value);)
+	uint32_t write = p->ring_write;
+	// never overwrite what a client might still be sending from
+	if (write - p->ring_read >= UART_TCP_RING_SIZE) {
+		p->ring_dropped++;
+		uart_tcp_kick(p);
+		return;
+	}
+	p->ring[write & (UART_TCP_RING_SIZE-1)] = value;
+	FIFO_SYNC;
+	p->ring_write = write + 1;
+	uart_tcp_kick(p);
+}
+
+/*
+ * Called when the uart has room in it's input buffer. This is called repeateadly
+ * if necessary, while the xoff is called only when the uart fifo is FULL
+ */
+static void
+uart_tcp_xon_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	int done = 0;
+	p->xon = 1;
+	// try to empty our fifo, the uart_tcp_xoff_hook() will be called when
+	// other side is full
+	while (p->xon && !uart_tcp_fifo_isempty(&p->out)) {
+		uint8_t byte = uart_tcp_fifo_read(&p->out);
+		avr_raise_irq(p->irq + IRQ_UART_TCP_BYTE_OUT, byte);
+		done++;
+	}
+	// there is room in the fifo, let the controlling client send more
+	if (done)
+		uart_tcp_kick(p);
+}
+
+/*
+ * Called when the uart ran out of room in it's input buffer
+ */
+static void
+uart_tcp_xoff_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+	p->xon = 0;
+}
+
+static void
+uart_tcp_client_close(
+		uart_tcp_t * p,
+		int ci)
+{
+	uart_tcp_client_t * c = &p->client[ci];
+	printf("uart_tcp: client %d disconnected%s", ci,
+			ci == p->control ? " (was in control)" : "");
+	if (c->dropped)
+		printf(", %u bytes dropped", c->dropped);
+	printf("\n");
+	epoll_ctl(p->epoll, EPOLL_CTL_DEL, c->s, NULL);
+	close(c->s);
+	memset(c, 0, sizeof(*c));
+	c->s = -1;
+	if (ci != p->control)
+		return;
+	// hand control to the oldest monitor
+	p->control = -1;
+	for (int i = 0; i < UART_TCP_MAX_CLIENTS; i++)
+		if (p->client[i].s >= 0 && (p->control == -1 ||
+				p->client[i].serial - p->client[p->control].serial > 0x80000000))
+			p->control = i;
+	if (p->control != -1)
+		printf("uart_tcp: client %d now in control\n", p->control);
+}
+
+static void
+uart_tcp_client_accept(
+		uart_tcp_t * p)
+{
+	int s = accept(p->listen, NULL, NULL);
+	if (s < 0)
+		return;
+	fcntl(s, F_SETFL, O_NONBLOCK);
+	int ci = 0;
+	while (ci < UART_TCP_MAX_CLIENTS && p->client[ci].s >= 0)
+		ci++;
+	if (ci == UART_TCP_MAX_CLIENTS) {
+		fprintf(stderr, "uart_tcp: too many clients\n");
+		close(s);
+		return;
+	}
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	uart_tcp_client_t * c = &p->client[ci];
+	memset(c, 0, sizeof(*c));
+	c->s = s;
+	c->serial = p->serial++;
+	c->cursor = p->ring_write;	// no backlog for newcomers
+	c->events = EPOLLIN;
+	struct epoll_event ev = { .events = c->events, .data.u32 = ci };
+	epoll_ctl(p->epoll, EPOLL_CTL_ADD, s, &ev);
+	if (p->control == -1)
+		p->control = ci;
+	printf("uart_tcp: client %d connected (%s)\n", ci,
+			ci == p->control ? "control" : "monitor");
+}
+
+/*
+ * Controlling client sends straight into the fifo, monitors are
+ * read only, and what they send is dropped on the floor
+ */
+static void
+uart_tcp_client_read(
+		uart_tcp_t * p,
+		int ci)
+{
+	uart_tcp_client_t * c = &p->client[ci];
+	ssize_t r;
+
+	if (ci == p->control) {
+		size_t room = uart_tcp_fifo_get_write_size(&p->out);
+		size_t end = uart_tcp_fifo_fifo_size - p->out.write;
+		if (!room)
+			return;
+		r = recv(c->s, p->out.buffer + p->out.write, room < end ? room : end, 0);
+		if (r > 0)
+			uart_tcp_fifo_write_offset(&p->out, r);
+	} else {
+		uint8_t discard[512];
+		r = recv(c->s, discard, sizeof(discard), 0);
+	}
+	if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		uart_tcp_client_close(p, ci);
+}
+
+/*
+ * Send whatever the client hasn't seen yet, straight from the ring, up
+ * to 'write', the cursor snapshot of this pass
+ */
+static void
+uart_tcp_client_send(
+		uart_tcp_t * p,
+		int ci,
+		uint32_t write)
+{
+	uart_tcp_client_t * c = &p->client[ci];
+
+	// too slow, resync so it doesn't hold the AVR back
+	if (write - c->cursor > UART_TCP_RING_SIZE / 2) {
+		c->dropped += write - c->cursor;
+		c->cursor = write;
+	}
+	while (c->cursor != write && !c->blocked) {
+		uint32_t o = c->cursor & (UART_TCP_RING_SIZE-1);
+		uint32_t len = write - c->cursor;
+		if (len > UART_TCP_RING_SIZE - o)
+			len = UART_TCP_RING_SIZE - o;
+		ssize_t r = send(c->s, p->ring + o, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r > 0)
+			c->cursor += r;
+		else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			c->blocked = 1;
+		else {
+			uart_tcp_client_close(p, ci);
+			return;
+		}
+	}
+}
+
+/*
+ * Update what we poll for; don't read from the controlling client if
+ * the fifo is full, and only wait for EPOLLOUT if the socket was full
+ */
+static void
+uart_tcp_client_events(
+		uart_tcp_t * p,
+		int ci)
+{
+	uart_tcp_client_t * c = &p->client[ci];
+	uint32_t events = 0;
+
+	if (ci != p->control || !uart_tcp_fifo_isfull(&p->out))
+		events |= EPOLLIN;
+	if (c->blocked)
+		events |= EPOLLOUT;
+	if (events == c->events)
+		return;
+	c->events = events;
+	struct epoll_event ev = { .events = events, .data.u32 = ci };
+	epoll_ctl(p->epoll, EPOLL_CTL_MOD, c->s, &ev);
+}
+
+static void *
+uart_tcp_thread(
+		void * param)
+{
+	uart_tcp_t * p = (uart_tcp_t*)param;
+
+	while (!p->stop) {
+		struct epoll_event events[16];
+
+		// tell the AVR side to kick us if it changes anything from now on
+		p->sleeping = 1;
+		FIFO_SYNC;
+		int pending = 0;
+		for (int ci = 0; ci < UART_TCP_MAX_CLIENTS; ci++) if (p->client[ci].s >= 0) {
+			uart_tcp_client_events(p, ci);
+			if (!p->client[ci].blocked && p->client[ci].cursor != p->ring_write)
+				pending = 1;
+		}
+		int n = epoll_wait(p->epoll, events, 16, pending ? 0 : -1);
+		p->sleeping = 0;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int ei = 0; ei < n; ei++) {
+			uint32_t ci = events[ei].data.u32;
+
+			if (ci == UART_TCP_EV_LISTEN) {
+				uart_tcp_client_accept(p);
+				continue;
+			}
+			if (ci == UART_TCP_EV_WAKEUP) {
+				uint64_t count;
+				(void)read(p->wakeup, &count, sizeof(count));
+				continue;
+			}
+			if (p->client[ci].s < 0)	// closed by a previous event
+				continue;
+			if (events[ei].events & EPOLLOUT)
+				p->client[ci].blocked = 0;
+			if (events[ei].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				uart_tcp_client_read(p, ci);
+		}
+		// one snapshot of the write cursor for all the clients; the ring
+		// up to there is stable until we publish the new read cursor
+		uint32_t write = p->ring_write;
+		FIFO_SYNC;
+		uint32_t read = write;
+		for (int ci = 0; ci < UART_TCP_MAX_CLIENTS; ci++) {
+			if (p->client[ci].s < 0)
+				continue;
+			uart_tcp_client_send(p, ci, write);
+			if (p->client[ci].s >= 0 && write - p->client[ci].cursor > write - read)
+				read = p->client[ci].cursor;
+		}
+		FIFO_SYNC;
+		p->ring_read = read;
+	}
+	return NULL;
+}
+
+static const char * irq_names[IRQ_UART_TCP_COUNT] = {
+	[IRQ_UART_TCP_BYTE_IN] = "8<uart_tcp.in",
+	[IRQ_UART_TCP_BYTE_OUT] = "8>uart_tcp.out",
+};
+
+int
+uart_tcp_init(
+		struct avr_t * avr,
+		uart_tcp_t * p,
+		uint16_t port)
+{
+	memset(p, 0, sizeof(*p));
+
+	p->avr = avr;
+	p->port = port;
+	p->control = -1;
+	p->epoll = p->wakeup = -1;
+	for (int ci = 0; ci < UART_TCP_MAX_CLIENTS; ci++)
+		p->client[ci].s = -1;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_TCP_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_UART_TCP_BYTE_IN, uart_tcp_in_hook, p);
+
+	if ((p->listen = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		fprintf(stderr, "%s: Can't create socket: %s", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+	int one = 1;
+	setsockopt(p->listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in address = { 0 };
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	if (bind(p->listen, (struct sockaddr *) &address, sizeof(address)) ||
+			listen(p->listen, 8)) {
+		fprintf(stderr, "%s: Can not bind socket: %s", __FUNCTION__, strerror(errno));
+		close(p->listen);
+		return -1;
+	}
+	p->epoll = epoll_create1(0);
+	p->wakeup = eventfd(0, EFD_NONBLOCK);
+	if (p->epoll < 0 || p->wakeup < 0) {
+		fprintf(stderr, "%s: Can't create epoll: %s", __FUNCTION__, strerror(errno));
+		if (p->epoll >= 0)
+			close(p->epoll);
+		if (p->wakeup >= 0)
+			close(p->wakeup);
+		close(p->listen);
+		p->epoll = p->wakeup = -1;
+		return -1;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = UART_TCP_EV_LISTEN };
+	epoll_ctl(p->epoll, EPOLL_CTL_ADD, p->listen, &ev);
+	ev.data.u32 = UART_TCP_EV_WAKEUP;
+	epoll_ctl(p->epoll, EPOLL_CTL_ADD, p->wakeup, &ev);
+
+	printf("uart_tcp_init bridge on port %d\n", port);
+
+	pthread_create(&p->thread, NULL, uart_tcp_thread, p);
+	return 0;
+}
+
+void
+uart_tcp_stop(
+		uart_tcp_t * p)
+{
+	puts(__func__);
+	if (p->epoll < 0)
+		return;
+	p->stop = 1;
+	p->sleeping = 1;
+	uart_tcp_kick(p);
+	void * ret;
+	pthread_join(p->thread, &ret);
+	for (int ci = 0; ci < UART_TCP_MAX_CLIENTS; ci++)
+		if (p->client[ci].s >= 0) {
+			close(p->client[ci].s);
+			p->client[ci].s = -1;
+		}
+	if (p->ring_dropped)
+		printf("uart_tcp: %u bytes dropped, ring full\n", p->ring_dropped);
+	close(p->listen);
+	close(p->wakeup);
+	close(p->epoll);
+	p->epoll = p->wakeup = -1;
+}
+
+void
+uart_tcp_connect(
+		uart_tcp_t * p,
+		char uart)
+{
+	// disable the stdio dump, as we are sending binary there
+	uint32_t f = 0;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_GET_FLAGS(uart), &f);
+	f &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_SET_FLAGS(uart), &f);
+
+	avr_irq_t * src = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XOFF);
+	if (src && dst) {
+		avr_connect_irq(src, p->irq + IRQ_UART_TCP_BYTE_IN);
+		avr_connect_irq(p->irq + IRQ_UART_TCP_BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, uart_tcp_xon_hook, p);
+	if (xoff)
+		avr_irq_register_notify(xoff, uart_tcp_xoff_hook, p);
+}
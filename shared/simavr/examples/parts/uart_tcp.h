@@ -0,0 +1,108 @@
+/*
+	uart_tcp.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Exposes an AVR UART on a local TCP port (linux only, uses epoll).
+ *
+ * The first client to connect is the 'controlling' one, what it sends goes
+ * to the AVR. Any other client is a read-only monitor, what it sends is
+ * discarded. When the controlling client leaves, the oldest monitor
+ * takes over, or the next one to connect if there are none.
+ *
+ * All clients get the firmware output; it is kept in a single ring buffer
+ * that each client sends from directly, with its own cursor. A client that
+ * falls more than half the ring behind skips ahead and loses that data.
+ * The AVR never overwrites what the slowest client hasn't sent yet; if the
+ * network thread is that late, the new bytes are dropped instead.
+ */
+#ifndef __UART_TCP_H___
+#define __UART_TCP_H___
+
+#include <pthread.h>
+#include "sim_network.h"
+#include "sim_irq.h"
+#include "fifo_declare.h"
+
+enum {
+	IRQ_UART_TCP_BYTE_IN = 0,
+	IRQ_UART_TCP_BYTE_OUT,
+	IRQ_UART_TCP_COUNT
+};
+
+DECLARE_FIFO(uint8_t,uart_tcp_fifo, 16384);
+
+#define UART_TCP_RING_SIZE		65536	// power of two
+#define UART_TCP_MAX_CLIENTS	32
+
+typedef struct uart_tcp_client_t {
+	int			s;			// -1 when slot is free
+	uint32_t	serial;		// connection order, to pick the next controller
+	int			blocked;	// socket is full, waiting for EPOLLOUT
+	uint32_t	events;		// what we currently poll for
+	uint32_t	cursor;		// in the output ring, free running
+	uint32_t	dropped;	// bytes skipped because the client was too slow
+} uart_tcp_client_t;
+
+typedef struct uart_tcp_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t *avr;		// keep it around so we can pause it
+
+	pthread_t	thread;
+	uint16_t	port;
+	int			listen;		// listening socket
+	int			epoll;
+	int			wakeup;		// eventfd to kick the thread
+	volatile int	sleeping;	// thread is about to block in epoll_wait()
+	volatile int	stop;
+
+	int			xon;
+	uart_tcp_fifo_t out;	// from the controlling client, to the AVR
+
+	// firmware output, written by the AVR thread only
+	uint8_t		ring[UART_TCP_RING_SIZE];
+	volatile uint32_t	ring_write;	// free running, AVR thread
+	volatile uint32_t	ring_read;	// slowest client cursor, network thread
+	uint32_t	ring_dropped;	// bytes the AVR couldn't queue, ring full
+	uint32_t	serial;
+
+	int			control;	// index of the controlling client, or -1
+	uart_tcp_client_t client[UART_TCP_MAX_CLIENTS];
+} uart_tcp_t;
+
+/*
+ * Listen on 127.0.0.1:port, returns 0 on success
+ */
+int
+uart_tcp_init(
+		struct avr_t * avr,
+		uart_tcp_t * p,
+		uint16_t port);
+
+void
+uart_tcp_stop(
+		uart_tcp_t * p);
+
+void
+uart_tcp_connect(
+		uart_tcp_t * p,
+		char uart);
+
+#endif /* __UART_TCP_H___ */
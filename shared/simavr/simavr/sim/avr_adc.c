@@ -24,6 +24,7 @@
 #include <string.h>
 #include "sim_time.h"
 #include "avr_adc.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_adc_int_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -288,6 +289,18 @@ static void avr_adc_reset(avr_io_t * port)
 		avr_irq_register_notify(p->io.irq + i, avr_adc_irq_notify, p);
 }
 
+static void avr_adc_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	AVR_SNAPSHOT(s, p->adts_mode);
+	AVR_SNAPSHOT(s, p->adc_values);
+	AVR_SNAPSHOT(s, p->temp);
+	AVR_SNAPSHOT(s, p->first);
+	AVR_SNAPSHOT(s, p->read_status);
+	avr_snapshot_timer(s, avr_adc_int_raise, p);
+}
+
 static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_ADC0] = "16<adc0",
 	[ADC_IRQ_ADC1] = "16<adc1",
@@ -313,6 +326,7 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
+	.snapshot = avr_adc_snapshot,
 	.irq_names = irq_names,
 };
 
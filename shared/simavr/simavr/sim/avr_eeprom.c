@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -59,6 +60,7 @@ static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void *
 			addr = avr->data[p->r_eearl];
 	//	printf("eeprom write %04x <- %02x\n", addr, avr->data[p->r_eedr]);
 		p->eeprom[addr] = avr->data[p->r_eedr];	
+		avr_raise_irq(p->io.irq + EEPROM_IRQ_WRITE, addr);
 		// Automatically clears that bit (?)
 		avr_regbit_clear(avr, p->eempe);
 
@@ -96,6 +98,19 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 			AVR_LOG(port->avr, LOG_TRACE, "EEPROM: %s: AVR_IOCTL_EEPROM_SET Loaded %d at offset %d\n",
 					__FUNCTION__, desc->size, desc->offset);
 		}	break;
+		case AVR_IOCTL_EEPROM_MAP: {
+			avr_eeprom_desc_t * desc = (avr_eeprom_desc_t*)io_param;
+			if (!desc || !desc->ee || desc->offset || desc->size != p->size) {
+				AVR_LOG(port->avr, LOG_WARNING, "EEPROM: %s: AVR_IOCTL_EEPROM_MAP Invalid argument\n",
+						__FUNCTION__);
+				return -2;
+			}
+			if (!p->external)
+				free(p->eeprom);
+			p->eeprom = desc->ee;
+			p->external = 1;
+			res = 0;
+		}	break;
 		case AVR_IOCTL_EEPROM_GET: {
 			avr_eeprom_desc_t * desc = (avr_eeprom_desc_t*)io_param;
 			if (!desc || (desc->offset + desc->size) > p->size) {
@@ -116,15 +131,30 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 static void avr_eeprom_dealloc(struct avr_io_t * port)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
-	if (p->eeprom)
+	if (p->eeprom && !p->external)
 		free(p->eeprom);
 	p->eeprom = NULL;
 }
 
+static void avr_eeprom_snapshot(struct avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+
+	avr_snapshot_data(s, "eeprom", p->eeprom, p->size);
+	avr_snapshot_timer(s, avr_eempe_clear, p);
+	avr_snapshot_timer(s, avr_eei_raise, p);
+}
+
+static const char * irq_names[EEPROM_IRQ_COUNT] = {
+	[EEPROM_IRQ_WRITE] = "16>write",
+};
+
 static	avr_io_t	_io = {
 	.kind = "eeprom",
+	.irq_names = irq_names,
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.snapshot = avr_eeprom_snapshot,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
@@ -138,6 +168,8 @@ void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
 	
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->ready);
+	// allocate this module's IRQ
+	avr_io_setirqs(&p->io, AVR_IOCTL_EEPROM_GETIRQ, EEPROM_IRQ_COUNT, NULL);
 
 	avr_register_io_write(avr, p->r_eecr, avr_eeprom_write, p);
 }
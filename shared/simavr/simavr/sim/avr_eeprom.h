@@ -28,11 +28,17 @@ extern "C" {
 
 #include "sim_avr.h"
 
+enum {
+	EEPROM_IRQ_WRITE = 0,	// raised with the address of each byte written
+	EEPROM_IRQ_COUNT
+};
+
 typedef struct avr_eeprom_t {
 	avr_io_t	io;
 
 	uint8_t *	eeprom;	// actual bytes
 	uint16_t	size;	// size for this MCU
+	uint8_t		external;	// 'eeprom' was given with AVR_IOCTL_EEPROM_MAP
 	
 	uint8_t r_eearh;
 	uint8_t r_eearl;
@@ -58,6 +64,13 @@ typedef struct avr_eeprom_desc_t {
 
 #define AVR_IOCTL_EEPROM_GET	AVR_IOCTL_DEF('e','e','g','p')
 #define AVR_IOCTL_EEPROM_SET	AVR_IOCTL_DEF('e','e','s','p')
+/*
+ * Use 'ee' (the whole 'size' of the eeprom, offset 0) as the storage from
+ * now on, for example a file mapped in memory. It's content is used as is,
+ * and it's not free()d by the module
+ */
+#define AVR_IOCTL_EEPROM_MAP	AVR_IOCTL_DEF('e','e','m','p')
+#define AVR_IOCTL_EEPROM_GETIRQ	AVR_IOCTL_DEF('e','e','i','r')
 
 
 /*
@@ -73,10 +73,12 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		if (avr_regbit_get(avr, p->pgers)) {
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_raise_irq(p->io.irq + FLASH_IRQ_WRITE, z);
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
 			z &= ~1;
+			avr_raise_irq(p->io.irq + FLASH_IRQ_WRITE, z);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
 				avr->flash[z++] = p->tmppage[i];
 				avr->flash[z++] = p->tmppage[i] >> 8;
@@ -120,8 +122,13 @@ avr_flash_dealloc(struct avr_io_t * port)
 		free(p->tmppage_used);
 }
 
+static const char * irq_names[FLASH_IRQ_COUNT] = {
+	[FLASH_IRQ_WRITE] = "32>write",
+};
+
 static	avr_io_t	_io = {
 	.kind = "flash",
+	.irq_names = irq_names,
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
@@ -140,6 +147,8 @@ void avr_flash_init(avr_t * avr, avr_flash_t * p)
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->flash);
+	// allocate this module's IRQ
+	avr_io_setirqs(&p->io, AVR_IOCTL_FLASH_GETIRQ, FLASH_IRQ_COUNT, NULL);
 
 	avr_register_io_write(avr, p->r_spm, avr_flash_write, p);
 }
@@ -29,6 +29,11 @@ extern "C" {
 
 #include "sim_avr.h"
 
+enum {
+	FLASH_IRQ_WRITE = 0,	// raised with the address of each page erased or written
+	FLASH_IRQ_COUNT
+};
+
 /*
  * Handles self-programming subsystem if the core
  * supports it.
@@ -58,6 +63,7 @@ void avr_flash_init(avr_t * avr, avr_flash_t * p);
 
 
 #define AVR_IOCTL_FLASH_SPM		AVR_IOCTL_DEF('f','s','p','m')
+#define AVR_IOCTL_FLASH_GETIRQ	AVR_IOCTL_DEF('f','s','i','r')
 
 #define AVR_SELFPROG_DECLARE_INTERNAL(_spmr, _spen, _vector) \
 		.r_spm = _spmr,\
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
 #define D(_w)
 
@@ -223,6 +224,20 @@ avr_ioport_ioctl(
 	return res;
 }
 
+/*
+ * The registers and pin IRQs are saved by the core, only the
+ * external pull ups/downs are left
+ */
+static void
+avr_ioport_snapshot(
+		struct avr_io_t * port,
+		avr_snapshot_t * s)
+{
+	avr_ioport_t * p = (avr_ioport_t *)port;
+
+	AVR_SNAPSHOT(s, p->external);
+}
+
 static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_PIN0] = "=pin0",
 	[IOPORT_IRQ_PIN1] = "=pin1",
@@ -242,6 +257,7 @@ static	avr_io_t	_io = {
 	.kind = "port",
 	.reset = avr_ioport_reset,
 	.ioctl = avr_ioport_ioctl,
+	.snapshot = avr_ioport_snapshot,
 	.irq_names = irq_names,
 };
 
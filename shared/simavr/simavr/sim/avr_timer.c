@@ -28,6 +28,7 @@
 #include "avr_timer.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
+#include "sim_snapshot.h"
 
 /*
  * The timers are /always/ 16 bits here, if the higher byte register
@@ -472,6 +473,26 @@ static void avr_timer_reset(avr_io_t * port)
 
 }
 
+static void avr_timer_snapshot(avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_timer_t * p = (avr_timer_t *)port;
+
+	AVR_SNAPSHOT(s, p->mode);
+	AVR_SNAPSHOT(s, p->wgm_op_mode_kind);
+	AVR_SNAPSHOT(s, p->wgm_op_mode_size);
+	AVR_SNAPSHOT(s, p->cs_div_clock);
+	AVR_SNAPSHOT(s, p->tov_cycles);
+	AVR_SNAPSHOT(s, p->tov_base);
+	AVR_SNAPSHOT(s, p->tov_top);
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		AVR_SNAPSHOT(s, p->comp[compi].comp_cycles);
+
+	avr_snapshot_timer(s, avr_timer_tov, p);
+	avr_snapshot_timer(s, avr_timer_compa, p);
+	avr_snapshot_timer(s, avr_timer_compb, p);
+	avr_snapshot_timer(s, avr_timer_compc, p);
+}
+
 static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_PWM0] = "8>pwm0",
 	[TIMER_IRQ_OUT_PWM1] = "8>pwm1",
@@ -483,6 +504,7 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 static	avr_io_t	_io = {
 	.kind = "timer",
 	.reset = avr_timer_reset,
+	.snapshot = avr_timer_snapshot,
 	.irq_names = irq_names,
 };
 
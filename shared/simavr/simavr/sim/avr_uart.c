@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include "avr_uart.h"
 #include "sim_hex.h"
+#include "sim_snapshot.h"
 
 //#define TRACE(_w) _w
 #ifndef TRACE
@@ -64,6 +65,18 @@ static avr_cycle_count_t avr_uart_rxc_raise(struct avr_t * avr, avr_cycle_count_
 	return 0;
 }
 
+/*
+ * Schedule 'timer' for when the current byte is done "on the wire", or
+ * after the minimal delay if the baud rate is ignored
+ */
+static void avr_uart_byte_timer(struct avr_t * avr, avr_uart_t * p, avr_cycle_timer_t timer)
+{
+	if (p->flags & AVR_UART_FLAG_FAST)
+		avr_cycle_timer_register(avr, p->fast_cycles, timer, p);
+	else
+		avr_cycle_timer_register_usec(avr, p->usec_per_byte, timer, p);
+}
+
 static uint8_t avr_uart_rxc_read(struct avr_t * avr, avr_io_addr_t addr, void * param)
 {
 	avr_uart_t * p = (avr_uart_t *)param;
@@ -116,7 +129,7 @@ static uint8_t avr_uart_read(struct avr_t * avr, avr_io_addr_t addr, void * para
 
 	// trigger timer if more characters are pending
 	if (!uart_fifo_isempty(&p->input))
-		avr_cycle_timer_register_usec(avr, p->usec_per_byte, avr_uart_rxc_raise, p);
+		avr_uart_byte_timer(avr, p, avr_uart_rxc_raise);
 
 	return v;
 }
@@ -152,8 +165,7 @@ static void avr_uart_udr_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v
 
 	if ( p->udrc.vector)
 		avr_regbit_clear(avr, p->udrc.raised);
-	avr_cycle_timer_register_usec(avr,
-			p->usec_per_byte, avr_uart_txc_raise, p); // should be uart speed dependent
+	avr_uart_byte_timer(avr, p, avr_uart_txc_raise);
 
 	if (p->flags & AVR_UART_FLAG_STDIO) {
 		const int maxsize = 256;
@@ -218,7 +230,7 @@ static void avr_uart_irq_input(struct avr_irq_t * irq, uint32_t value, void * pa
 		return;
 
 	if (uart_fifo_isempty(&p->input))
-		avr_cycle_timer_register_usec(avr, p->usec_per_byte, avr_uart_rxc_raise, p); // should be uart speed dependent
+		avr_uart_byte_timer(avr, p, avr_uart_rxc_raise);
 	uart_fifo_write(&p->input, value); // add to fifo
 
 	TRACE(printf("UART IRQ in %02x (%d/%d) %s\n", value, p->input.read, p->input.write, uart_fifo_isfull(&p->input) ? "FULL!!" : "");)
@@ -263,10 +275,28 @@ static int avr_uart_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
 		*(uint32_t*)io_param = p->flags;
 		res = 0;
 	}
+	if (ctl == AVR_IOCTL_UART_SET_FAST_CYCLES(p->name)) {
+		p->fast_cycles = *(uint32_t*)io_param;
+		res = 0;
+	}
 
 	return res;
 }
 
+/*
+ * The flags and fast_cycles are left alone, they are set by whoever
+ * runs the simulation, not by the firmware
+ */
+static void avr_uart_snapshot(struct avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_uart_t * p = (avr_uart_t *)port;
+
+	AVR_SNAPSHOT(s, p->input);
+	AVR_SNAPSHOT(s, p->usec_per_byte);
+	avr_snapshot_timer(s, avr_uart_rxc_raise, p);
+	avr_snapshot_timer(s, avr_uart_txc_raise, p);
+}
+
 static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_INPUT] = "8<in",
 	[UART_IRQ_OUTPUT] = "8>out",
@@ -278,6 +308,7 @@ static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
+	.snapshot = avr_uart_snapshot,
 	.irq_names = irq_names,
 };
 
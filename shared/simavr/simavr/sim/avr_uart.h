@@ -30,7 +30,15 @@ extern "C" {
 
 #include "fifo_declare.h"
 
-DECLARE_FIFO(uint8_t, uart_fifo, 64);
+/*
+ * Depth of the input fifo. The default (64) is already deeper than the
+ * real hardware; define it bigger (power of two) to let external parts
+ * push longer bursts between XON/XOFF.
+ */
+#ifndef AVR_UART_FIFO_SIZE
+#define AVR_UART_FIFO_SIZE	64
+#endif
+DECLARE_FIFO(uint8_t, uart_fifo, AVR_UART_FIFO_SIZE);
 
 /*
  * The method of "connecting" the the UART from external code is to use 4 IRQS.
@@ -81,6 +89,10 @@ enum {
 	// if it's detected, this helps regulating CPU
 	AVR_UART_FLAG_POOL_SLEEP = (1 << 0),
 	AVR_UART_FLAG_STDIO = (1 << 1),			// print lines on the console
+	// ignore the baud rate, and complete each byte after 'fast_cycles'
+	// instead. Interrupts are still raised via the same cycle timers, so
+	// ordering of UDRE/TXC/RXC is preserved, just (much) sooner.
+	AVR_UART_FLAG_FAST = (1 << 2),
 };
 
 typedef struct avr_uart_t {
@@ -110,6 +122,7 @@ typedef struct avr_uart_t {
 
 	uint32_t		flags;
 	avr_cycle_count_t usec_per_byte;
+	avr_cycle_count_t fast_cycles;	// cycles per byte with AVR_UART_FLAG_FAST
 
 	uint8_t *		stdio_out;
 	int				stdio_len;	// current size in the stdio output
@@ -118,6 +131,8 @@ typedef struct avr_uart_t {
 /* takes a uint32_t* as parameter */
 #define AVR_IOCTL_UART_SET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','s',(_name))
 #define AVR_IOCTL_UART_GET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','g',(_name))
+/* takes a uint32_t* as parameter, number of cycles per byte in 'fast' mode */
+#define AVR_IOCTL_UART_SET_FAST_CYCLES(_name)	AVR_IOCTL_DEF('u','a','f',(_name))
 
 void avr_uart_init(avr_t * avr, avr_uart_t * port);
 
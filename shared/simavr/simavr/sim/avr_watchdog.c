@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_snapshot.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -200,10 +201,20 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(&p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static void avr_watchdog_snapshot(struct avr_io_t * port, avr_snapshot_t * s)
+{
+	avr_watchdog_t * p = (avr_watchdog_t *)port;
+
+	AVR_SNAPSHOT(s, p->cycle_count);
+	avr_snapshot_timer(s, avr_watchdog_timer, p);
+	avr_snapshot_timer(s, avr_wdce_clear, p);
+}
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.snapshot = avr_watchdog_snapshot,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
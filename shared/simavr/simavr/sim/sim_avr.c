@@ -215,7 +215,15 @@ void avr_loadcode(avr_t * avr, uint8_t * code, uint32_t size, avr_flashaddr_t ad
 			size, avr->flashend + 1);
 		abort();
 	}
-	memcpy(avr->flash + address, code, size);
+	/*
+	 * The flash might be a file or copy-on-write mapping that already
+	 * holds this code, only write the pages that differ
+	 */
+	for (uint32_t o = 0; o < size; o += 256) {
+		uint32_t l = size - o < 256 ? size - o : 256;
+		if (memcmp(avr->flash + address + o, code + o, l))
+			memcpy(avr->flash + address + o, code + o, l);
+	}
 }
 
 /**
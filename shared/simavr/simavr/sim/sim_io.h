@@ -35,6 +35,8 @@ extern "C" {
 #define AVR_IOCTL_DEF(_a,_b,_c,_d) \
 	(((_a) << 24)|((_b) << 16)|((_c) << 8)|((_d)))
 
+struct avr_snapshot_t;
+
 /*
  * IO module base struct
  * Modules uses that as their first member in their own struct
@@ -56,6 +58,8 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	// optional, save/restore the module's internal state, see sim_snapshot.h
+	void (*snapshot)(struct avr_io_t *io, struct avr_snapshot_t *s);
 } avr_io_t;
 
 /*
@@ -0,0 +1,422 @@
+/*
+	sim_snapshot.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "sim_snapshot.h"
+
+static const char magic[8] = "SIMAVRSN";
+
+// modulo a cursor value on the pending interrupt fifo
+#define INT_FIFO_SIZE (sizeof(table->pending) / sizeof(avr_int_vector_t *))
+#define INT_FIFO_MOD(_v) ((_v) &  (INT_FIFO_SIZE - 1))
+
+static void
+_avr_snapshot_rw(
+		avr_snapshot_t * s,
+		void * data,
+		uint32_t size)
+{
+	if (s->error || !size)
+		return;
+	size_t r = s->restore ?
+			fread(data, 1, size, s->f) :
+			fwrite(data, 1, size, s->f);
+	if (r != size) {
+		AVR_LOG(s->avr, LOG_ERROR, "SNAPSHOT: %s\n",
+				s->restore ? "file is truncated" : "write error");
+		s->error = -1;
+	}
+}
+
+void
+avr_snapshot_data(
+		avr_snapshot_t * s,
+		const char * name,
+		void * data,
+		uint32_t size)
+{
+	if (s->error)
+		return;
+	uint8_t l = strlen(name) > 255 ? 255 : strlen(name);
+	uint32_t saved = size;
+	char n[256];
+
+	if (!s->restore) {
+		_avr_snapshot_rw(s, &l, 1);
+		_avr_snapshot_rw(s, (void*)name, l);
+		_avr_snapshot_rw(s, &saved, sizeof(saved));
+		_avr_snapshot_rw(s, data, size);
+		return;
+	}
+	_avr_snapshot_rw(s, &l, 1);
+	_avr_snapshot_rw(s, n, l);
+	n[l] = 0;
+	_avr_snapshot_rw(s, &saved, sizeof(saved));
+	if (s->error)
+		return;
+	if (strncmp(n, name, 255) || saved != size) {
+		AVR_LOG(s->avr, LOG_ERROR,
+				"SNAPSHOT: expected '%s' (%u bytes), found '%s' (%u bytes)\n",
+				name, size, n, saved);
+		s->error = -1;
+		return;
+	}
+	_avr_snapshot_rw(s, data, size);
+}
+
+void
+avr_snapshot_timer(
+		avr_snapshot_t * s,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	if (s->timer_count == MAX_CYCLE_TIMERS) {
+		AVR_LOG(s->avr, LOG_ERROR, "SNAPSHOT: too many timers\n");
+		s->error = -1;
+		return;
+	}
+	s->timer[s->timer_count].timer = timer;
+	s->timer[s->timer_count].param = param;
+	s->timer_count++;
+}
+
+static int
+avr_snapshot_timer_index(
+		avr_snapshot_t * s,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	for (int i = 0; i < s->timer_count; i++)
+		if (s->timer[i].timer == timer && s->timer[i].param == param)
+			return i;
+	return -1;
+}
+
+/*
+ * Registers, memories and cycle count
+ */
+static void
+avr_snapshot_core(
+		avr_snapshot_t * s)
+{
+	avr_t * avr = s->avr;
+	char mmcu[32] = {0};
+	uint32_t sizes[3] = { avr->ramend, avr->flashend, avr->e2end };
+
+	snprintf(mmcu, sizeof(mmcu), "%s", avr->mmcu);
+	AVR_SNAPSHOT(s, mmcu);
+	AVR_SNAPSHOT(s, sizes);
+	if (s->restore && !s->error && (strcmp(mmcu, avr->mmcu) ||
+			sizes[0] != avr->ramend || sizes[1] != avr->flashend ||
+			sizes[2] != avr->e2end)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: saved from a %s, this is a %s\n",
+				mmcu, avr->mmcu);
+		s->error = -1;
+	}
+	AVR_SNAPSHOT(s, avr->frequency);
+	AVR_SNAPSHOT(s, avr->cycle);
+	AVR_SNAPSHOT(s, avr->state);
+	AVR_SNAPSHOT(s, avr->pc);
+	AVR_SNAPSHOT(s, avr->sreg);
+	AVR_SNAPSHOT(s, avr->interrupt_state);
+	avr_snapshot_data(s, "data", avr->data, avr->ramend + 1);
+
+	/*
+	 * The flash might be a copy-on-write mapping shared with other
+	 * instances, only write back the pages that actually changed
+	 */
+	uint32_t size = avr->flashend + 1;
+	uint8_t * flash = s->restore ? malloc(size) : avr->flash;
+	avr_snapshot_data(s, "flash", flash, size);
+	if (s->restore) {
+		for (uint32_t o = 0; o < size && !s->error; o += 256) {
+			uint32_t l = size - o < 256 ? size - o : 256;
+			if (memcmp(avr->flash + o, flash + o, l))
+				memcpy(avr->flash + o, flash + o, l);
+		}
+		free(flash);
+	}
+}
+
+/*
+ * The pending bits, and the pending fifo, as indexes in the vector table
+ */
+static void
+avr_snapshot_interrupts(
+		avr_snapshot_t * s)
+{
+	avr_int_table_p table = &s->avr->interrupts;
+	uint8_t count = table->vector_count;
+	// one per slot of the vector table, the file format depends on it
+	uint8_t pending[sizeof(table->vector) / sizeof(table->vector[0])] = {0};
+	uint8_t fifo[INT_FIFO_SIZE];
+	uint8_t fifo_count = 0;
+
+	if (table->vector_count > sizeof(pending)) {
+		AVR_LOG(s->avr, LOG_ERROR, "SNAPSHOT: %d interrupt vectors, max %d\n",
+				table->vector_count, (int)sizeof(pending));
+		s->error = -1;
+		return;
+	}
+	if (!s->restore) {
+		for (int i = 0; i < table->vector_count; i++)
+			pending[i] = table->vector[i]->pending;
+		for (uint8_t r = table->pending_r; r != table->pending_w;
+				r = INT_FIFO_MOD(r + 1))
+			for (int i = 0; i < table->vector_count; i++)
+				if (table->vector[i] == table->pending[r] &&
+						fifo_count < INT_FIFO_SIZE)
+					fifo[fifo_count++] = i;
+	}
+	AVR_SNAPSHOT(s, count);
+	AVR_SNAPSHOT(s, pending);
+	AVR_SNAPSHOT(s, fifo_count);
+	if (fifo_count > INT_FIFO_SIZE || count > sizeof(pending) ||
+			(s->restore && count != table->vector_count)) {
+		AVR_LOG(s->avr, LOG_ERROR, "SNAPSHOT: interrupt table mismatch\n");
+		s->error = -1;
+	}
+	avr_snapshot_data(s, "fifo", fifo, fifo_count);
+	if (!s->restore || s->error)
+		return;
+	table->pending_r = table->pending_w = 0;
+	for (int i = 0; i < table->vector_count; i++)
+		table->vector[i]->pending = pending[i];
+	for (int i = 0; i < fifo_count; i++) {
+		table->pending[table->pending_w++] = table->vector[fifo[i]];
+		table->pending_w = INT_FIFO_MOD(table->pending_w);
+	}
+}
+
+/*
+ * IRQ values are matched by name, in allocation order, so the restoring
+ * side can have a different set of parts attached (say, a gcode streamer
+ * instead of a pty); IRQs that aren't in both are just left alone.
+ * They are restored quietly, without calling the hooks.
+ */
+static void
+avr_snapshot_irqs(
+		avr_snapshot_t * s)
+{
+	avr_irq_pool_t * pool = &s->avr->irq_pool;
+	uint32_t count = 0;
+
+	if (!s->restore) {
+		for (int i = 0; i < pool->count; i++)
+			if (pool->irq[i] && pool->irq[i]->name)
+				count++;
+		AVR_SNAPSHOT(s, count);
+		for (int i = 0; i < pool->count; i++) {
+			avr_irq_t * irq = pool->irq[i];
+			if (!irq || !irq->name)
+				continue;
+			uint8_t flags = irq->flags & IRQ_FLAG_INIT;
+			uint8_t l = strlen(irq->name) > 255 ? 255 : strlen(irq->name);
+			_avr_snapshot_rw(s, &l, 1);
+			_avr_snapshot_rw(s, (void*)irq->name, l);
+			_avr_snapshot_rw(s, &irq->value, sizeof(irq->value));
+			_avr_snapshot_rw(s, &flags, 1);
+		}
+		return;
+	}
+	AVR_SNAPSHOT(s, count);
+	if (s->error)
+		return;
+	struct {
+		char		name[256];
+		uint32_t	value;
+		uint8_t		flags;
+		uint8_t		used;
+	} * saved = calloc(count, sizeof(*saved));
+	for (int si = 0; si < count && !s->error; si++) {
+		uint8_t l;
+		_avr_snapshot_rw(s, &l, 1);
+		_avr_snapshot_rw(s, saved[si].name, l);
+		_avr_snapshot_rw(s, &saved[si].value, sizeof(saved[si].value));
+		_avr_snapshot_rw(s, &saved[si].flags, 1);
+	}
+	int matched = 0;
+	for (int i = 0; i < pool->count && !s->error; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq || !irq->name)
+			continue;
+		for (int si = 0; si < count; si++) {
+			if (saved[si].used || strncmp(saved[si].name, irq->name, 255))
+				continue;
+			saved[si].used = 1;
+			irq->value = saved[si].value;
+			irq->flags = (irq->flags & ~IRQ_FLAG_INIT) |
+					(saved[si].flags & IRQ_FLAG_INIT);
+			matched++;
+			break;
+		}
+	}
+	if (matched != count)
+		AVR_LOG(s->avr, LOG_WARNING, "SNAPSHOT: %d of %d IRQs restored\n",
+				matched, count);
+	free(saved);
+}
+
+static void
+avr_snapshot_ios(
+		avr_snapshot_t * s)
+{
+	for (avr_io_t * port = s->avr->io_port; port; port = port->next) {
+		if (!port->snapshot)
+			continue;
+		avr_snapshot_data(s, port->kind, NULL, 0);
+		port->snapshot(port, s);
+	}
+}
+
+/*
+ * Pending timers are saved in the order they are queued, so ones that
+ * are due on the same cycle still fire in the same order once restored.
+ */
+static void
+avr_snapshot_timers(
+		avr_snapshot_t * s)
+{
+	avr_t * avr = s->avr;
+	uint8_t count = 0;
+	uint8_t index[MAX_CYCLE_TIMERS];
+	avr_cycle_count_t when[MAX_CYCLE_TIMERS];
+
+	if (!s->restore) {
+		for (avr_cycle_timer_slot_p t = avr->cycle_timers.timer; t; t = t->next) {
+			int i = avr_snapshot_timer_index(s, t->timer, t->param);
+			if (i < 0) {
+				AVR_LOG(avr, LOG_WARNING,
+						"SNAPSHOT: timer %p(%p) has no owner, not saved\n",
+						t->timer, t->param);
+				continue;
+			}
+			index[count] = i;
+			when[count] = t->when;
+			count++;
+		}
+	}
+	AVR_SNAPSHOT(s, count);
+	if (count > MAX_CYCLE_TIMERS) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: too many timers\n");
+		s->error = -1;
+	}
+	avr_snapshot_data(s, "index", index, count * sizeof(index[0]));
+	avr_snapshot_data(s, "when", when, count * sizeof(when[0]));
+	if (!s->restore || s->error)
+		return;
+
+	for (int i = 0; i < s->timer_count; i++)
+		avr_cycle_timer_cancel(avr, s->timer[i].timer, s->timer[i].param);
+	avr_cycle_count_t now = avr->cycle;
+	for (int i = 0; i < count; i++) {
+		if (index[i] >= s->timer_count) {
+			AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: unknown timer %d\n", index[i]);
+			s->error = -1;
+			break;
+		}
+		// a timer can be overdue, keep it's exact 'when' anyway
+		if (when[i] < now)
+			avr->cycle = when[i];
+		avr_cycle_timer_register(avr, when[i] - avr->cycle,
+				s->timer[index[i]].timer, s->timer[index[i]].param);
+		avr->cycle = now;
+	}
+}
+
+int
+avr_snapshot_begin(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		const char * filename,
+		int restore)
+{
+	memset(s, 0, sizeof(*s));
+	s->avr = avr;
+	s->restore = restore;
+	s->f = fopen(filename, restore ? "rb" : "wb");
+	if (!s->f) {
+		perror(filename);
+		s->error = -1;
+		return -1;
+	}
+	char m[sizeof(magic)];
+	uint32_t version = AVR_SNAPSHOT_VERSION;
+	memcpy(m, magic, sizeof(m));
+	_avr_snapshot_rw(s, m, sizeof(m));
+	_avr_snapshot_rw(s, &version, sizeof(version));
+	if (!s->error && (memcmp(m, magic, sizeof(m)) ||
+			version != AVR_SNAPSHOT_VERSION)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s is not a version %d snapshot\n",
+				filename, AVR_SNAPSHOT_VERSION);
+		s->error = -1;
+	}
+	avr_snapshot_core(s);
+	avr_snapshot_interrupts(s);
+	avr_snapshot_irqs(s);
+	avr_snapshot_ios(s);
+	return s->error;
+}
+
+int
+avr_snapshot_end(
+		avr_snapshot_t * s)
+{
+	if (!s->f)
+		return -1;
+	avr_t * avr = s->avr;
+	avr_snapshot_timers(s);
+	AVR_SNAPSHOT(s, avr->run_cycle_count);
+	AVR_SNAPSHOT(s, avr->run_cycle_limit);
+	if (fclose(s->f) && !s->restore)
+		s->error = -1;
+	s->f = NULL;
+	if (!s->error)
+		AVR_LOG(avr, LOG_TRACE, "SNAPSHOT: %s at cycle %llu\n",
+				s->restore ? "restored" : "saved",
+				(unsigned long long)avr->cycle);
+	return s->error;
+}
+
+int
+avr_snapshot_save(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_snapshot_t s;
+	avr_snapshot_begin(avr, &s, filename, 0);
+	return avr_snapshot_end(&s);
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_snapshot_t s;
+	avr_snapshot_begin(avr, &s, filename, 1);
+	return avr_snapshot_end(&s);
+}
@@ -0,0 +1,134 @@
+/*
+	sim_snapshot.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine checkpoint: saves the whole state of a running avr_t to a file,
+ * and restores it into a freshly initialized one with the same MCU, the
+ * same IO modules and the same parts attached.
+ *
+ * Saving and restoring use the very same code path; avr_snapshot_data()
+ * writes a named block when saving, and reads/verifies it when restoring,
+ * so modules and parts only have to list their runtime state once.
+ *
+ * The core takes care of registers, SRAM, flash, interrupts, the IRQ values
+ * (matched by name) and calls each IO module 'snapshot' callback. Cycle timers
+ * can't be saved blindly as they are function pointers, so each owner
+ * declares the ones it uses with avr_snapshot_timer(), and the core saves
+ * the pending ones in the order they were queued, and re-arms them.
+ *
+ * Typical use, with external parts:
+ *	avr_snapshot_t s;
+ *	avr_snapshot_begin(avr, &s, "file", 0);	// or 1 to restore
+ *	stepper_snapshot(&stepper, &s);
+ *	...
+ *	if (avr_snapshot_end(&s)) ... error
+ *
+ * The format is host native, it's only meant to be read back by the same
+ * simulator build:
+ *	"SIMAVRSN", uint32 version, then blocks of
+ *	uint8 name length, name, uint32 size, data
+ */
+#ifndef __SIM_SNAPSHOT_H___
+#define __SIM_SNAPSHOT_H___
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_SNAPSHOT_VERSION	1
+
+typedef struct avr_snapshot_t {
+	avr_t *		avr;
+	FILE *		f;
+	int			restore;	// 0 when saving, 1 when restoring
+	int			error;		// sticky, once set everything else is ignored
+
+	// timers declared by their owners, see avr_snapshot_timer()
+	int			timer_count;
+	struct {
+		avr_cycle_timer_t	timer;
+		void *				param;
+	} timer[MAX_CYCLE_TIMERS];
+} avr_snapshot_t;
+
+/*
+ * Open 'filename' and save (or restore) the core and IO modules state.
+ * External parts can then add their own, before calling avr_snapshot_end().
+ * Returns 0 on success
+ */
+int
+avr_snapshot_begin(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		const char * filename,
+		int restore);
+
+/*
+ * Save (or re-arm) the cycle timers and close the file.
+ * Returns 0 if everything went fine, -1 otherwise
+ */
+int
+avr_snapshot_end(
+		avr_snapshot_t * s);
+
+/*
+ * Save, or restore, 'size' bytes at 'data'. When restoring, the name and
+ * size must match what was saved, otherwise the snapshot is in error and
+ * 'data' is left alone
+ */
+void
+avr_snapshot_data(
+		avr_snapshot_t * s,
+		const char * name,
+		void * data,
+		uint32_t size);
+
+#define AVR_SNAPSHOT(_s, _v) \
+	avr_snapshot_data((_s), #_v, &(_v), sizeof(_v))
+
+/*
+ * Declare a cycle timer owned by the caller, so it is saved if pending,
+ * and re-armed on restore
+ */
+void
+avr_snapshot_timer(
+		avr_snapshot_t * s,
+		avr_cycle_timer_t timer,
+		void * param);
+
+// shortcuts when there are no external parts
+int
+avr_snapshot_save(
+		avr_t * avr,
+		const char * filename);
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		const char * filename);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H___ */
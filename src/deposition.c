@@ -0,0 +1,172 @@
+/*
+	deposition.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sim_avr.h"
+
+#include "deposition.h"
+
+#define DEPOSITION_MIN_HEIGHT	0.05f
+#define DEPOSITION_MAX_HEIGHT	1.0f
+#define DEPOSITION_FIRST_LAYER	0.3f	// when we don't know better
+
+static void
+deposition_emit(
+		deposition_p p,
+		float * to,
+		float e)
+{
+	float dx = to[0] - p->start[0], dy = to[1] - p->start[1];
+	float len = sqrtf(dx * dx + dy * dy);
+	float de = e - p->start_e;
+
+	if (len < 0.001f || de <= 0)
+		return;
+	uint32_t index = p->count;
+	int ci = index >> DEPOSITION_CHUNK_BITS;
+	if (ci == DEPOSITION_MAX_CHUNKS)
+		return;		// that's one long print
+	if (!p->chunk[ci])
+		p->chunk[ci] = malloc(DEPOSITION_CHUNK_SIZE * sizeof(deposition_segment_t));
+
+	// a new layer when the nozzle went up
+	if (to[2] > p->layer_z + 0.01f) {
+		p->prev_layer_z = p->layer_z;
+		p->layer_z = to[2];
+	} else if (to[2] < p->layer_z - 0.01f)	// new print, or a Z hop back
+		p->prev_layer_z = p->layer_z = to[2];
+	float h = p->layer_z - p->prev_layer_z;
+	if (h < DEPOSITION_MIN_HEIGHT || h > DEPOSITION_MAX_HEIGHT)
+		h = DEPOSITION_FIRST_LAYER;
+
+	deposition_segment_t * s = deposition_get(p, index);
+	memcpy(s->a, p->start, sizeof(s->a));
+	memcpy(s->b, to, sizeof(s->b));
+	s->height = h;
+	s->width = de * p->filament_area / (len * h);
+	if (s->width > 4 * h)	// blob, probably priming
+		s->width = 4 * h;
+	// the segment must be all there before the renderer can see it
+	__sync_synchronize();
+	p->count = index + 1;
+
+	memcpy(p->start, to, sizeof(p->start));
+	p->start_e = e;
+}
+
+static void
+deposition_e_step_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	deposition_p p = (deposition_p)param;
+	if (value)
+		return;
+
+	float e = stepper_get_position_mm(p->e);
+	float pos[3] = {
+		stepper_get_position_mm(p->x),
+		stepper_get_position_mm(p->y),
+		stepper_get_position_mm(p->z),
+	};
+	float dx = pos[0] - p->last[0], dy = pos[1] - p->last[1];
+
+	if (e < p->last_e) {	// retraction, the bead stops here
+		if (p->extruding)
+			deposition_emit(p, p->last, p->last_e);
+		p->extruding = 0;
+	} else if (e > p->last_e) {
+		// went somewhere without pushing? don't draw a bead over the travel
+		if (p->extruding && (dx * dx + dy * dy > p->max_gap * p->max_gap ||
+				fabsf(pos[2] - p->last[2]) > 0.05f)) {
+			deposition_emit(p, p->last, p->last_e);
+			p->extruding = 0;
+		}
+		if (!p->extruding) {
+			p->extruding = 1;
+			memcpy(p->start, pos, sizeof(p->start));
+			p->start_e = p->last_e;
+		} else {
+			dx = pos[0] - p->start[0];
+			dy = pos[1] - p->start[1];
+			if (dx * dx + dy * dy >= p->min_length * p->min_length)
+				deposition_emit(p, pos, e);
+		}
+	}
+	memcpy(p->last, pos, sizeof(p->last));
+	p->last_e = e;
+}
+
+static const char * irq_names[IRQ_DEPOSITION_COUNT] = {
+	[IRQ_DEPOSITION_E_STEP_IN] = "1<deposition.e_step",
+};
+
+void
+deposition_init(
+		struct avr_t * avr,
+		deposition_p p,
+		stepper_p x,
+		stepper_p y,
+		stepper_p z,
+		stepper_p e,
+		float filament_diameter )
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->x = x;
+	p->y = y;
+	p->z = z;
+	p->e = e;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_DEPOSITION_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_DEPOSITION_E_STEP_IN,
+			deposition_e_step_hook, p);
+
+	p->filament_area = M_PI * filament_diameter * filament_diameter / 4;
+	p->min_length = 0.2f;
+	p->max_gap = 1.0f;
+	p->last[0] = stepper_get_position_mm(x);
+	p->last[1] = stepper_get_position_mm(y);
+	p->last[2] = p->layer_z = stepper_get_position_mm(z);
+	p->last_e = stepper_get_position_mm(e);
+}
+
+void
+deposition_connect(
+		deposition_p p,
+		avr_irq_t * e_step )
+{
+	avr_connect_irq(e_step, p->irq + IRQ_DEPOSITION_E_STEP_IN);
+}
+
+void
+deposition_dispose(
+		deposition_p p )
+{
+	for (int i = 0; i < DEPOSITION_MAX_CHUNKS && p->chunk[i]; i++) {
+		free(p->chunk[i]);
+		p->chunk[i] = NULL;
+	}
+	p->count = 0;
+}
@@ -0,0 +1,115 @@
+/*
+	deposition.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lays down the plastic: follows the E stepper steps, and when filament is
+ * pushed while the head moves, emits a bead segment from where the push
+ * started to where the head is now. The bead width comes from the volume
+ * of filament pushed, spread over the segment length and layer height.
+ *
+ * Segments are only ever appended, in fixed size chunks that never move,
+ * so the renderer (another thread) can read everything below 'count'
+ * without a lock.
+ */
+#ifndef __DEPOSITION_H___
+#define __DEPOSITION_H___
+
+#include "sim_avr.h"
+#include "stepper.h"
+
+enum {
+	IRQ_DEPOSITION_E_STEP_IN = 0,
+	IRQ_DEPOSITION_COUNT
+};
+
+#define DEPOSITION_CHUNK_BITS	16
+#define DEPOSITION_CHUNK_SIZE	(1 << DEPOSITION_CHUNK_BITS)
+#define DEPOSITION_MAX_CHUNKS	1024	// 64M segments
+
+typedef struct deposition_segment_t {
+	float		a[3], b[3];	// top of the bead, mm
+	float		width;		// mm
+	float		height;		// layer height, mm
+} deposition_segment_t;
+
+typedef struct deposition_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t * avr;
+	stepper_p	x, y, z, e;
+
+	float		filament_area;	// mm2
+	float		min_length;		// segments are at least that long, mm
+	float		max_gap;		// head moved more than that without pushing: travel
+
+	int			extruding;
+	float		start[3];	// of the current segment
+	float		start_e;
+	float		last[3];	// head at the last E step
+	float		last_e;
+	float		layer_z, prev_layer_z;
+
+	volatile uint32_t	count;	// segments published
+	deposition_segment_t * chunk[DEPOSITION_MAX_CHUNKS];
+} deposition_t, *deposition_p;
+
+void
+deposition_init(
+		struct avr_t * avr,
+		deposition_p p,
+		stepper_p x,
+		stepper_p y,
+		stepper_p z,
+		stepper_p e,
+		float filament_diameter );	// mm
+
+/*
+ * Connect to the E stepper step pin
+ */
+void
+deposition_connect(
+		deposition_p p,
+		avr_irq_t * e_step );
+
+/*
+ * Number of segments that can be read, from any thread
+ */
+static inline uint32_t
+deposition_count(
+		deposition_p p )
+{
+	uint32_t res = p->count;
+	__sync_synchronize();
+	return res;
+}
+
+static inline deposition_segment_t *
+deposition_get(
+		deposition_p p,
+		uint32_t index )
+{
+	return &p->chunk[index >> DEPOSITION_CHUNK_BITS][index & (DEPOSITION_CHUNK_SIZE - 1)];
+}
+
+void
+deposition_dispose(
+		deposition_p p );
+
+#endif /* __DEPOSITION_H___ */
@@ -0,0 +1,228 @@
+/*
+	deposition_gl.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if __APPLE__
+#define GL_GLEXT_PROTOTYPES
+#include <GLUT/glut.h>
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glut.h>
+#include <GL/glext.h>
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "deposition_gl.h"
+
+/*
+ * A bead is a "tent": the nozzle path is the ridge, and the two sides go
+ * down one layer height, half the width out. Three vertices per end, four
+ * triangles; the normals are packed as bytes to keep it at 16 bytes
+ */
+typedef struct deposition_gl_vertex_t {
+	float		p[3];
+	int8_t		n[4];
+} deposition_gl_vertex_t;
+
+#define DEPOSITION_GL_VERTICES	6
+#define DEPOSITION_GL_INDICES	12
+
+static const uint8_t deposition_gl_pattern[DEPOSITION_GL_INDICES] = {
+	0, 1, 4,  0, 4, 3,		// left side
+	1, 2, 5,  1, 5, 4,		// right side
+};
+
+static void
+deposition_gl_segment(
+		const deposition_segment_t * s,
+		deposition_gl_vertex_t * v)
+{
+	float dx = s->b[0] - s->a[0], dy = s->b[1] - s->a[1];
+	float l = sqrtf(dx * dx + dy * dy);
+	// 'side' is to the left of the direction of travel
+	float sx = -dy / l, sy = dx / l;
+	float hw = s->width / 2, h = s->height;
+	float nl = sqrtf(h * h + hw * hw);
+	int8_t ns[2] = { 127 * h * sx / nl, 127 * h * sy / nl };
+	int8_t nz = 127 * hw / nl;
+
+	for (int end = 0; end < 2; end++) {
+		const float * c = end ? s->b : s->a;
+		deposition_gl_vertex_t * e = v + end * 3;
+		e[0] = (deposition_gl_vertex_t) {
+			{ c[0] + sx * hw, c[1] + sy * hw, c[2] - h }, { ns[0], ns[1], nz } };
+		e[1] = (deposition_gl_vertex_t) {
+			{ c[0], c[1], c[2] }, { 0, 0, 127 } };
+		e[2] = (deposition_gl_vertex_t) {
+			{ c[0] - sx * hw, c[1] - sy * hw, c[2] - h }, { -ns[0], -ns[1], nz } };
+	}
+}
+
+void
+deposition_gl_init(
+		deposition_gl_p g,
+		deposition_p dep,
+		const float color[4] )
+{
+	memset(g, 0, sizeof(*g));
+	g->dep = dep;
+	g->budget = DEPOSITION_CHUNK_SIZE;
+
+	// the index pattern is the same for every chunk, so is the buffer
+	uint32_t * idx = malloc(DEPOSITION_CHUNK_SIZE * DEPOSITION_GL_INDICES * sizeof(uint32_t));
+	for (uint32_t s = 0, o = 0; s < DEPOSITION_CHUNK_SIZE; s++)
+		for (int i = 0; i < DEPOSITION_GL_INDICES; i++)
+			idx[o++] = s * DEPOSITION_GL_VERTICES + deposition_gl_pattern[i];
+	glGenBuffers(1, &g->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			DEPOSITION_CHUNK_SIZE * DEPOSITION_GL_INDICES * sizeof(uint32_t),
+			idx, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(idx);
+
+	// the scene shader takes the color from texture 0
+	uint8_t rgba[4];
+	for (int i = 0; i < 4; i++)
+		rgba[i] = color[i] * 255;
+	glGenTextures(1, &g->texture);
+	glBindTexture(GL_TEXTURE_2D, g->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static deposition_gl_chunk_t *
+deposition_gl_chunk_new(
+		deposition_gl_p g)
+{
+	deposition_gl_chunk_t * c = &g->chunk[g->chunk_count++];
+
+	glGenVertexArrays(1, &c->vao);
+	glBindVertexArray(c->vao);
+	glGenBuffers(1, &c->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+	// full size once, it's only ever appended to
+	glBufferData(GL_ARRAY_BUFFER,
+			DEPOSITION_CHUNK_SIZE * DEPOSITION_GL_VERTICES * sizeof(deposition_gl_vertex_t),
+			NULL, GL_DYNAMIC_DRAW);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(deposition_gl_vertex_t),
+			(void*)offsetof(deposition_gl_vertex_t, p));
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_BYTE, sizeof(deposition_gl_vertex_t),
+			(void*)offsetof(deposition_gl_vertex_t, n));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->ibo);
+	glBindVertexArray(0);
+	return c;
+}
+
+void
+deposition_gl_update(
+		deposition_gl_p g )
+{
+	uint32_t count = deposition_count(g->dep);
+	uint32_t budget = g->budget;
+
+	while (g->done < count && budget) {
+		int ci = g->done >> DEPOSITION_CHUNK_BITS;
+		deposition_gl_chunk_t * c = ci < g->chunk_count ?
+				&g->chunk[ci] : deposition_gl_chunk_new(g);
+		uint32_t n = count - g->done;
+		if (n > DEPOSITION_CHUNK_SIZE - c->count)
+			n = DEPOSITION_CHUNK_SIZE - c->count;
+		if (n > budget)
+			n = budget;
+
+		/*
+		 * The GPU never reads past 'count', so there is no need to wait
+		 * for it to be done with the buffer before writing there
+		 */
+		const size_t vsize = DEPOSITION_GL_VERTICES * sizeof(deposition_gl_vertex_t);
+		glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+		deposition_gl_vertex_t * v = glMapBufferRange(GL_ARRAY_BUFFER,
+				c->count * vsize, n * vsize,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+				GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!v)
+			break;
+		for (uint32_t i = 0; i < n; i++, v += DEPOSITION_GL_VERTICES)
+			deposition_gl_segment(deposition_get(g->dep, g->done + i), v);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		c->count += n;
+		g->done += n;
+		budget -= n;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void
+deposition_gl_draw(
+		deposition_gl_p g,
+		uint32_t from,
+		uint32_t to )
+{
+	if (to > g->done)
+		to = g->done;
+	if (from >= to)
+		return;
+	glColor4f(1.0, 1.0, 1.0, 1.0);
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, g->texture);
+	glMultiTexCoord2f(GL_TEXTURE0, 0.5, 0.5);
+	for (int i = from >> DEPOSITION_CHUNK_BITS;
+			i <= (to - 1) >> DEPOSITION_CHUNK_BITS; i++) {
+		deposition_gl_chunk_t * c = &g->chunk[i];
+		uint32_t base = i << DEPOSITION_CHUNK_BITS;
+		uint32_t start = from > base ? from - base : 0;
+		uint32_t end = to - base < c->count ? to - base : c->count;
+		glBindVertexArray(c->vao);
+		// the indices are the same pattern for every segment, so skip some
+		glDrawElements(GL_TRIANGLES, (end - start) * DEPOSITION_GL_INDICES,
+				GL_UNSIGNED_INT,
+				(void*)(start * DEPOSITION_GL_INDICES * sizeof(uint32_t)));
+	}
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+}
+
+void
+deposition_gl_dispose(
+		deposition_gl_p g )
+{
+	for (int i = 0; i < g->chunk_count; i++) {
+		glDeleteBuffers(1, &g->chunk[i].vbo);
+		glDeleteVertexArrays(1, &g->chunk[i].vao);
+	}
+	glDeleteBuffers(1, &g->ibo);
+	glDeleteTextures(1, &g->texture);
+	g->chunk_count = 0;
+	g->done = 0;
+}
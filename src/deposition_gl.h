@@ -0,0 +1,78 @@
+/*
+	deposition_gl.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Draws the plastic laid down by a deposition_t. Each chunk of segments
+ * has it's own vertex buffer, allocated full size once, and the new
+ * segments are appended to it as they come; nothing is ever rebuilt, so
+ * a frame costs the new segments plus one draw call per chunk.
+ */
+#ifndef __DEPOSITION_GL_H___
+#define __DEPOSITION_GL_H___
+
+#include "deposition.h"
+
+typedef struct deposition_gl_chunk_t {
+	unsigned int	vao, vbo;
+	uint32_t		count;		// segments uploaded
+} deposition_gl_chunk_t;
+
+typedef struct deposition_gl_t {
+	deposition_p	dep;
+	uint32_t		done;		// segments uploaded, all chunks
+	uint32_t		budget;		// max segments uploaded per frame
+	unsigned int	ibo;		// shared by all the chunks
+	unsigned int	texture;	// plastic color
+	int				chunk_count;
+	deposition_gl_chunk_t	chunk[DEPOSITION_MAX_CHUNKS];
+} deposition_gl_t, *deposition_gl_p;
+
+/*
+ * Needs a GL context; 'color' is RGBA
+ */
+void
+deposition_gl_init(
+		deposition_gl_p g,
+		deposition_p dep,
+		const float color[4] );
+
+/*
+ * Upload the segments that appeared since the last call
+ */
+void
+deposition_gl_update(
+		deposition_gl_p g );
+
+/*
+ * Draw segments 'from' to 'to' (excluded) with the current modelview
+ * matrix and program; 'to' is clipped to what was uploaded
+ */
+void
+deposition_gl_draw(
+		deposition_gl_p g,
+		uint32_t from,
+		uint32_t to );
+
+void
+deposition_gl_dispose(
+		deposition_gl_p g );
+
+#endif /* __DEPOSITION_GL_H___ */
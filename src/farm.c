@@ -0,0 +1,290 @@
+/*
+	farm.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "farm.h"
+
+/*
+ * Split "host:port" into it's parts; the host is NULL for ":port"
+ */
+static int
+farm_address(
+		const char * address,
+		char * host,
+		size_t size,
+		const char ** port)
+{
+	const char * colon = strrchr(address, ':');
+	if (!colon || !colon[1] || colon - address >= size)
+		return -1;
+	memcpy(host, address, colon - address);
+	host[colon - address] = 0;
+	*port = colon + 1;
+	return 0;
+}
+
+static int
+farm_unix(
+		const char * address,
+		struct sockaddr_un * sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(address + 5) >= sizeof(sa->sun_path))
+		return -1;
+	strcpy(sa->sun_path, address + 5);
+	return 0;
+}
+
+int
+farm_listen(
+		const char * address )
+{
+	int fd = -1;
+
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un sa;
+		if (farm_unix(address, &sa))
+			goto bad_address;
+		unlink(sa.sun_path);	// left over from a previous run
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+				bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			goto error;
+	} else {
+		char host[256];
+		const char * port;
+		if (farm_address(address, host, sizeof(host), &port))
+			goto bad_address;
+		struct addrinfo hints = {
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+			.ai_flags = AI_PASSIVE,
+		}, * res;
+		int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+		if (err) {
+			fprintf(stderr, "%s: %s: %s\n", __func__, address, gai_strerror(err));
+			return -1;
+		}
+		int one = 1;
+		if ((fd = socket(res->ai_family, SOCK_STREAM, 0)) < 0 ||
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+				bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+			freeaddrinfo(res);
+			goto error;
+		}
+		freeaddrinfo(res);
+	}
+	if (listen(fd, 64) < 0)
+		goto error;
+	return fd;
+bad_address:
+	fprintf(stderr, "%s: invalid address '%s'\n", __func__, address);
+	return -1;
+error:
+	fprintf(stderr, "%s: %s: %s\n", __func__, address, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+int
+farm_connect(
+		const char * address )
+{
+	int fd = -1;
+
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un sa;
+		if (farm_unix(address, &sa))
+			return -1;
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+				connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+			goto error;
+		return fd;
+	}
+	char host[256];
+	const char * port;
+	if (farm_address(address, host, sizeof(host), &port))
+		return -1;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	}, * res;
+	if (getaddrinfo(host[0] ? host : "localhost", port, &hints, &res))
+		return -1;
+	for (struct addrinfo * a = res; a; a = a->ai_next) {
+		if ((fd = socket(a->ai_family, SOCK_STREAM, 0)) < 0)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		return -1;
+	// the lines are small and we wait on the answers
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+error:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+void
+farm_conn_init(
+		farm_conn_t * c,
+		int fd )
+{
+	c->fd = fd;
+	c->pos = c->len = 0;
+}
+
+static int
+farm_fill(
+		farm_conn_t * c)
+{
+	ssize_t r;
+	do {
+		r = read(c->fd, c->buf, sizeof(c->buf));
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0)
+		return -1;
+	c->pos = 0;
+	c->len = r;
+	return 0;
+}
+
+int
+farm_read_line(
+		farm_conn_t * c,
+		char * line,
+		size_t size )
+{
+	size_t l = 0;
+
+	while (1) {
+		if (c->pos == c->len && farm_fill(c))
+			return -1;
+		char ch = c->buf[c->pos++];
+		if (ch == '\n')
+			break;
+		if (l == size - 1)
+			return -1;
+		line[l++] = ch;
+	}
+	if (l && line[l - 1] == '\r')
+		l--;
+	line[l] = 0;
+	return l;
+}
+
+int
+farm_read(
+		farm_conn_t * c,
+		void * data,
+		size_t size )
+{
+	uint8_t * d = data;
+
+	while (size) {
+		if (c->pos == c->len && farm_fill(c))
+			return -1;
+		size_t n = c->len - c->pos;
+		if (n > size)
+			n = size;
+		memcpy(d, c->buf + c->pos, n);
+		c->pos += n;
+		d += n;
+		size -= n;
+	}
+	return 0;
+}
+
+void *
+farm_read_payload(
+		farm_conn_t * c,
+		size_t size )
+{
+	if (size > FARM_MAX_PAYLOAD)
+		return NULL;
+	void * res = malloc(size + 1);
+	if (!res)
+		return NULL;
+	if (farm_read(c, res, size)) {
+		free(res);
+		return NULL;
+	}
+	((char *)res)[size] = 0;	// handy for text
+	return res;
+}
+
+int
+farm_write(
+		farm_conn_t * c,
+		const void * data,
+		size_t size )
+{
+	const uint8_t * d = data;
+
+	while (size) {
+		// don't die of SIGPIPE when the other end is gone
+		ssize_t w = send(c->fd, d, size, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		d += w;
+		size -= w;
+	}
+	return 0;
+}
+
+int
+farm_send(
+		farm_conn_t * c,
+		const char * format,
+		... )
+{
+	char line[1024];
+	va_list ap;
+
+	va_start(ap, format);
+	int l = vsnprintf(line, sizeof(line) - 1, format, ap);
+	va_end(ap);
+	if (l < 0 || l >= sizeof(line) - 1)
+		return -1;
+	line[l++] = '\n';
+	return farm_write(c, line, l);
+}
@@ -0,0 +1,127 @@
+/*
+	farm.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulation farm: a coordinator (farm_coordinator.elf) hands out jobs, a
+ * firmware, a bit of config and a gcode file, to workers (farm_worker.elf)
+ * that run them and send back metrics and artifacts (summary, host log...).
+ *
+ * Each worker slot is one connection, and runs one job at a time. The
+ * protocol is lines of text, some followed by a payload of the size given
+ * in the line.
+ *
+ * Worker to coordinator:
+ *	HELLO <name>
+ *	READY					wants a job
+ *	PROGRESS <id> <lines> <sim_sec>
+ *	ARTIFACT <id> <size> <name>		followed by <size> bytes
+ *	RESULT <id> <status> <sim_sec> <wall_sec>	the job is over
+ * Coordinator to worker:
+ *	JOB <id> <timeout_sec> <fast_uart> <firmware_size> <gcode_size> <name_size> <firmware>
+ *						followed by the job name, the firmware, then the gcode;
+ *						the firmware is "-", size 0, for the default
+ *						(the job name is a file name, it can have spaces)
+ *	BYE					nothing left, come back later
+ *
+ * A worker that doesn't say anything for a while (it sends PROGRESS every
+ * second while running) is dropped, and it's job is requeued.
+ *
+ * Addresses are "host:port", ":port" for all the interfaces, or
+ * "unix:path" for a local socket.
+ */
+#ifndef __FARM_H___
+#define __FARM_H___
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FARM_DEFAULT_ADDRESS	":4480"
+#define FARM_MAX_PAYLOAD		(256 * 1024 * 1024)
+#define FARM_MAX_NAME			1024
+
+typedef struct farm_conn_t {
+	int			fd;
+	int			pos, len;	// what's left in 'buf'
+	char		buf[4096];
+} farm_conn_t;
+
+/*
+ * Returns a listening socket, or -1
+ */
+int
+farm_listen(
+		const char * address );
+
+/*
+ * Returns a connected socket, or -1
+ */
+int
+farm_connect(
+		const char * address );
+
+void
+farm_conn_init(
+		farm_conn_t * c,
+		int fd );
+
+/*
+ * Read a line, without the newline. Returns it's length, or -1 on error,
+ * end of file, or if it doesn't fit in 'size'
+ */
+int
+farm_read_line(
+		farm_conn_t * c,
+		char * line,
+		size_t size );
+
+/*
+ * Read exactly 'size' bytes, returns 0, or -1
+ */
+int
+farm_read(
+		farm_conn_t * c,
+		void * data,
+		size_t size );
+
+/*
+ * Read a payload into a malloc()ed buffer, NULL on error
+ */
+void *
+farm_read_payload(
+		farm_conn_t * c,
+		size_t size );
+
+/*
+ * Send a line, printf style; the newline is added. Returns 0, or -1
+ */
+int
+farm_send(
+		farm_conn_t * c,
+		const char * format,
+		... ) __attribute__ ((format (printf, 2, 3)));
+
+int
+farm_write(
+		farm_conn_t * c,
+		const void * data,
+		size_t size );
+
+#endif /* __FARM_H___ */
@@ -0,0 +1,490 @@
+/*
+	farm_coordinator.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hands out a directory of gcode jobs to the farm workers that connect,
+ * collects their artifacts in the output directory, and prints a line of
+ * results per job, as CSV. A job whose worker goes away is given to
+ * another one. See farm.h for the protocol.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "farm.h"
+
+enum {
+	JOB_PENDING = 0,
+	JOB_RUNNING,
+	JOB_FINISHED,	// the worker said how it went
+	JOB_LOST,		// too many workers died on it
+};
+
+typedef struct farm_job_t {
+	char		path[1024];
+	const char * name;
+	int			state;
+	int			attempts;
+	char		worker[64];		// last one to run it
+	char		status[32];		// as reported by the worker
+	unsigned	lines;
+	double		sim, wall;		// seconds
+} farm_job_t;
+
+typedef struct farm_t {
+	const char *	output;		// artifact directory
+	double		timeout;		// simulated seconds per job
+	double		liveness;		// wall seconds a worker can stay silent, 0 for ever
+	int			fast_uart;
+	int			retries;
+	const char *	firmware_name;	// basename, "-" for the default
+	uint8_t *	firmware;
+	size_t		firmware_size;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	changed;	// a job was requeued or finished, a client left
+	int			count;
+	int			remaining;	// not finished or lost
+	int			clients;
+	farm_job_t *	job;
+} farm_t;
+
+typedef struct farm_client_t {
+	farm_t *	farm;
+	farm_conn_t	conn;
+	char		name[64];
+	farm_job_t *	job;		// the one it runs
+} farm_client_t;
+
+/*
+ * Wait for a pending job, returns NULL once there is nothing left to do
+ */
+static farm_job_t *
+farm_take(
+		farm_t * f)
+{
+	farm_job_t * res = NULL;
+
+	pthread_mutex_lock(&f->lock);
+	while (!res && f->remaining) {
+		for (int i = 0; i < f->count && !res; i++)
+			if (f->job[i].state == JOB_PENDING)
+				res = &f->job[i];
+		if (!res)
+			pthread_cond_wait(&f->changed, &f->lock);
+	}
+	if (res) {
+		res->state = JOB_RUNNING;
+		res->attempts++;
+	}
+	pthread_mutex_unlock(&f->lock);
+	return res;
+}
+
+static void
+farm_job_done(
+		farm_t * f,
+		farm_job_t * j,
+		int state)
+{
+	pthread_mutex_lock(&f->lock);
+	j->state = state;
+	if (state != JOB_PENDING)
+		f->remaining--;
+	pthread_cond_broadcast(&f->changed);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static uint8_t *
+farm_load(
+		const char * path,
+		size_t * size)
+{
+	FILE * in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return NULL;
+	}
+	fseek(in, 0, SEEK_END);
+	*size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	uint8_t * res = malloc(*size ? *size : 1);
+	if (fread(res, 1, *size, in) != *size) {
+		perror(path);
+		free(res);
+		res = NULL;
+	}
+	fclose(in);
+	return res;
+}
+
+static int
+farm_send_job(
+		farm_client_t * c,
+		farm_job_t * j,
+		uint8_t * gcode,
+		size_t size)
+{
+	farm_t * f = c->farm;
+
+	size_t name_size = strlen(j->name);
+	int res = farm_send(&c->conn, "JOB %d %.3f %d %zu %zu %zu %s",
+			(int)(j - f->job), f->timeout, f->fast_uart,
+			f->firmware_size, size, name_size, f->firmware_name);
+	if (!res)
+		res = farm_write(&c->conn, j->name, name_size);
+	if (!res && f->firmware_size)
+		res = farm_write(&c->conn, f->firmware, f->firmware_size);
+	if (!res)
+		res = farm_write(&c->conn, gcode, size);
+	return res;
+}
+
+/*
+ * Artifacts go to <output>/<job>.<name>
+ */
+static int
+farm_artifact(
+		farm_client_t * c,
+		farm_job_t * j,
+		size_t size,
+		const char * name)
+{
+	farm_t * f = c->farm;
+	void * data = farm_read_payload(&c->conn, size);
+	if (!data)
+		return -1;
+	// the name comes from the network, keep it in the directory
+	const char * slash = strrchr(name, '/');
+	if (slash)
+		name = slash + 1;
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s.%s", f->output, j->name, name);
+	FILE * o = fopen(path, "wb");
+	if (o) {
+		fwrite(data, 1, size, o);
+		fclose(o);
+	} else
+		perror(path);
+	free(data);
+	return 0;
+}
+
+static void *
+farm_client(
+		void * param)
+{
+	farm_client_t * c = (farm_client_t *)param;
+	farm_t * f = c->farm;
+	char line[1024];
+	int silent = 0;		// the worker stopped talking
+
+	// a hung worker (or network) makes the reads fail, and the job requeued
+	if (f->liveness > 0) {
+		struct timeval tv = {
+			.tv_sec = f->liveness,
+			.tv_usec = (f->liveness - (long)f->liveness) * 1000000,
+		};
+		setsockopt(c->conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+	if (farm_read_line(&c->conn, line, sizeof(line)) < 0 ||
+			sscanf(line, "HELLO %63s", c->name) != 1)
+		goto done;
+	fprintf(stderr, "farm: %s connected\n", c->name);
+
+	while (1) {
+		if (farm_read_line(&c->conn, line, sizeof(line)) < 0) {
+			silent = errno == EAGAIN || errno == EWOULDBLOCK;
+			break;
+		}
+		int id;
+		if (!strcmp(line, "READY")) {
+			if (c->job)		// the worker must be confused, don't lose it
+				break;
+			farm_job_t * j;
+			uint8_t * gcode = NULL;
+			size_t size;
+			// a file we can't read isn't the worker's problem
+			while ((j = farm_take(f)) && !(gcode = farm_load(j->path, &size))) {
+				pthread_mutex_lock(&f->lock);
+				strcpy(j->status, "error");
+				pthread_mutex_unlock(&f->lock);
+				farm_job_done(f, j, JOB_FINISHED);
+			}
+			if (!j) {
+				farm_send(&c->conn, "BYE");
+				break;
+			}
+			c->job = j;
+			pthread_mutex_lock(&f->lock);
+			snprintf(j->worker, sizeof(j->worker), "%s", c->name);
+			pthread_mutex_unlock(&f->lock);
+			int res = farm_send_job(c, j, gcode, size);
+			free(gcode);
+			if (res)
+				break;
+		} else if (!strncmp(line, "PROGRESS ", 9)) {
+			unsigned lines;
+			double sim;
+			if (c->job && sscanf(line + 9, "%d %u %lf", &id, &lines, &sim) == 3 &&
+					id == c->job - f->job) {
+				pthread_mutex_lock(&f->lock);
+				c->job->lines = lines;
+				c->job->sim = sim;
+				pthread_mutex_unlock(&f->lock);
+			}
+		} else if (!strncmp(line, "ARTIFACT ", 9)) {
+			size_t size;
+			int name = 0;
+			if (!c->job || sscanf(line + 9, "%d %zu %n", &id, &size, &name) < 2 ||
+					!name || id != c->job - f->job ||
+					farm_artifact(c, c->job, size, line + 9 + name))
+				break;
+		} else if (!strncmp(line, "RESULT ", 7)) {
+			farm_job_t * j = c->job;
+			char status[32];
+			double sim, wall;
+			if (!j || sscanf(line + 7, "%d %31s %lf %lf", &id,
+					status, &sim, &wall) != 4 || id != j - f->job)
+				break;
+			fprintf(stderr, "farm: %s %s on %s\n", j->name, status, c->name);
+			pthread_mutex_lock(&f->lock);
+			strcpy(j->status, status);
+			j->sim = sim;
+			j->wall = wall;
+			pthread_mutex_unlock(&f->lock);
+			c->job = NULL;
+			farm_job_done(f, j, JOB_FINISHED);
+		} else {
+			fprintf(stderr, "farm: %s: unexpected '%s'\n", c->name, line);
+			break;
+		}
+	}
+done:
+	if (c->job) {
+		farm_job_t * j = c->job;
+		int retry = j->attempts <= f->retries;
+		fprintf(stderr, "farm: lost %s on %s%s%s\n", j->name, c->name,
+				silent ? " (not responding)" : "", retry ? ", requeued" : "");
+		farm_job_done(f, j, retry ? JOB_PENDING : JOB_LOST);
+	}
+	close(c->conn.fd);
+	free(c);
+	pthread_mutex_lock(&f->lock);
+	f->clients--;
+	pthread_cond_broadcast(&f->changed);
+	pthread_mutex_unlock(&f->lock);
+	return NULL;
+}
+
+/*
+ * Clients that didn't leave yet still have their thread, so the jobs are
+ * read under the lock. Returns the number of jobs that didn't go well
+ */
+static int
+farm_report(
+		farm_t * f,
+		FILE * out)
+{
+	int failed = 0;
+
+	pthread_mutex_lock(&f->lock);
+	fprintf(out, "job,status,worker,attempts,lines,sim_sec,wall_sec\n");
+	for (int i = 0; i < f->count; i++) {
+		farm_job_t * j = &f->job[i];
+		fprintf(out, "%s,%s,%s,%d,%u,%.3f,%.3f\n",
+				j->name,
+				j->state == JOB_FINISHED ? j->status : "lost",
+				j->worker, j->attempts, j->lines, j->sim, j->wall);
+		failed += j->state != JOB_FINISHED || strcmp(j->status, "done");
+	}
+	pthread_mutex_unlock(&f->lock);
+	return failed;
+}
+
+static int
+farm_filter(
+		const struct dirent * d)
+{
+	const char * ext = strrchr(d->d_name, '.');
+	return d->d_name[0] != '.' && ext &&
+			(!strcmp(ext, ".g") || !strcmp(ext, ".gcode") || !strcmp(ext, ".gco"));
+}
+
+static void
+usage(
+		const char * name)
+{
+	fprintf(stderr,
+		"Usage: %s [--listen address] [--firmware file] [--timeout sec] [-f]\n"
+		"\t\t[--retries n] [--liveness sec] [-o directory] <directory>\n"
+		"  Hands out the .g/.gcode files in <directory> to farm workers.\n"
+		"  Workers silent for --liveness wall seconds (default 60) are dropped.\n"
+		"  Address is host:port, :port or unix:path, default %s\n",
+		name, FARM_DEFAULT_ADDRESS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	farm_t f = {
+		.output = ".",
+		.timeout = 3600,
+		.retries = 2,
+		.liveness = 60,
+		.firmware_name = "-",
+	};
+	const char * address = FARM_DEFAULT_ADDRESS;
+	const char * dir = NULL, * firmware = NULL;
+
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--listen") && i < argc-1)
+			address = argv[++i];
+		else if (!strcmp(argv[i], "--firmware") && i < argc-1)
+			firmware = argv[++i];
+		else if (!strcmp(argv[i], "--timeout") && i < argc-1)
+			f.timeout = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--retries") && i < argc-1)
+			f.retries = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--liveness") && i < argc-1)
+			f.liveness = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-f"))
+			f.fast_uart = 1;
+		else if (!strcmp(argv[i], "-o") && i < argc-1)
+			f.output = argv[++i];
+		else if (argv[i][0] != '-' && !dir)
+			dir = argv[i];
+		else
+			usage(argv[0]);
+	if (!dir)
+		usage(argv[0]);
+
+	if (firmware) {
+		FILE * in = fopen(firmware, "rb");
+		if (!in) {
+			perror(firmware);
+			exit(1);
+		}
+		fseek(in, 0, SEEK_END);
+		f.firmware_size = ftell(in);
+		fseek(in, 0, SEEK_SET);
+		f.firmware = malloc(f.firmware_size);
+		if (fread(f.firmware, 1, f.firmware_size, in) != f.firmware_size) {
+			perror(firmware);
+			exit(1);
+		}
+		fclose(in);
+		// the workers keep the extension, for .hex vs ELF
+		const char * slash = strrchr(firmware, '/');
+		f.firmware_name = slash ? slash + 1 : firmware;
+		if (strpbrk(f.firmware_name, " \t") || !f.firmware_size) {
+			fprintf(stderr, "%s: %s: invalid firmware\n", argv[0], firmware);
+			exit(1);
+		}
+	}
+	mkdir(f.output, 0755);
+
+	struct dirent ** list;
+	int n = scandir(dir, &list, farm_filter, alphasort);
+	if (n < 0) {
+		perror(dir);
+		exit(1);
+	}
+	f.count = f.remaining = n;
+	f.job = calloc(n ? n : 1, sizeof(farm_job_t));
+	for (int i = 0; i < n; i++) {
+		farm_job_t * j = &f.job[i];
+		snprintf(j->path, sizeof(j->path), "%s/%s", dir, list[i]->d_name);
+		j->name = strrchr(j->path, '/') + 1;
+		free(list[i]);
+	}
+	free(list);
+	pthread_mutex_init(&f.lock, NULL);
+	pthread_cond_init(&f.changed, NULL);
+
+	int lfd = farm_listen(address);
+	if (lfd < 0)
+		exit(1);
+	fprintf(stderr, "%s: %d jobs, listening on %s\n", argv[0], f.count, address);
+
+	// accept workers until it's all done
+	while (1) {
+		pthread_mutex_lock(&f.lock);
+		int remaining = f.remaining;
+		pthread_mutex_unlock(&f.lock);
+		if (!remaining)
+			break;
+		struct pollfd p = { .fd = lfd, .events = POLLIN };
+		if (poll(&p, 1, 200) <= 0)
+			continue;
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		farm_client_t * c = calloc(1, sizeof(*c));
+		c->farm = &f;
+		farm_conn_init(&c->conn, fd);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_t t;
+		pthread_mutex_lock(&f.lock);
+		f.clients++;
+		pthread_mutex_unlock(&f.lock);
+		if (pthread_create(&t, &attr, farm_client, c)) {
+			perror(argv[0]);
+			close(fd);
+			free(c);
+			pthread_mutex_lock(&f.lock);
+			f.clients--;
+			pthread_mutex_unlock(&f.lock);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	close(lfd);
+	if (!strncmp(address, "unix:", 5))
+		unlink(address + 5);
+
+	/*
+	 * The clients waiting for a job got their BYE already, give the others
+	 * a moment to say READY and get theirs
+	 */
+	pthread_mutex_lock(&f.lock);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 5;
+	while (f.clients &&
+			pthread_cond_timedwait(&f.changed, &f.lock, &ts) != ETIMEDOUT)
+		;
+	pthread_mutex_unlock(&f.lock);
+
+	int failed = farm_report(&f, stdout);
+	fprintf(stderr, "%s: %d jobs, %d failed\n", argv[0], f.count, failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,358 @@
+/*
+	farm_worker.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Farm worker daemon: runs jobs from a coordinator on a few printers, and
+ * sends back the progress, a JSON summary with the print report, and the
+ * gcode host log. Without --once it keeps coming back, so it can be left
+ * running on a build server, waiting for the nightly coordinator.
+ * See farm.h for the protocol.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sim_avr.h"
+#include "sim_time.h"
+
+#include "reprap.h"
+#include "farm.h"
+
+typedef struct farm_worker_t {
+	const char *	address;
+	const char *	dir;		// for the firmware and gcode files
+	char		name[64];
+	int			once;
+	int			retry;		// seconds between connection attempts
+} farm_worker_t;
+
+typedef struct farm_slot_t {
+	farm_worker_t *	worker;
+	int			index;
+	pthread_t	thread;
+	farm_conn_t	conn;
+	char		name[80];
+} farm_slot_t;
+
+static double
+farm_wall(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1E9;
+}
+
+static int
+farm_save(
+		const char * path,
+		const void * data,
+		size_t size)
+{
+	FILE * o = fopen(path, "wb");
+	if (!o) {
+		perror(path);
+		return -1;
+	}
+	int res = fwrite(data, 1, size, o) == size ? 0 : -1;
+	if (fclose(o))
+		res = -1;
+	return res;
+}
+
+/*
+ * The firmware is saved once per content, under a stable name, so the
+ * printers share one flash image (see reprap_new) from job to job
+ */
+static int
+farm_firmware(
+		farm_slot_t * s,
+		const uint8_t * data,
+		size_t size,
+		const char * name,
+		char * path,
+		size_t path_size)
+{
+	uint32_t hash = 2166136261u;	// FNV-1a
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	snprintf(path, path_size, "%s/fw-%08x-%zu-%s", s->worker->dir, hash, size, name);
+
+	struct stat st;
+	if (stat(path, &st) == 0 && st.st_size == size)
+		return 0;
+	// the other slots might want the same one, at the same time
+	char tmp[1200];
+	snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, (int)getpid(), s->index);
+	if (farm_save(tmp, data, size) || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+farm_artifact(
+		farm_slot_t * s,
+		int id,
+		const char * name,
+		char * data,
+		size_t size)
+{
+	if (farm_send(&s->conn, "ARTIFACT %d %zu %s", id, size, name))
+		return -1;
+	return farm_write(&s->conn, data, size);
+}
+
+/*
+ * Run a job to the end; returns -1 if the coordinator went away
+ */
+static int
+farm_run(
+		farm_slot_t * s,
+		int id,
+		double timeout,
+		reprap_config_t * config)
+{
+	double start = farm_wall(), progress = start;
+	const char * reason = "error";
+
+	reprap_p r = reprap_new(config);
+	if (!r)
+		return farm_send(&s->conn, "RESULT %d %s 0 %.3f", id, reason,
+				farm_wall() - start);
+
+	avr_cycle_count_t limit = avr_usec_to_cycles(r->avr, timeout * 1000000);
+	avr_cycle_count_t chunk = avr_usec_to_cycles(r->avr, 10000);
+	while (1) {
+		int state = reprap_run_gcode(r, chunk);
+		if (state == cpu_Crashed) {
+			reason = "crashed";
+			break;
+		}
+		if (state == cpu_Done) {
+			reason = "stopped";
+			break;
+		}
+		if (r->gcode_host.done) {
+			reason = "done";
+			break;
+		}
+		if (r->avr->cycle >= limit) {
+			reason = "timeout";
+			break;
+		}
+		double now = farm_wall();
+		if (now - progress >= 1.0) {
+			progress = now;
+			if (farm_send(&s->conn, "PROGRESS %d %u %.3f", id,
+					r->gcode_host.stats.lines,
+					avr_cycles_to_nsec(r->avr, r->avr->cycle) / 1E9)) {
+				reprap_free(r);
+				return -1;
+			}
+		}
+	}
+	double wall = farm_wall() - start;
+	double sim = avr_cycles_to_nsec(r->avr, r->avr->cycle) / 1E9;
+
+	char * data;
+	size_t size;
+	int res = 0;
+	FILE * o = open_memstream(&data, &size);
+	reprap_json_summary(r, reason, wall, o);
+	fclose(o);
+	res = farm_artifact(s, id, "summary.json", data, size);
+	free(data);
+	if (!res) {
+		o = open_memstream(&data, &size);
+		gcode_host_report(&r->gcode_host, o);
+		fclose(o);
+		res = farm_artifact(s, id, "host.txt", data, size);
+		free(data);
+	}
+	reprap_free(r);
+	if (!res)
+		res = farm_send(&s->conn, "RESULT %d %s %.3f %.3f", id, reason, sim, wall);
+	return res;
+}
+
+/*
+ * Ask for jobs and run them, until the coordinator says BYE or goes away
+ */
+static int
+farm_session(
+		farm_slot_t * s)
+{
+	char line[1024];
+	char gcode_path[1024];
+
+	snprintf(gcode_path, sizeof(gcode_path), "%s/job-%d-%d.g",
+			s->worker->dir, (int)getpid(), s->index);
+	if (farm_send(&s->conn, "HELLO %s", s->name))
+		return -1;
+	while (1) {
+		if (farm_send(&s->conn, "READY") ||
+				farm_read_line(&s->conn, line, sizeof(line)) < 0)
+			return -1;
+		if (!strcmp(line, "BYE"))
+			return 0;
+
+		int id, fast_uart;
+		double timeout;
+		size_t fw_size, gcode_size, name_size;
+		char fw_name[256];
+		if (sscanf(line, "JOB %d %lf %d %zu %zu %zu %255s", &id, &timeout, &fast_uart,
+				&fw_size, &gcode_size, &name_size, fw_name) != 7 ||
+				name_size > FARM_MAX_NAME) {
+			fprintf(stderr, "%s: unexpected '%s'\n", s->name, line);
+			return -1;
+		}
+		char job[FARM_MAX_NAME + 1];
+		if (farm_read(&s->conn, job, name_size))
+			return -1;
+		job[name_size] = 0;
+		char fw_path[1024];
+		uint8_t * fw = fw_size ? farm_read_payload(&s->conn, fw_size) : NULL;
+		uint8_t * gcode = farm_read_payload(&s->conn, gcode_size);
+		if ((fw_size && !fw) || !gcode) {
+			free(fw);
+			free(gcode);
+			return -1;
+		}
+		// the name came from the network, it can't go up the tree
+		char * slash = strrchr(fw_name, '/');
+		int bad = (fw_size && (farm_firmware(s, fw, fw_size,
+				slash ? slash + 1 : fw_name, fw_path, sizeof(fw_path)))) ||
+				farm_save(gcode_path, gcode, gcode_size);
+		free(fw);
+		free(gcode);
+		if (bad) {
+			if (farm_send(&s->conn, "RESULT %d error 0 0", id))
+				return -1;
+			continue;
+		}
+		printf("%s: running %s\n", s->name, job);
+		reprap_config_t c = {
+			.firmware = fw_size ? fw_path : NULL,
+			.gcode_file = gcode_path,
+			.fast_uart = fast_uart,
+			.quiet = 1,
+			.report = 1,
+		};
+		if (farm_run(s, id, timeout, &c))
+			return -1;
+	}
+}
+
+static void *
+farm_slot_thread(
+		void * param)
+{
+	farm_slot_t * s = (farm_slot_t *)param;
+	farm_worker_t * w = s->worker;
+
+	while (1) {
+		int fd = farm_connect(w->address);
+		if (fd >= 0) {
+			farm_conn_init(&s->conn, fd);
+			int res = farm_session(s);
+			close(fd);
+			if (res)
+				fprintf(stderr, "%s: lost the coordinator\n", s->name);
+		}
+		if (w->once)
+			break;
+		sleep(w->retry);
+	}
+	return NULL;
+}
+
+static void
+usage(
+		const char * name)
+{
+	fprintf(stderr,
+		"Usage: %s [-j slots] [--name name] [--dir directory] [--retry sec]\n"
+		"\t\t[--once] [address]\n"
+		"  Runs farm jobs from the coordinator at address (host:port, :port,\n"
+		"  unix:path), default %s\n",
+		name, FARM_DEFAULT_ADDRESS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	farm_worker_t w = {
+		.address = FARM_DEFAULT_ADDRESS,
+		.dir = "/tmp",
+		.retry = 5,
+	};
+	int slots = sysconf(_SC_NPROCESSORS_ONLN);
+	const char * name = NULL;
+
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "-j") && i < argc-1)
+			slots = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--name") && i < argc-1)
+			name = argv[++i];
+		else if (!strcmp(argv[i], "--dir") && i < argc-1)
+			w.dir = argv[++i];
+		else if (!strcmp(argv[i], "--retry") && i < argc-1)
+			w.retry = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--once"))
+			w.once = 1;
+		else if (argv[i][0] != '-')
+			w.address = argv[i];
+		else
+			usage(argv[0]);
+	if (slots < 1)
+		slots = 1;
+	if (w.retry < 1)
+		w.retry = 1;
+	if (name)
+		snprintf(w.name, sizeof(w.name), "%s", name);
+	else {
+		gethostname(w.name, sizeof(w.name) - 1);
+		snprintf(w.name + strlen(w.name), sizeof(w.name) - strlen(w.name),
+				".%d", (int)getpid());
+	}
+	mkdir(w.dir, 0755);
+
+	farm_slot_t * slot = calloc(slots, sizeof(farm_slot_t));
+	for (int i = 0; i < slots; i++) {
+		farm_slot_t * s = &slot[i];
+		s->worker = &w;
+		s->index = i;
+		snprintf(s->name, sizeof(s->name), "%s/%d", w.name, i);
+		if (pthread_create(&s->thread, NULL, farm_slot_thread, s)) {
+			perror(argv[0]);
+			exit(1);
+		}
+	}
+	for (int i = 0; i < slots; i++)
+		pthread_join(slot[i].thread, NULL);
+	free(slot);
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*
+	fleet.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs a printer per gcode file found in a directory, all of them in the
+ * same process, time sliced on a few worker threads, and prints a line of
+ * metrics per job, as CSV.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+
+#include "sim_avr.h"
+#include "sim_time.h"
+
+#include "reprap.h"
+#include "workpool.h"
+
+enum {
+	FLEET_PENDING = 0,
+	FLEET_OK,
+	FLEET_CRASHED,
+	FLEET_TIMEOUT,
+	FLEET_ERROR,
+};
+
+static const char * fleet_status[] = {
+	"pending", "ok", "crashed", "timeout", "error",
+};
+
+typedef struct fleet_job_t {
+	char		path[1024];
+	const char * name;
+	reprap_p	r;			// only while it runs
+
+	int			status;
+	uint64_t	start;		// wall, usec, at the first slice
+	uint64_t	end;
+	uint64_t	busy;		// wall usec spent in slices
+	uint32_t	slices, parks;
+
+	double		sim;		// seconds of simulated time streaming gcode
+	gcode_host_stats_t	stats;
+	float		position[4];	// X, Y, Z, E in mm
+} fleet_job_t;
+
+typedef struct fleet_t {
+	reprap_config_t	config;
+	avr_cycle_count_t	slice;		// cycles per time slice
+	double		timeout;		// simulated seconds per job
+	double		realtime;		// max simulated/wall speed, 0 for flat out
+	int			count;
+	fleet_job_t *	job;
+} fleet_t;
+
+static void
+fleet_job_finish(
+		fleet_job_t * j,
+		int status)
+{
+	reprap_p r = j->r;
+
+	j->status = status;
+	j->end = workpool_now();
+	if (r) {
+		j->stats = r->gcode_host.stats;
+		if (!r->gcode_host.done)
+			j->stats.end_cycle = r->avr->cycle;
+		j->sim = avr_cycles_to_nsec(r->avr,
+				j->stats.end_cycle - j->stats.start_cycle) / 1E9;
+		j->position[0] = stepper_get_position_mm(&r->step_x);
+		j->position[1] = stepper_get_position_mm(&r->step_y);
+		j->position[2] = stepper_get_position_mm(&r->step_z);
+		j->position[3] = stepper_get_position_mm(&r->step_e);
+		reprap_free(r);
+		j->r = NULL;
+	}
+}
+
+/*
+ * One time slice of a printer; it's created on the first one, so the
+ * workers share the setup cost, and so only the ones running use memory
+ */
+static int
+fleet_slice(
+		void * param,
+		int index,
+		int worker,
+		uint64_t * wake)
+{
+	fleet_t * f = (fleet_t *)param;
+	fleet_job_t * j = &f->job[index];
+	uint64_t now = workpool_now();
+
+	if (!j->r) {
+		reprap_config_t c = f->config;
+		c.gcode_file = j->path;
+		if (c.gdb_port)
+			c.gdb_port += index;
+		j->start = now;
+		j->r = reprap_new(&c);
+		if (!j->r) {
+			fleet_job_finish(j, FLEET_ERROR);
+			return WORKPOOL_DONE;
+		}
+	}
+	reprap_p r = j->r;
+	int state = reprap_run_gcode(r, f->slice);
+	uint64_t end = workpool_now();
+	j->busy += end - now;
+	j->slices++;
+
+	if (r->gcode_host.done) {
+		fleet_job_finish(j, FLEET_OK);
+		return WORKPOOL_DONE;
+	}
+	if (state == cpu_Done || state == cpu_Crashed) {
+		fleet_job_finish(j, FLEET_CRASHED);
+		return WORKPOOL_DONE;
+	}
+	uint64_t sim = avr_cycles_to_usec(r->avr, r->avr->cycle);
+	if (sim >= f->timeout * 1000000) {
+		fleet_job_finish(j, FLEET_TIMEOUT);
+		return WORKPOOL_DONE;
+	}
+	// ahead of the wall clock? then sleep it off, someone else can run
+	if (f->realtime > 0) {
+		uint64_t due = j->start + sim / f->realtime;
+		if (due > end) {
+			j->parks++;
+			*wake = due;
+			return WORKPOOL_PARK;
+		}
+	}
+	return WORKPOOL_AGAIN;
+}
+
+static void
+fleet_report(
+		fleet_t * f,
+		FILE * out)
+{
+	fprintf(out, "job,status,lines,errors,resends,sim_sec,wall_sec,busy_sec,"
+			"slices,parks,planner_avg,planner_full_pct,x,y,z,e\n");
+	for (int i = 0; i < f->count; i++) {
+		fleet_job_t * j = &f->job[i];
+		gcode_host_stats_t * s = &j->stats;
+		fprintf(out, "%s,%s,%u,%u,%u,%.3f,%.3f,%.3f,%u,%u,",
+				j->name, fleet_status[j->status],
+				s->lines, s->errors, s->resends,
+				j->sim, (j->end - j->start) / 1E6, j->busy / 1E6,
+				j->slices, j->parks);
+		if (s->planner_samples)
+			fprintf(out, "%.2f,%.1f,",
+					(double)s->planner_sum / s->planner_samples,
+					100.0 * s->planner_full / s->planner_samples);
+		else
+			fprintf(out, ",,");
+		fprintf(out, "%.3f,%.3f,%.3f,%.3f\n",
+				j->position[0], j->position[1], j->position[2], j->position[3]);
+	}
+}
+
+static int
+fleet_filter(
+		const struct dirent * d)
+{
+	const char * ext = strrchr(d->d_name, '.');
+	return d->d_name[0] != '.' && ext &&
+			(!strcmp(ext, ".g") || !strcmp(ext, ".gcode") || !strcmp(ext, ".gco"));
+}
+
+static void
+usage(
+		const char * name)
+{
+	fprintf(stderr,
+		"Usage: %s [-j threads] [--slice cycles] [--timeout sec]\n"
+		"\t\t[--realtime factor] [--firmware file] [-f] [-o metrics.csv] <directory>\n"
+		"  Runs a printer for each .g/.gcode file in <directory>\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	fleet_t f = {
+		.slice = 200000,	// 10ms of simulated time at 20MHz
+		.timeout = 3600,
+	};
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char * dir = NULL, * output = NULL;
+
+	f.config.quiet = 1;
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "-j") && i < argc-1)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--slice") && i < argc-1)
+			f.slice = strtoull(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--timeout") && i < argc-1)
+			f.timeout = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--realtime") && i < argc-1)
+			f.realtime = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--firmware") && i < argc-1)
+			f.config.firmware = argv[++i];
+		else if (!strcmp(argv[i], "-f"))
+			f.config.fast_uart++;
+		else if (!strcmp(argv[i], "-o") && i < argc-1)
+			output = argv[++i];
+		else if (argv[i][0] != '-' && !dir)
+			dir = argv[i];
+		else
+			usage(argv[0]);
+	if (!dir || !f.slice)
+		usage(argv[0]);
+
+	struct dirent ** list;
+	int n = scandir(dir, &list, fleet_filter, alphasort);
+	if (n < 0) {
+		perror(dir);
+		exit(1);
+	}
+	f.count = n;
+	f.job = calloc(n ? n : 1, sizeof(fleet_job_t));
+	for (int i = 0; i < n; i++) {
+		fleet_job_t * j = &f.job[i];
+		snprintf(j->path, sizeof(j->path), "%s/%s", dir, list[i]->d_name);
+		j->name = strrchr(j->path, '/') + 1;
+		free(list[i]);
+	}
+	free(list);
+
+	fprintf(stderr, "%s: %d jobs on %d threads\n", argv[0], f.count, threads);
+	workpool_stats_t stats;
+	uint64_t start = workpool_now();
+	if (workpool_run(f.count, threads, fleet_slice, &f, &stats))
+		exit(1);
+	double wall = (workpool_now() - start) / 1E6;
+
+	FILE * out = output ? fopen(output, "w") : stdout;
+	if (!out) {
+		perror(output);
+		out = stdout;
+	}
+	fleet_report(&f, out);
+	if (out != stdout)
+		fclose(out);
+
+	int failed = 0;
+	for (int i = 0; i < f.count; i++)
+		failed += f.job[i].status != FLEET_OK;
+	fprintf(stderr, "%s: %d jobs, %d failed, %.3fs wall, "
+			"%llu slices, %llu steals, %llu parks\n",
+			argv[0], f.count, failed, wall,
+			(unsigned long long)stats.slices,
+			(unsigned long long)stats.steals,
+			(unsigned long long)stats.parks);
+	free(f.job);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,433 @@
+/*
+	gcode_host.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim_avr.h"
+#include "sim_time.h"
+#include "avr_uart.h"
+
+#include "gcode_host.h"
+
+//#define TRACE(_w) _w
+#ifndef TRACE
+#define TRACE(_w)
+#endif
+
+static uint64_t
+gcode_host_wall_nsec(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/*
+ * Parse the next non empty line from the file, strip comments and
+ * whitespace, and format it in p->line, with number and checksum
+ * if needed. Returns 0 when there is nothing left to send
+ */
+static int
+gcode_host_next_line(
+		gcode_host_p p)
+{
+	while (p->pos < p->size) {
+		const char * s = p->base + p->pos;
+		const char * e = memchr(s, '\n', p->size - p->pos);
+		if (!e)
+			e = p->base + p->size;
+		size_t start = p->pos;
+		p->pos = (e - p->base) + 1;
+
+		char code[sizeof(p->line)];
+		int len = 0, paren = 0, over = 0;
+		for (; s < e; s++) {
+			if (*s == ';')
+				break;
+			if (*s == '(')
+				paren++;
+			else if (*s == ')' && paren)
+				paren--;
+			else if (!paren && *s != '\r') {
+				if (len < sizeof(code) - 1)
+					code[len++] = *s;
+				else
+					over = 1;
+			}
+		}
+		while (len && (code[len-1] == ' ' || code[len-1] == '\t'))
+			len--;
+		int skip = 0;
+		while (skip < len && (code[skip] == ' ' || code[skip] == '\t'))
+			skip++;
+		if (skip == len)
+			continue;
+		code[len] = 0;
+
+		/*
+		 * A truncated line would still get a valid checksum and be run,
+		 * so lines that don't fit are skipped, without using a line number
+		 */
+		int l;
+		if (p->flags & GCODE_HOST_FLAG_CHECKSUM) {
+			// leave room for the "*255\n"
+			l = snprintf(p->line, sizeof(p->line) - 8, "N%u %s",
+					p->lineno + 1, code + skip);
+			over |= l >= sizeof(p->line) - 8;
+		} else {
+			l = snprintf(p->line, sizeof(p->line), "%s\n", code + skip);
+			over |= l >= sizeof(p->line);
+		}
+		if (over) {
+			p->stats.errors++;
+			fprintf(stderr, "%s: line too long, skipped: %.24s...\n",
+					__func__, code + skip);
+			continue;
+		}
+		if (p->flags & GCODE_HOST_FLAG_CHECKSUM) {
+			p->lineno++;
+			p->history[p->lineno & (GCODE_HOST_HISTORY-1)] = start;
+			uint8_t sum = 0;
+			for (int i = 0; i < l; i++)
+				sum ^= p->line[i];
+			l += sprintf(p->line + l, "*%d\n", sum);
+		}
+		p->line_len = l;
+		p->line_sent = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * push as much of the current line as the UART will take
+ */
+static void
+gcode_host_flush(
+		gcode_host_p p)
+{
+	while (p->xon && p->line_sent < p->line_len)
+		avr_raise_irq(p->irq + IRQ_GCODE_HOST_BYTE_OUT,
+				(uint8_t)p->line[p->line_sent++]);
+}
+
+static void
+gcode_host_send_next(
+		gcode_host_p p)
+{
+	if (p->resend >= 0) {
+		p->pos = p->history[p->resend & (GCODE_HOST_HISTORY-1)];
+		p->lineno = p->resend - 1;
+		p->resend = -1;
+	}
+	if (!gcode_host_next_line(p)) {
+		if (!p->done) {
+			p->done = 1;
+			p->stats.end_cycle = p->avr->cycle;
+			p->stats.end_wall = gcode_host_wall_nsec();
+			avr_raise_irq(p->irq + IRQ_GCODE_HOST_DONE, 1);
+		}
+		return;
+	}
+	TRACE(printf("%s %s", __func__, p->line);)
+	p->waiting_ok = 1;
+	gcode_host_flush(p);
+}
+
+static void
+gcode_host_sample_planner(
+		gcode_host_p p)
+{
+	if (!p->planner.size)
+		return;
+	uint8_t head = p->avr->data[p->planner.head];
+	uint8_t tail = p->avr->data[p->planner.tail];
+	uint32_t fill = (head - tail) & (p->planner.size - 1);
+
+	p->stats.planner_samples++;
+	p->stats.planner_sum += fill;
+	if (fill > p->stats.planner_max)
+		p->stats.planner_max = fill;
+	if (fill == p->planner.size - 1)
+		p->stats.planner_full++;
+}
+
+/*
+ * A full line was received from the firmware
+ */
+static void
+gcode_host_reply(
+		gcode_host_p p,
+		const char * r)
+{
+	if (p->flags & GCODE_HOST_FLAG_ECHO)
+		printf("%s\n", r);
+
+	if (!p->started) {
+		if (strncmp(r, "start", 5))
+			return;
+		p->started = 1;
+		p->stats.start_cycle = p->avr->cycle;
+		p->stats.start_wall = gcode_host_wall_nsec();
+		gcode_host_send_next(p);
+		return;
+	}
+	if (!strncmp(r, "Error:", 6) || !strncmp(r, "!!", 2)) {
+		p->stats.errors++;
+	} else if (!strncmp(r, "Resend:", 7) || !strncmp(r, "rs ", 3)) {
+		const char * n = r + (r[0] == 'R' ? 7 : 3);
+		while (*n == ' ' || *n == 'N')
+			n++;
+		int line = atoi(n);
+		// can't go back further than our history, or into the previous file
+		if (line >= p->first_lineno && line > 0 && line <= p->lineno &&
+				p->lineno - line < GCODE_HOST_HISTORY) {
+			p->resend = line;
+			p->stats.resends++;
+		} else
+			fprintf(stderr, "%s: can't resend line %d (at %u)\n", __func__, line, p->lineno);
+	} else if (!strncmp(r, "ok", 2) && p->waiting_ok) {
+		p->waiting_ok = 0;
+		if (p->resend < 0)
+			p->stats.lines++;
+		gcode_host_sample_planner(p);
+		gcode_host_send_next(p);
+	}
+}
+
+/*
+ * A byte from the firmware, assemble the reply lines
+ */
+static void
+gcode_host_in_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	gcode_host_p p = (gcode_host_p)param;
+
+	if (value == '\r')
+		return;
+	if (value == '\n' || p->reply_len == sizeof(p->reply) - 1) {
+		p->reply[p->reply_len] = 0;
+		p->reply_len = 0;
+		gcode_host_reply(p, p->reply);
+		if (value == '\n')
+			return;
+	}
+	p->reply[p->reply_len++] = value;
+}
+
+/*
+ * The AVR uart has room again, resume the line we were sending
+ */
+static void
+gcode_host_xon_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	gcode_host_p p = (gcode_host_p)param;
+	p->xon = 1;
+	gcode_host_flush(p);
+}
+
+/*
+ * The AVR uart fifo is full, hold the rest of the line
+ */
+static void
+gcode_host_xoff_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	gcode_host_p p = (gcode_host_p)param;
+	p->xon = 0;
+}
+
+static const char * irq_names[IRQ_GCODE_HOST_COUNT] = {
+	[IRQ_GCODE_HOST_BYTE_IN] = "8<gcode_host.in",
+	[IRQ_GCODE_HOST_BYTE_OUT] = "8>gcode_host.out",
+	[IRQ_GCODE_HOST_DONE] = "1>gcode_host.done",
+};
+
+static int
+gcode_host_map(
+		gcode_host_p p,
+		const char * filename )
+{
+	p->fd = open(filename, O_RDONLY);
+	if (p->fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	struct stat st;
+	fstat(p->fd, &st);
+	p->size = st.st_size;
+	if (p->size) {
+		p->base = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, p->fd, 0);
+		if (p->base == MAP_FAILED) {
+			perror(filename);
+			p->base = NULL;
+			close(p->fd);
+			p->fd = -1;
+			return -1;
+		}
+		madvise((void*)p->base, p->size, MADV_SEQUENTIAL);
+	}
+	p->pos = 0;
+	return 0;
+}
+
+int
+gcode_host_init(
+		struct avr_t * avr,
+		gcode_host_p p,
+		const char * filename,
+		uint32_t flags )
+{
+	memset(p, 0, sizeof(*p));
+
+	p->avr = avr;
+	p->fd = -1;
+	p->flags = flags;
+	p->resend = -1;
+	p->started = !(flags & GCODE_HOST_FLAG_WAIT_START);
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_GCODE_HOST_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_GCODE_HOST_BYTE_IN, gcode_host_in_hook, p);
+
+	if (gcode_host_map(p, filename))
+		return -1;
+	fprintf(stderr, "%s %s, %d bytes%s\n", __func__, filename, (int)p->size,
+			flags & GCODE_HOST_FLAG_CHECKSUM ? " (checksums)" : "");
+	return 0;
+}
+
+int
+gcode_host_load(
+		gcode_host_p p,
+		const char * filename )
+{
+	gcode_host_dispose(p);
+	if (gcode_host_map(p, filename))
+		return -1;
+	// line numbers carry on, the firmware expects them to
+	p->done = 0;
+	p->resend = -1;
+	// the history has offsets in the old file, it can't be resent from
+	memset(p->history, 0, sizeof(p->history));
+	p->first_lineno = p->lineno + 1;
+	memset(&p->stats, 0, sizeof(p->stats));
+	if (p->started && !p->waiting_ok) {
+		p->stats.start_cycle = p->avr->cycle;
+		p->stats.start_wall = gcode_host_wall_nsec();
+		gcode_host_send_next(p);
+	}
+	return 0;
+}
+
+void
+gcode_host_connect(
+		gcode_host_p p,
+		char uart )
+{
+	// disable the stdio dump, we do it ourselves if needed
+	uint32_t f = 0;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_GET_FLAGS(uart), &f);
+	f &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(p->avr, AVR_IOCTL_UART_SET_FLAGS(uart), &f);
+
+	avr_irq_t * src = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(p->avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUT_XOFF);
+	if (src && dst) {
+		avr_connect_irq(src, p->irq + IRQ_GCODE_HOST_BYTE_IN);
+		avr_connect_irq(p->irq + IRQ_GCODE_HOST_BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, gcode_host_xon_hook, p);
+	if (xoff)
+		avr_irq_register_notify(xoff, gcode_host_xoff_hook, p);
+
+	// if we don't wait for the firmware to boot, start right away
+	if (p->started) {
+		p->stats.start_cycle = p->avr->cycle;
+		p->stats.start_wall = gcode_host_wall_nsec();
+		gcode_host_send_next(p);
+	}
+}
+
+void
+gcode_host_set_planner_probe(
+		gcode_host_p p,
+		uint16_t head_addr,
+		uint16_t tail_addr,
+		uint8_t size )
+{
+	p->planner.head = head_addr;
+	p->planner.tail = tail_addr;
+	p->planner.size = size;
+}
+
+void
+gcode_host_report(
+		gcode_host_p p,
+		FILE * out )
+{
+	gcode_host_stats_t * s = &p->stats;
+	avr_cycle_count_t end = p->done ? s->end_cycle : p->avr->cycle;
+	uint64_t end_wall = p->done ? s->end_wall : gcode_host_wall_nsec();
+	double sim = avr_cycles_to_nsec(p->avr, end - s->start_cycle) / 1E9;
+	double wall = (end_wall - s->start_wall) / 1E9;
+
+	fprintf(out, "gcode: %u lines%s, %u resends, %u errors\n",
+			s->lines, p->done ? "" : " (not done)", s->resends, s->errors);
+	fprintf(out, "gcode: %.3fs simulated, %.3fs wall (x%.2f)\n",
+			sim, wall, wall > 0 ? sim / wall : 0);
+	fprintf(out, "gcode: %.1f lines/simulated sec, %.1f lines/wall sec\n",
+			sim > 0 ? s->lines / sim : 0, wall > 0 ? s->lines / wall : 0);
+	if (s->planner_samples)
+		fprintf(out, "gcode: planner avg %.2f max %u/%u, full %.1f%% of the time\n",
+				(double)s->planner_sum / s->planner_samples,
+				s->planner_max, p->planner.size - 1,
+				100.0 * s->planner_full / s->planner_samples);
+}
+
+void
+gcode_host_dispose(
+		gcode_host_p p )
+{
+	if (p->base)
+		munmap((void*)p->base, p->size);
+	p->base = NULL;
+	if (p->fd >= 0)
+		close(p->fd);
+	p->fd = -1;
+}
@@ -0,0 +1,143 @@
+/*
+	gcode_host.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a built-in 'host' that streams a gcode file to the firmware's
+ * UART, like pronterface would, but from the AVR thread itself, so there
+ * is no pty nor host process scheduling jitter involved.
+ *
+ * Lines are sent one at a time, the next one when the firmware says "ok".
+ * Comments and blank lines are stripped. With GCODE_HOST_FLAG_CHECKSUM,
+ * lines are numbered and checksummed, and "Resend:" requests are honored.
+ */
+#ifndef __GCODE_HOST_H___
+#define __GCODE_HOST_H___
+
+#include <stdio.h>
+#include "sim_irq.h"
+
+enum {
+	IRQ_GCODE_HOST_BYTE_IN = 0,		// from the AVR UART
+	IRQ_GCODE_HOST_BYTE_OUT,		// to the AVR UART
+	IRQ_GCODE_HOST_DONE,			// raised when the last line was acknowledged
+	IRQ_GCODE_HOST_COUNT
+};
+
+enum {
+	GCODE_HOST_FLAG_CHECKSUM	= (1 << 0),	// send "N<line> <gcode>*<checksum>"
+	GCODE_HOST_FLAG_WAIT_START	= (1 << 1),	// wait for "start" before sending
+	GCODE_HOST_FLAG_ECHO		= (1 << 2),	// print firmware output on stdout
+};
+
+// number of lines we remember for "Resend:", power of two
+#define GCODE_HOST_HISTORY	64
+
+typedef struct gcode_host_stats_t {
+	uint32_t	lines;			// lines acknowledged
+	uint32_t	resends;
+	uint32_t	errors;			// "Error:" lines from the firmware, lines too long
+	avr_cycle_count_t	start_cycle, end_cycle;
+	uint64_t	start_wall, end_wall;	// in nsec, CLOCK_MONOTONIC
+
+	// planner fill, sampled at each "ok", only if a probe was set
+	uint32_t	planner_samples;
+	uint64_t	planner_sum;
+	uint32_t	planner_max;
+	uint32_t	planner_full;	// samples where the planner was full
+} gcode_host_stats_t;
+
+typedef struct gcode_host_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t *avr;		// keep it around so we can pause it
+	uint32_t	flags;
+	int			xon;
+	unsigned int	started : 1, waiting_ok : 1, done : 1;
+
+	int			fd;
+	const char * base;		// mmap'ed file
+	size_t		size;
+	size_t		pos;		// current parsing position in base
+
+	uint32_t	lineno;		// number of the line in 'line'
+	uint32_t	first_lineno;	// number of the first line of this file
+	int			resend;		// line number to resend, or -1
+	size_t		history[GCODE_HOST_HISTORY];	// file offsets per line number
+
+	char		line[128];	// line currently being sent
+	int			line_len, line_sent;
+
+	char		reply[128];	// firmware reply being assembled
+	int			reply_len;
+
+	// optional probe for the planner ring buffer in the AVR SRAM
+	struct {
+		uint16_t	head, tail;	// SRAM addresses of the 8 bits indexes
+		uint8_t		size;		// BLOCK_BUFFER_SIZE
+	} planner;
+
+	gcode_host_stats_t	stats;
+} gcode_host_t, *gcode_host_p;
+
+/*
+ * Opens & maps 'filename', returns 0 on success
+ */
+int
+gcode_host_init(
+		struct avr_t * avr,
+		gcode_host_p p,
+		const char * filename,
+		uint32_t flags );
+
+void
+gcode_host_connect(
+		gcode_host_p p,
+		char uart );
+
+/*
+ * Switch to streaming another file, once the current one is done.
+ * The stats restart from zero. Returns 0 on success
+ */
+int
+gcode_host_load(
+		gcode_host_p p,
+		const char * filename );
+
+/*
+ * Tell the host where Marlin's block_buffer_head/tail are in SRAM, so
+ * it can report how full the planner stays
+ */
+void
+gcode_host_set_planner_probe(
+		gcode_host_p p,
+		uint16_t head_addr,
+		uint16_t tail_addr,
+		uint8_t size );
+
+void
+gcode_host_report(
+		gcode_host_p p,
+		FILE * out );
+
+void
+gcode_host_dispose(
+		gcode_host_p p );
+
+#endif /* __GCODE_HOST_H___ */
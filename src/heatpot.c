@@ -25,9 +25,25 @@
 #include <math.h>
 #include "sim_avr.h"
 #include "sim_time.h"
+#include "sim_snapshot.h"
 
 #include "heatpot.h"
 
+/*
+ * xorshift32; we can't use random() as it's shared with everyone else,
+ * and we want each heatpot to be reproducible on it's own
+ */
+static uint32_t
+heatpot_random(
+		heatpot_p p)
+{
+	uint32_t x = p->noise;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return p->noise = x;
+}
+
 static avr_cycle_count_t
 heatpot_evaluate_timer(
 		struct avr_t * avr,
@@ -43,7 +59,7 @@ heatpot_evaluate_timer(
 			weight += p->tally[si].cost;
 
 	float delta = p->current - p->ambiant;
-	float noise = (float)((random() % 32) - 16) / 32.0;
+	float noise = (float)((int)(heatpot_random(p) % 32) - 16) / 32.0;
 	delta += noise;
 
 	float cost = ((delta/2) + noise) * -weight;
@@ -94,6 +110,19 @@ heatpot_init(
 	avr_cycle_timer_register_usec(avr, p->cycle, heatpot_evaluate_timer, p);
 
 	p->ambiant = p->current = ambiant;
+	// default seed only depends on the name, so runs are repeatable
+	uint32_t seed = 0;
+	for (const char * n = name; *n; n++)
+		seed = (seed * 31) + *n;
+	heatpot_seed(p, seed);
+}
+
+void
+heatpot_seed(
+		heatpot_p p,
+		uint32_t seed )
+{
+	p->noise = seed ? seed : 0x2545f491;
 }
 
 void
@@ -110,7 +139,7 @@ heatpot_tally(
 			f = si;
 	if (f == -1) {
 		if (ei == -1) {
-			printf("%s(%s) no room for extra tally source id %d\n", __func__, p->name, sid);
+			fprintf(stderr, "%s(%s) no room for extra tally source id %d\n", __func__, p->name, sid);
 			return;
 		}
 		f = ei;
@@ -118,3 +147,14 @@ heatpot_tally(
 	p->tally[f].sid = sid;
 	p->tally[f].cost = cost;
 }
+
+void
+heatpot_snapshot(
+		heatpot_p p,
+		avr_snapshot_t * s )
+{
+	AVR_SNAPSHOT(s, p->tally);
+	AVR_SNAPSHOT(s, p->current);
+	AVR_SNAPSHOT(s, p->noise);
+	avr_snapshot_timer(s, heatpot_evaluate_timer, p);
+}
@@ -25,6 +25,8 @@
 
 #include "sim_irq.h"
 
+struct avr_snapshot_t;
+
 enum {
 	IRQ_HEATPOT_TALLY = 0,		// heatpot_data_t
 	IRQ_HEATPOT_TEMP_OUT,		// Celcius * 256
@@ -45,6 +47,7 @@ typedef struct heatpot_t {
 
 	float ambiant;
 	float current;
+	uint32_t	noise;		// state of the noise generator, never zero
 
 	avr_cycle_count_t	cycle;
 } heatpot_t, *heatpot_p;
@@ -56,10 +59,26 @@ heatpot_init(
 		const char * name,
 		float ambiant );
 
+/*
+ * Reseed the noise generator, so runs can be reproduced
+ */
+void
+heatpot_seed(
+		heatpot_p p,
+		uint32_t seed );
+
 void
 heatpot_tally(
 		heatpot_p p,
 		int sid,
 		float cost );
 
+/*
+ * Save/restore the temperature, heat sources and noise, see sim_snapshot.h
+ */
+void
+heatpot_snapshot(
+		heatpot_p p,
+		struct avr_snapshot_t * s );
+
 #endif /* __HEATPOT_H___ */
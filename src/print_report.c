@@ -0,0 +1,286 @@
+/*
+	print_report.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sim_avr.h"
+#include "sim_time.h"
+#include "sim_snapshot.h"
+
+#include "print_report.h"
+
+// smaller moves are noise, or rounding of the steps
+#define PRINT_REPORT_Z_EPSILON	0.005f
+#define PRINT_REPORT_E_EPSILON	0.001f
+
+static double
+print_report_sec(
+		print_report_p p,
+		avr_cycle_count_t cycles)
+{
+	return avr_cycles_to_nsec(p->avr, cycles) / 1E9;
+}
+
+/*
+ * Add the time the heater was on since the last change
+ */
+static void
+print_report_heater_account(
+		print_report_heater_t * h,
+		avr_cycle_count_t now)
+{
+	if (h->on) {
+		h->on_cycles += now - h->last;
+		h->window_on += now - h->last;
+	}
+	h->last = now;
+}
+
+static void
+print_report_heater_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	print_report_p p = (print_report_p)param;
+	print_report_heater_t * h = &p->heater[irq->irq];
+
+	if (p->end || h->on == !!value)
+		return;
+	print_report_heater_account(h, p->avr->cycle);
+	h->on = !!value;
+}
+
+static void
+print_report_new_layer(
+		print_report_p p,
+		float z,
+		avr_cycle_count_t start)
+{
+	if (p->layer_count)
+		p->layer[p->layer_count - 1].end = start;
+	if (p->layer_count == p->layer_size) {
+		p->layer_size = p->layer_size ? p->layer_size * 2 : 64;
+		p->layer = realloc(p->layer, p->layer_size * sizeof(p->layer[0]));
+	}
+	print_report_layer_t * l = &p->layer[p->layer_count++];
+	memset(l, 0, sizeof(*l));
+	l->z = z;
+	l->start = start;
+}
+
+/*
+ * Is the host waiting for the "ok" of a M109 or M190?
+ */
+static int
+print_report_waiting(
+		print_report_p p)
+{
+	if (!p->host || !p->host->waiting_ok)
+		return 0;
+	const char * l = p->host->line;
+	if (*l == 'N') {	// line number, when checksumming
+		while (*l && *l != ' ')
+			l++;
+		while (*l == ' ')
+			l++;
+	}
+	return (!strncmp(l, "M109", 4) || !strncmp(l, "M190", 4)) &&
+			(l[4] < '0' || l[4] > '9');
+}
+
+static avr_cycle_count_t
+print_report_sample_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	print_report_p p = (print_report_p)param;
+
+	if (p->end)
+		return 0;
+
+	float z = stepper_get_position_mm(p->z);
+	float e = stepper_get_position_mm(p->e);
+	float de = e - p->last_e;
+
+	if (fabsf(z - p->last_z) > PRINT_REPORT_Z_EPSILON) {
+		p->last_z = z;
+		p->z_moved = when;
+	}
+	if (de > PRINT_REPORT_E_EPSILON) {
+		// pushing filament at a new height, that's a new layer
+		if (!p->layer_count ||
+				fabsf(p->layer[p->layer_count - 1].z - z) > PRINT_REPORT_Z_EPSILON)
+			print_report_new_layer(p, z, p->z_moved);
+		p->layer[p->layer_count - 1].filament += de;
+		p->filament += de;
+		p->last_e = e;
+	} else if (de < -PRINT_REPORT_E_EPSILON) {
+		p->retracted -= de;
+		p->last_e = e;
+	}
+	if (print_report_waiting(p))
+		p->wait_cycles += p->period;
+
+	if (when - p->window_start >= p->window) {
+		for (int i = 0; i < PRINT_REPORT_HEATERS; i++) {
+			print_report_heater_t * h = &p->heater[i];
+			print_report_heater_account(h, when);
+			float duty = (float)h->window_on / (when - p->window_start);
+			if (duty > h->peak)
+				h->peak = duty;
+			h->window_on = 0;
+		}
+		p->window_start = when;
+	}
+	return when + p->period;
+}
+
+static const char * irq_names[IRQ_PRINT_REPORT_COUNT] = {
+	[IRQ_PRINT_REPORT_HOTEND_IN] = "1<report.hotend",
+	[IRQ_PRINT_REPORT_HOTBED_IN] = "1<report.hotbed",
+};
+
+void
+print_report_init(
+		struct avr_t * avr,
+		print_report_p p,
+		stepper_p z,
+		stepper_p e,
+		gcode_host_p host )
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->z = z;
+	p->e = e;
+	p->host = host;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_PRINT_REPORT_COUNT, irq_names);
+	for (int i = 0; i < IRQ_PRINT_REPORT_COUNT; i++)
+		avr_irq_register_notify(p->irq + i, print_report_heater_hook, p);
+
+	p->period = avr_usec_to_cycles(avr, 1000);
+	p->window = avr_usec_to_cycles(avr, 1000000);
+	p->start = p->window_start = p->z_moved = avr->cycle;
+	p->last_z = stepper_get_position_mm(z);
+	p->last_e = stepper_get_position_mm(e);
+	for (int i = 0; i < PRINT_REPORT_HEATERS; i++)
+		p->heater[i].last = avr->cycle;
+	avr_cycle_timer_register(avr, p->period, print_report_sample_timer, p);
+}
+
+void
+print_report_connect(
+		print_report_p p,
+		avr_irq_t * hotend_heater,
+		avr_irq_t * hotbed_heater )
+{
+	if (hotend_heater)
+		avr_connect_irq(hotend_heater, p->irq + IRQ_PRINT_REPORT_HOTEND_IN);
+	if (hotbed_heater)
+		avr_connect_irq(hotbed_heater, p->irq + IRQ_PRINT_REPORT_HOTBED_IN);
+}
+
+void
+print_report_finish(
+		print_report_p p )
+{
+	if (p->end)
+		return;
+	p->end = p->avr->cycle;
+	if (p->layer_count)
+		p->layer[p->layer_count - 1].end = p->end;
+	for (int i = 0; i < PRINT_REPORT_HEATERS; i++)
+		print_report_heater_account(&p->heater[i], p->end);
+	avr_cycle_timer_cancel(p->avr, print_report_sample_timer, p);
+}
+
+void
+print_report_json(
+		print_report_p p,
+		FILE * out )
+{
+	static const char * heater_name[PRINT_REPORT_HEATERS] = { "hotend", "hotbed" };
+	avr_cycle_count_t end = p->end ? p->end : p->avr->cycle;
+	avr_cycle_count_t total = end - p->start;
+
+	fprintf(out, "{ \"time_sec\": %.3f, \"layers\": %d, "
+			"\"filament_mm\": %.3f, \"retracted_mm\": %.3f, "
+			"\"temperature_wait_sec\": %.3f,\n",
+			print_report_sec(p, total), p->layer_count,
+			p->filament, p->retracted, print_report_sec(p, p->wait_cycles));
+	for (int i = 0; i < PRINT_REPORT_HEATERS; i++) {
+		print_report_heater_t * h = &p->heater[i];
+		fprintf(out, "    \"%s\": { \"duty_avg\": %.4f, \"duty_peak\": %.4f },\n",
+				heater_name[i], total ? (double)h->on_cycles / total : 0, h->peak);
+	}
+	fprintf(out, "    \"layer\": [");
+	for (int i = 0; i < p->layer_count; i++) {
+		print_report_layer_t * l = &p->layer[i];
+		avr_cycle_count_t le = l->end ? l->end : end;
+		fprintf(out, "%s\n      { \"z\": %.3f, \"start_sec\": %.3f, \"time_sec\": %.3f, "
+				"\"filament_mm\": %.3f }",
+				i ? "," : "", l->z, print_report_sec(p, l->start - p->start),
+				print_report_sec(p, le - l->start), l->filament);
+	}
+	fprintf(out, " ] }");
+}
+
+void
+print_report_snapshot(
+		print_report_p p,
+		avr_snapshot_t * s )
+{
+	AVR_SNAPSHOT(s, p->start);
+	AVR_SNAPSHOT(s, p->end);
+	AVR_SNAPSHOT(s, p->window_start);
+	AVR_SNAPSHOT(s, p->last_z);
+	AVR_SNAPSHOT(s, p->last_e);
+	AVR_SNAPSHOT(s, p->z_moved);
+	AVR_SNAPSHOT(s, p->filament);
+	AVR_SNAPSHOT(s, p->retracted);
+	AVR_SNAPSHOT(s, p->wait_cycles);
+	AVR_SNAPSHOT(s, p->heater);
+
+	int count = p->layer_count;
+	AVR_SNAPSHOT(s, count);
+	if (s->restore && !s->error && count > p->layer_size) {
+		p->layer_size = count;
+		p->layer = realloc(p->layer, count * sizeof(p->layer[0]));
+	}
+	if (!s->error) {
+		p->layer_count = count;
+		if (count)
+			avr_snapshot_data(s, "layer", p->layer, count * sizeof(p->layer[0]));
+	}
+	avr_snapshot_timer(s, print_report_sample_timer, p);
+}
+
+void
+print_report_dispose(
+		print_report_p p )
+{
+	free(p->layer);
+	p->layer = NULL;
+	p->layer_count = p->layer_size = 0;
+}
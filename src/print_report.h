@@ -0,0 +1,136 @@
+/*
+	print_report.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Watches a print and tells how long it really took, as the firmware ran
+ * it: time per layer, filament used, heater duty, and the time spent
+ * waiting for the heaters (M109/M190).
+ *
+ * The Z and E steppers are sampled every millisecond of simulated time. A
+ * new layer starts when filament is pushed at a new Z height, so Z hops
+ * and travel moves don't count as layers. The heater pins are connected to
+ * the IRQ inputs, their duty is averaged over the whole print, and the
+ * peak is the highest over a one second window.
+ */
+#ifndef __PRINT_REPORT_H___
+#define __PRINT_REPORT_H___
+
+#include <stdio.h>
+#include "sim_irq.h"
+#include "stepper.h"
+#include "gcode_host.h"
+
+struct avr_snapshot_t;
+
+enum {
+	IRQ_PRINT_REPORT_HOTEND_IN = 0,		// heater pins
+	IRQ_PRINT_REPORT_HOTBED_IN,
+	IRQ_PRINT_REPORT_COUNT
+};
+
+enum {
+	PRINT_REPORT_HOTEND = 0,
+	PRINT_REPORT_HOTBED,
+	PRINT_REPORT_HEATERS
+};
+
+typedef struct print_report_layer_t {
+	float		z;			// mm
+	avr_cycle_count_t	start, end;
+	float		filament;	// mm pushed in this layer
+} print_report_layer_t;
+
+typedef struct print_report_heater_t {
+	int			on;
+	avr_cycle_count_t	last;		// cycle of the last change
+	avr_cycle_count_t	on_cycles;	// since the start
+	avr_cycle_count_t	window_on;	// in the current window
+	float		peak;		// highest duty of any window
+} print_report_heater_t;
+
+typedef struct print_report_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t * avr;
+	stepper_p	z, e;
+	gcode_host_p	host;	// optional, to know when it waits on temperature
+
+	avr_cycle_count_t	period;		// sampling
+	avr_cycle_count_t	window;		// for the peak duty
+	avr_cycle_count_t	start, end;	// end is zero until finished
+	avr_cycle_count_t	window_start;
+
+	float		last_z, last_e;
+	avr_cycle_count_t	z_moved;	// when Z last changed
+	float		filament;	// mm, all the positive E moves
+	float		retracted;	// mm, all the negative ones
+	avr_cycle_count_t	wait_cycles;	// in M109/M190
+
+	print_report_heater_t	heater[PRINT_REPORT_HEATERS];
+
+	int			layer_count, layer_size;
+	print_report_layer_t *	layer;
+} print_report_t, *print_report_p;
+
+/*
+ * 'host' is optional, without it the temperature waits aren't known
+ */
+void
+print_report_init(
+		struct avr_t * avr,
+		print_report_p p,
+		stepper_p z,
+		stepper_p e,
+		gcode_host_p host );
+
+void
+print_report_connect(
+		print_report_p p,
+		avr_irq_t * hotend_heater,
+		avr_irq_t * hotbed_heater );
+
+/*
+ * Close the current layer and the heater accounting, at the current cycle
+ */
+void
+print_report_finish(
+		print_report_p p );
+
+/*
+ * Writes the report as a JSON object
+ */
+void
+print_report_json(
+		print_report_p p,
+		FILE * out );
+
+/*
+ * Save/restore the report so far, see sim_snapshot.h
+ */
+void
+print_report_snapshot(
+		print_report_p p,
+		struct avr_snapshot_t * s );
+
+void
+print_report_dispose(
+		print_report_p p );
+
+#endif /* __PRINT_REPORT_H___ */
@@ -1,5 +1,5 @@
 /*
-	simduino.c
+	reprap.c
 
 	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
 
@@ -20,243 +20,150 @@
  */
 
 #include <unistd.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "sim_avr.h"
-#include "avr_ioport.h"
-#include "sim_elf.h"
-#include "sim_hex.h"
-#include "sim_gdb.h"
+#include "sim_time.h"
 
+// reprap_headless.c builds this without any of the GL parts
+#ifndef REPRAP_HEADLESS
+#define REPRAP_HEADLESS	0
+#endif
+
+#if !REPRAP_HEADLESS
 #include "reprap_gl.h"
+#endif
 
-#include "button.h"
 #include "reprap.h"
-#include "arduidiot_pins.h"
-
-#define __AVR_ATmega644__
-#include "marlin/pins.h"
-
-#include <stdbool.h>
-#define PROGMEM
-#include "marlin/Configuration.h"
-
-/*
- * these are the sources of heat and cold to register to the heatpots
- */
-enum {
-	TALLY_AMBIANT = 1,
-	TALLY_HOTEND_PWM,
-	TALLY_HOTBED,
-	TALLY_HOTEND_FAN,
-};
-
-reprap_t reprap;
-
-avr_t * avr = NULL;
+#include "scenario.h"
 
-// gnu hackery to make sure the parameter is expanded
-#define _TERMISTOR_TABLE(num) \
-		temptable_##num
-#define TERMISTOR_TABLE(num) \
-		_TERMISTOR_TABLE(num)
-
-/*
- * called when the AVR change any of the pins on port B
- * so lets update our buffer
- */
-static void
-hotbed_change_hook(
-		struct avr_irq_t * irq,
-		uint32_t value,
-		void * param)
-{
-//	printf("%s %d\n", __func__, value);
-//	pin_state = (pin_state & ~(1 << irq->irq)) | (value << irq->irq);
-	heatpot_tally(
-			&reprap.hotbed,
-			TALLY_HOTEND_PWM,
-			value ? 1.0f : 0 );
-}
-static void
-hotend_change_hook(
-		struct avr_irq_t * irq,
-		uint32_t value,
-		void * param)
-{
-//	printf("%s %d\n", __func__, value);
-//	pin_state = (pin_state & ~(1 << irq->irq)) | (value << irq->irq);
-	heatpot_tally(
-			&reprap.hotend,
-			TALLY_HOTBED,
-			value ? 1.0f : 0 );
-}
-static void
-hotend_fan_change_hook(
-		struct avr_irq_t * irq,
-		uint32_t value,
+#if !REPRAP_HEADLESS
+static void *
+avr_run_thread(
 		void * param)
 {
-	printf("%s %d\n", __func__, value);
-//	pin_state = (pin_state & ~(1 << irq->irq)) | (value << irq->irq);
-	heatpot_tally(
-			&reprap.hotend,
-			TALLY_HOTEND_FAN,
-			value ? -0.05 : 0 );
-}
-
+	reprap_p r = (reprap_p)param;
 
-
-char avr_flash_path[1024];
-int avr_flash_fd = 0;
-
-// avr special flash initalization
-// here: open and map a file to enable a persistent storage for the flash memory
-void avr_special_init( avr_t * avr)
-{
-	// open the file
-	avr_flash_fd = open(avr_flash_path, O_RDWR|O_CREAT, 0644);
-	if (avr_flash_fd < 0) {
-		perror(avr_flash_path);
-		exit(1);
-	}
-	// resize and map the file the file
-	(void)ftruncate(avr_flash_fd, avr->flashend + 1);
-	ssize_t r = read(avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(avr_flash_path);
-		exit(1);
-	}
+	while (1)
+		reprap_run_for(r, 100000);
+	return NULL;
 }
+#endif
+
+typedef struct reprap_scenario_t {
+	reprap_p	r;
+	int			count;
+	const char **	file;
+	avr_cycle_count_t	limit;	// maximum simulated cycles per scenario
+} reprap_scenario_t;
+
+typedef struct reprap_scenario_result_t {
+	int			done;
+	int			state;		// of the AVR, at the end
+	double		wall;		// seconds
+	gcode_host_stats_t	stats;
+	float		position[4];	// X, Y, Z, E in mm
+	float		hotend, hotbed;
+} reprap_scenario_result_t;
 
-// avr special flash deinitalization
-// here: cleanup the persistent storage
-void avr_special_deinit( avr_t* avr)
+/*
+ * Called in a child, the machine is in the state the parent left it
+ */
+static int
+reprap_scenario_run(
+		void * param,
+		int index,
+		void * result)
 {
-	puts(__func__);
-	lseek(avr_flash_fd, SEEK_SET, 0);
-	ssize_t r = write(avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(avr_flash_path);
-	}
-	close(avr_flash_fd);
-	uart_pty_stop(&reprap.uart_pty);
+	reprap_scenario_t * s = (reprap_scenario_t *)param;
+	reprap_scenario_result_t * res = (reprap_scenario_result_t *)result;
+	reprap_p r = s->r;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (gcode_host_load(&r->gcode_host, s->file[index]))
+		return -1;
+	res->state = reprap_run_gcode(r, s->limit);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	res->done = r->gcode_host.done;
+	res->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1E9;
+	res->stats = r->gcode_host.stats;
+	if (!res->done)
+		res->stats.end_cycle = r->avr->cycle;
+	res->position[0] = stepper_get_position_mm(&r->step_x);
+	res->position[1] = stepper_get_position_mm(&r->step_y);
+	res->position[2] = stepper_get_position_mm(&r->step_z);
+	res->position[3] = stepper_get_position_mm(&r->step_e);
+	res->hotend = r->hotend.current;
+	res->hotbed = r->hotbed.current;
+	return res->done ? 0 : -1;
 }
 
-#define MEGA644_GPIOR0 0x3e
-
 static void
-reprap_relief_callback(
-		struct avr_t * avr,
-		avr_io_addr_t addr,
-		uint8_t v,
-		void * param)
+reprap_scenario_done(
+		void * param,
+		int index,
+		int status,
+		void * result)
 {
-//	printf("%s write %x\n", __func__, addr);
-	static uint16_t tick = 0;
-	if (!(tick++ & 0xf))
-		usleep(100);
-}
+	reprap_scenario_t * s = (reprap_scenario_t *)param;
+	reprap_scenario_result_t * res = (reprap_scenario_result_t *)result;
 
-static void *
-avr_run_thread(
-		void * ignore)
-{
-	while (1) {
-		avr_run(avr);
+	if (status && !res->stats.start_cycle) {
+		printf("scenario %s: FAILED (status %d)\n", s->file[index], status);
+		return;
 	}
-	return NULL;
+	double sim = avr_cycles_to_nsec(s->r->avr,
+			res->stats.end_cycle - res->stats.start_cycle) / 1E9;
+	printf("scenario %s: %s %u lines %u errors %u resends, "
+			"%.3fs simulated %.3fs wall, "
+			"X%.3f Y%.3f Z%.3f E%.3f, hotend %.1fC hotbed %.1fC\n",
+			s->file[index],
+			res->done ? "ok" : res->state == cpu_Crashed ? "CRASHED" : "TIMEOUT",
+			res->stats.lines, res->stats.errors, res->stats.resends,
+			sim, res->wall,
+			res->position[0], res->position[1], res->position[2], res->position[3],
+			res->hotend, res->hotbed);
 }
 
-void
-reprap_init(
-		avr_t * avr,
-		reprap_p r)
+/*
+ * Headless batch mode, runs on the main thread until one of these
+ */
+typedef struct reprap_batch_t {
+	double		timeout;		// simulated seconds
+	float		hotend, hotbed;	// stop once reached, when non zero
+	const char *	json;		// summary file, NULL for stdout
+} reprap_batch_t;
+
+static const char *
+reprap_batch_run(
+		reprap_p r,
+		reprap_batch_t * b)
 {
-	r->avr = avr;
-	uart_pty_init(avr, &r->uart_pty);
-	uart_pty_connect(&r->uart_pty, '0');
-
-	thermistor_init(avr, &r->therm_hotend, 0,
-			(short*)TERMISTOR_TABLE(TEMP_SENSOR_0),
-			sizeof(TERMISTOR_TABLE(TEMP_SENSOR_0)) / sizeof(short) / 2,
-			OVERSAMPLENR, 25.0f);
-	thermistor_init(avr, &r->therm_hotbed, 2,
-			(short*)TERMISTOR_TABLE(TEMP_SENSOR_BED),
-			sizeof(TERMISTOR_TABLE(TEMP_SENSOR_BED)) / sizeof(short) / 2,
-			OVERSAMPLENR, 30.0f);
-	thermistor_init(avr, &r->therm_spare, 1,
-			(short*)temptable_5, sizeof(temptable_5) / sizeof(short) / 2,
-			OVERSAMPLENR, 10.0f);
-
-	heatpot_init(avr, &r->hotend, "hotend", 28.0f);
-	heatpot_init(avr, &r->hotbed, "hotbed", 25.0f);
-
-	heatpot_tally(&r->hotend, TALLY_AMBIANT, -0.5f);
-	heatpot_tally(&r->hotbed, TALLY_AMBIANT, -0.3f);
+	avr_cycle_count_t limit = avr_usec_to_cycles(r->avr, b->timeout * 1000000);
+	// check the stop conditions every simulated millisecond
+	avr_cycle_count_t chunk = avr_usec_to_cycles(r->avr, 1000);
 
-	/* connect heatpot temp output to thermistors */
-	avr_connect_irq(r->hotend.irq + IRQ_HEATPOT_TEMP_OUT,
-			r->therm_hotend.irq + IRQ_TERM_TEMP_VALUE_IN);
-	avr_connect_irq(r->hotbed.irq + IRQ_HEATPOT_TEMP_OUT,
-			r->therm_hotbed.irq + IRQ_TERM_TEMP_VALUE_IN);
-
-	avr_irq_register_notify(
-			get_ardu_irq(avr, HEATER_0_PIN, arduidiot_644),
-			hotend_change_hook, NULL);
-	avr_irq_register_notify(
-			get_ardu_irq(avr, FAN_PIN, arduidiot_644),
-			hotend_fan_change_hook, NULL);
-	avr_irq_register_notify(
-			get_ardu_irq(avr, HEATER_BED_PIN, arduidiot_644),
-			hotbed_change_hook, NULL);
-
-	//avr_irq_register_notify()
-	float axis_pp_per_mm[4] = DEFAULT_AXIS_STEPS_PER_UNIT;	// from Marlin!
-	{
-		avr_irq_t * e = get_ardu_irq(avr, X_ENABLE_PIN, arduidiot_644);
-		avr_irq_t * s = get_ardu_irq(avr, X_STEP_PIN, arduidiot_644);
-		avr_irq_t * d = get_ardu_irq(avr, X_DIR_PIN, arduidiot_644);
-		avr_irq_t * m = get_ardu_irq(avr, X_MIN_PIN, arduidiot_644);
-
-		stepper_init(avr, &r->step_x, "X", axis_pp_per_mm[0], 100, 200, 0);
-		stepper_connect(&r->step_x, s, d, e, m, stepper_endstop_inverted);
-	}
-	{
-		avr_irq_t * e = get_ardu_irq(avr, Y_ENABLE_PIN, arduidiot_644);
-		avr_irq_t * s = get_ardu_irq(avr, Y_STEP_PIN, arduidiot_644);
-		avr_irq_t * d = get_ardu_irq(avr, Y_DIR_PIN, arduidiot_644);
-		avr_irq_t * m = get_ardu_irq(avr, Y_MIN_PIN, arduidiot_644);
-
-		stepper_init(avr, &r->step_y, "Y", axis_pp_per_mm[1], 100, 200, 0);
-		stepper_connect(&r->step_y, s, d, e, m, stepper_endstop_inverted);
-	}
-	{
-		avr_irq_t * e = get_ardu_irq(avr, Z_ENABLE_PIN, arduidiot_644);
-		avr_irq_t * s = get_ardu_irq(avr, Z_STEP_PIN, arduidiot_644);
-		avr_irq_t * d = get_ardu_irq(avr, Z_DIR_PIN, arduidiot_644);
-		avr_irq_t * m = get_ardu_irq(avr, Z_MIN_PIN, arduidiot_644);
-
-		stepper_init(avr, &r->step_z, "Z", axis_pp_per_mm[2], 20, 130, 0);
-		stepper_connect(&r->step_z, s, d, e, m, stepper_endstop_inverted);
-	}
-	{
-		avr_irq_t * e = get_ardu_irq(avr, E0_ENABLE_PIN, arduidiot_644);
-		avr_irq_t * s = get_ardu_irq(avr, E0_STEP_PIN, arduidiot_644);
-		avr_irq_t * d = get_ardu_irq(avr, E0_DIR_PIN, arduidiot_644);
-
-		stepper_init(avr, &r->step_e, "E", axis_pp_per_mm[3], 0, 0, 0);
-		stepper_connect(&r->step_e, s, d, e, NULL, 0);
+	while (1) {
+		int state = reprap_run_gcode(r, chunk);
+		if (state == cpu_Crashed)
+			return "crashed";
+		if (state == cpu_Done)
+			return "stopped";
+		if (r->host == REPRAP_HOST_GCODE && r->gcode_host.done)
+			return "done";
+		if ((b->hotend > 0 && r->hotend.current >= b->hotend) ||
+				(b->hotbed > 0 && r->hotbed.current >= b->hotbed))
+			return "temperature";
+		if (r->avr->cycle >= limit)
+			return "timeout";
 	}
-
 }
 
 int main(int argc, char *argv[])
@@ -265,72 +172,138 @@ int main(int argc, char *argv[])
 	strcpy(path, argv[0]);
 	strcpy(path, dirname(path));
 	strcpy(path, dirname(path));
-	printf("Stripped base directory to '%s'\n", path);
+	fprintf(stderr, "Stripped base directory to '%s'\n", path);
 	chdir(path);
 
-	int debug = 0;
+	reprap_config_t config = {
+		.flash_file = "reprap_flash.bin",
+		.eeprom_file = "reprap_eeprom.bin",
+		.sync_usec = 1000000,
+	};
+	// fork mode: each of these is run from the state reached after -g
+	reprap_scenario_t scenarios = {
+		.file = calloc(argc, sizeof(char*)),
+	};
+	int parallel = sysconf(_SC_NPROCESSORS_ONLN);
+	double timeout = 600;	// simulated seconds
+	int headless = REPRAP_HEADLESS;
+	reprap_batch_t batch = { 0 };
 
 	for (int i = 1; i < argc; i++)
 		if (!strcmp(argv[i], "-d"))
-			debug++;
-	avr = avr_make_mcu_by_name("atmega644");
-	if (!avr) {
-		fprintf(stderr, "%s: Error creating the AVR core\n", argv[0]);
+			config.gdb++;
+		else if (!strcmp(argv[i], "--gdb-port") && i < argc-1)
+			config.gdb_port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-f"))
+			config.fast_uart++;
+		else if (!strcmp(argv[i], "-g") && i < argc-1)
+			config.gcode_file = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i < argc-1)
+			config.tcp_port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--record") && i < argc-1) {
+			config.stimulus_mode = STIMULUS_RECORD;
+			config.stimulus_file = argv[++i];
+		} else if (!strcmp(argv[i], "--replay") && i < argc-1) {
+			config.stimulus_mode = STIMULUS_REPLAY;
+			config.stimulus_file = argv[++i];
+		} else if (!strcmp(argv[i], "--seed") && i < argc-1)
+			config.seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--checkpoint") && i < argc-2) {
+			config.checkpoint_file = argv[++i];
+			config.checkpoint_cycle = strtoull(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "--restore") && i < argc-1)
+			config.restore_file = argv[++i];
+		else if (!strcmp(argv[i], "--firmware") && i < argc-1)
+			config.firmware = argv[++i];
+		else if (!strcmp(argv[i], "--fork") && i < argc-1)
+			scenarios.file[scenarios.count++] = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i < argc-1)
+			parallel = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--timeout") && i < argc-1)
+			timeout = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--headless"))
+			headless++;
+		else if (!strcmp(argv[i], "--until-hotend") && i < argc-1)
+			batch.hotend = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--until-hotbed") && i < argc-1)
+			batch.hotbed = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--json") && i < argc-1)
+			batch.json = argv[++i];
+	// forked scenarios need the built-in host, even just to wait for "start"
+	if (scenarios.count && !config.gcode_file)
+		config.gcode_file = "/dev/null";
+	// when running headless, we want these as fast as possible
+	config.throttle = !scenarios.count && !headless;
+	// the JSON summary says it all
+	config.quiet = headless;
+	config.report = headless;
+	// only the window shows the plastic
+	config.deposition = !headless && !scenarios.count;
+	// and they mustn't all write to the same persistent files
+	if (scenarios.count)
+		config.flash_file = config.eeprom_file = NULL;
+
+	reprap_p r = reprap_new(&config);
+	if (!r) {
+		fprintf(stderr, "%s: Unable to create the printer\n", argv[0]);
 		exit(1);
 	}
-//	snprintf(avr_flash_path, sizeof(avr_flash_path), "%s/%s", pwd, "simduino_flash.bin");
-	strcpy(avr_flash_path,  "reprap_flash.bin");
-	// register our own functions
-	avr->special_init = avr_special_init;
-	avr->special_deinit = avr_special_deinit;
-	avr_init(avr);
-	avr->frequency = 20000000;
-	avr->aref = avr->avcc = avr->vcc = 5 * 1000;	// needed for ADC
 
-	elf_firmware_t f;
-	const char * fname = "/opt/reprap/tvrrug/Marlin/Marlin/applet/Marlin.elf";
-	// try to load an ELF file, before trying the .hex
-	if (elf_read_firmware(fname, &f) == 0) {
-		printf("firmware %s f=%d mmcu=%s\n", fname, (int)f.frequency, f.mmcu);
-		avr_load_firmware(avr, &f);
-	} else {
-		char path[1024];
-		uint32_t base, size;
-//		snprintf(path, sizeof(path), "%s/%s", pwd, "ATmegaBOOT_168_atmega328.ihex");
-		strcpy(path, "marlin/Marlin.hex");
-//		strcpy(path, "marlin/bootloader-644-20MHz.hex");
-		uint8_t * boot = read_ihex_file(path, &size, &base);
-		if (!boot) {
-			fprintf(stderr, "%s: Unable to load %s\n", argv[0], path);
+	/*
+	 * Headless: boot (and home, or whatever the -g file does) once, then
+	 * fork a child per scenario, from that warm state
+	 */
+	if (scenarios.count) {
+		scenarios.r = r;
+		scenarios.limit = avr_usec_to_cycles(r->avr, timeout * 1000000);
+		int state = reprap_run_gcode(r, scenarios.limit);
+		if (!r->gcode_host.done) {
+			fprintf(stderr, "%s: warm up failed, cpu state %d\n", argv[0], state);
 			exit(1);
 		}
-		printf("Firmware %04x(%04x in AVR talk): %d bytes (%d words)\n", base, base/2, size, size/2);
-		memcpy(avr->flash + base, boot, size);
-		free(boot);
-		avr->pc = base;
-		avr->codeend = avr->flashend;
+		printf("%s: warm at cycle %llu, running %d scenarios, %d at a time\n",
+				argv[0], (unsigned long long)r->avr->cycle, scenarios.count, parallel);
+		int failed = scenario_fork(scenarios.count, parallel,
+				sizeof(reprap_scenario_result_t),
+				reprap_scenario_run, reprap_scenario_done, &scenarios);
+		printf("%s: %d scenarios, %d failed\n", argv[0], scenarios.count, failed);
+		reprap_free(r);
+		free(scenarios.file);
+		exit(failed ? 1 : 0);
 	}
-	//avr->trace = 1;
-
-	// even if not setup at startup, activate gdb if crashing
-	avr->gdb_port = 1234;
-	if (debug) {
-		printf("AVR is stopped, waiting on gdb on port %d. Use 'target remote :%d' in avr-gdb\n",
-				avr->gdb_port, avr->gdb_port);
-		avr->state = cpu_Stopped;
-		avr_gdb_init(avr);
+	free(scenarios.file);
+
+	/*
+	 * Batch: no display, no GLUT, just run here until a stop condition,
+	 * and tell what happened
+	 */
+	if (headless) {
+		struct timespec start, end;
+		batch.timeout = timeout;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		const char * reason = reprap_batch_run(r, &batch);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1E9;
+
+		FILE * out = batch.json ? fopen(batch.json, "w") : stdout;
+		if (!out) {
+			perror(batch.json);
+			out = stdout;
+		}
+		reprap_json_summary(r, reason, wall, out);
+		if (out != stdout)
+			fclose(out);
+		int ok = !strcmp(reason, "done") || !strcmp(reason, "temperature");
+		reprap_free(r);
+		exit(ok ? 0 : 1);
 	}
 
-	// Marlin doesn't loop, sleep, so we don't know when it's idle
-	// I changed Marlin to do a spurious write to the GPIOR0 register so we can trap it
-	avr_register_io_write(avr, MEGA644_GPIOR0, reprap_relief_callback, NULL);
-
-	reprap_init(avr, &reprap);
-
-	gl_init(argc, argv);
+#if !REPRAP_HEADLESS
+	gl_init(argc, argv, r);
 	pthread_t run;
-	pthread_create(&run, NULL, avr_run_thread, NULL);
+	pthread_create(&run, NULL, avr_run_thread, r);
 
 	gl_runloop();
-
+#endif
+	return 0;
 }
@@ -28,10 +28,90 @@
 #include "heatpot.h"
 #include "stepper.h"
 #include "uart_pty.h"
+#include "uart_tcp.h"
+#include "gcode_host.h"
+#include "stimulus.h"
+#include "print_report.h"
+#include "deposition.h"
 #include "sim_vcd_file.h"
 
+/*
+ * The simulated hardware, the "plant" the firmware drives. Heaters are
+ * heatpot tally costs, see heatpot.h; axes are X, Y, Z and E, in mm
+ */
+typedef struct reprap_heater_plant_t {
+	float			ambient;		// Celsius
+	float			power;			// heater on
+	float			loss;			// to the ambient, negative
+	float			fan;			// fan on, negative
+} reprap_heater_plant_t;
+
+typedef struct reprap_axis_plant_t {
+	float			steps_per_mm;
+	float			start, max, endstop;
+} reprap_axis_plant_t;
+
+typedef struct reprap_plant_t {
+	reprap_heater_plant_t	hotend, hotbed;
+	reprap_axis_plant_t		axis[4];
+	float			filament_diameter;	// mm
+	uint32_t		uart_cycles;	// per byte, with fast_uart
+} reprap_plant_t;
+
+/*
+ * What to build; zero is a sensible default for everything but the
+ * host, which is a pty unless gcode_file or tcp_port are set
+ */
+typedef struct reprap_config_t {
+	const char *	firmware;		// .hex, or .elf; NULL for the default Marlin
+	const char *	flash_file;		// persistent flash, NULL for none
+	const char *	eeprom_file;	// persistent eeprom, NULL for none
+	uint32_t		sync_usec;		// flush them every so often (simulated), 0 for never
+	int				gdb;			// stop and wait for gdb
+	uint16_t		gdb_port;		// zero for 1234 + the instance number
+	int				fast_uart;		// ignore the baud rate
+	const reprap_plant_t *	plant;	// NULL for reprap_plant_defaults()
+	int				throttle;		// sleep a bit when Marlin is idle, for interactive use
+	int				quiet;			// no chatter on stdout, for fleets of them
+	int				report;			// keep a print_report of the job
+	int				deposition;		// follow the plastic laid down, for display
+
+	const char *	gcode_file;		// stream this file instead of using a pty
+	uint16_t		tcp_port;		// use a tcp port instead of a pty
+
+	int				stimulus_mode;	// STIMULUS_RECORD/REPLAY, or zero
+	const char *	stimulus_file;
+	uint32_t		seed;			// for the heatpot noise, zero for default
+
+	const char *	checkpoint_file;	// saved when reaching checkpoint_cycle
+	avr_cycle_count_t	checkpoint_cycle;
+	const char *	restore_file;		// start from this checkpoint
+} reprap_config_t;
+
+enum {
+	REPRAP_HOST_NONE = 0,
+	REPRAP_HOST_PTY,
+	REPRAP_HOST_TCP,
+	REPRAP_HOST_GCODE,
+};
+
+// byte range of a mapped file that needs flushing, empty if start >= end
+typedef struct reprap_dirty_t {
+	uint32_t		start, end;
+} reprap_dirty_t;
+
 typedef struct reprap_t {
 	struct avr_t *	avr;
+	reprap_config_t	config;
+	reprap_plant_t	plant;
+	int				flash_fd;
+	int				flash_mapped;	// flash is a private mapping of the firmware image
+	reprap_dirty_t	flash_dirty;
+	int				eeprom_fd;
+	uint8_t *		eeprom;		// mapped eeprom_file
+	reprap_dirty_t	eeprom_dirty;
+	uint16_t		relief_tick;
+
 	thermistor_t	therm_hotend;
 	thermistor_t	therm_hotbed;
 	thermistor_t	therm_spare;
@@ -40,8 +120,82 @@ typedef struct reprap_t {
 
 	stepper_t		step_x, step_y, step_z, step_e;
 
+	int				host;		// REPRAP_HOST_*, what is on the UART
 	uart_pty_t		uart_pty;
+	uart_tcp_t		uart_tcp;
+	gcode_host_t	gcode_host;
+
+	stimulus_t		stimulus;
+	print_report_t	report;
+	deposition_t	deposition;
 	avr_vcd_t		vcd_file;
 } reprap_t, *reprap_p;
 
+/*
+ * Fill 'plant' with the hardware as the Marlin configuration describes it,
+ * to start from when simulating a variant of it
+ */
+void
+reprap_plant_defaults(
+		reprap_plant_t * plant );
+
+/*
+ * Build a printer: AVR core, firmware and all the parts, following 'config'.
+ * There is no global state, any number of them can run, each one from a
+ * single thread at a time. Returns NULL on error
+ */
+reprap_p
+reprap_new(
+		const reprap_config_t * config );
+
+/*
+ * Run for (at most) 'cycles', returns the AVR state, it stops early if
+ * the firmware is done or crashed
+ */
+int
+reprap_run_for(
+		reprap_p r,
+		avr_cycle_count_t cycles );
+
+/*
+ * Same, but also stops when the gcode file is done
+ */
+int
+reprap_run_gcode(
+		reprap_p r,
+		avr_cycle_count_t cycles );
+
+/*
+ * Save (or restore) the whole printer state, see sim_snapshot.h
+ */
+int
+reprap_snapshot(
+		reprap_p r,
+		const char * filename,
+		int restore );
+
+/*
+ * Flush the persistent flash and eeprom pages that changed, 'wait' for
+ * them to be on disk. This is also done periodically, and by reprap_free()
+ */
+int
+reprap_sync(
+		reprap_p r,
+		int wait );
+
+/*
+ * Writes what the printer is up to as a JSON object, with the print report
+ * when there is one. 'reason' is why it stopped, 'wall' the seconds it took
+ */
+void
+reprap_json_summary(
+		reprap_p r,
+		const char * reason,
+		double wall,
+		FILE * out );
+
+void
+reprap_free(
+		reprap_p r );
+
 #endif /* __REPRAP_H___ */
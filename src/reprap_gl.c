@@ -36,11 +36,13 @@
 
 #include "reprap.h"
 #include "reprap_gl.h"
+#include "deposition_gl.h"
 
 #include "c3.h"
 #include "c3camera.h"
 #include "c3driver_context.h"
 #include "c3model_obj.h"
+#include "c3cache.h"
 #include "c3lines.h"
 #include "c3sphere.h"
 #include "c3light.h"
@@ -67,7 +69,9 @@ c3texture_p fbo_c3;			// frame buffer object texture
 c3program_p fxaa = NULL;	// full screen antialias shader
 c3program_p scene = NULL;
 c3gl_fbo_t 	fbo;
-c3gl_fbo_t 	shadow;
+c3gl_fbo_t 	shadow;			// dynamic casters
+c3gl_fbo_t 	shadow_static;	// everything else, cached
+c3geometry_array_t head_casters = C_ARRAY_NULL;	// drawn in the dynamic pass
 c3geometry_p debug_shadowmap_decal = NULL;
 
 uint16_t	visible_views = 0xffff;
@@ -76,19 +80,41 @@ enum {
 	uniform_ShadowMap = 0,
 	uniform_pixelOffset,
 	uniform_tex0,
-	uniform_shadowMatrix
+	uniform_shadowMatrix,
+	uniform_staticShadowMap,
 };
 const char *uniforms_scene[] = {
 		"shadowMap",
 		"pixelOffset",
 		"tex0",
 		"shadowMatrix",
+		"staticShadowMap",
 		NULL
 };
 
 int glsl_version = 110;
 
-extern reprap_t reprap;
+static reprap_p reprap;	// the printer we show
+static deposition_gl_t plastic;	// what it printed so far
+
+/*
+ * Nothing is redrawn unless something changed: the head moved, there is
+ * more plastic, or the camera/anything else dirtied a context. The timer
+ * polls for that, backing off when idle, and never faster than twice what
+ * the last frame cost.
+ */
+#define REDRAW_MIN_MS	(1000 / 60)
+#define REDRAW_IDLE_MS	100
+
+static struct {
+	c3vec3		head;		// head position in the scene
+	uint32_t	plastic;	// plastic segments in the shadow map
+	uint32_t	baked;		// plastic segments in the static shadow map
+	int			casters;	// static casters in it
+	c3mat4		light;		// light projection it was drawn with
+	int			frame_ms;	// what the last frame cost
+	int			period;		// timer period
+} shown;
 
 static int dumpError(const char * what)
 {
@@ -196,19 +222,67 @@ _gl_key_cb(
 	}
 }
 
+/*
+ * The static shadow casters (bed, frame, plastic already printed) are
+ * drawn in their own depth texture, only when the light moved, or when
+ * there is enough new plastic to be worth it. Every frame only draws the
+ * head and the newest plastic in 'shadow', and the shader uses both.
+ */
+#define SHADOW_BACKLOG	4096	// plastic segments drawn as dynamic, at most
+
+static void
+_gl_shadow_draw(
+		c3context_view_p view)
+{
+	// 'd' mode: the light view is on screen, draw it all there
+	if (visible_views != 0xffff) {
+		c3context_draw(c3);
+		for (int i = 0; i < head_casters.count; i++)
+			c3geometry_draw(head_casters.e[i]);
+		glLoadMatrixf(view->cam.mtx.n);
+		deposition_gl_draw(&plastic, 0, plastic.done);
+		return;
+	}
+	c3mat4 light = c3mat4_mul(&view->projection, &view->cam.mtx);
+	if (memcmp(&light, &shown.light, sizeof(light)) ||
+			view->projected.count != shown.casters ||
+			plastic.done - shown.baked > SHADOW_BACKLOG) {
+		glBindFramebuffer(GL_FRAMEBUFFER, C3APIO_INT(shadow_static.fbo));
+		glClear(GL_DEPTH_BUFFER_BIT);
+		c3context_draw(c3);
+		glLoadMatrixf(view->cam.mtx.n);
+		deposition_gl_draw(&plastic, 0, plastic.done);
+		glBindFramebuffer(GL_FRAMEBUFFER, C3APIO_INT(view->bid));
+
+		shown.light = light;
+		shown.casters = view->projected.count;
+		shown.baked = plastic.done;
+	}
+	for (int i = 0; i < head_casters.count; i++)
+		c3geometry_draw(head_casters.e[i]);
+	glLoadMatrixf(view->cam.mtx.n);
+	deposition_gl_draw(&plastic, shown.baked, plastic.done);
+}
+
 static void
 _gl_display_cb(void)		/* function called whenever redisplay needed */
 {
-	c3vec3 headp = c3vec3f(
-			stepper_get_position_mm(&reprap.step_x),
-			stepper_get_position_mm(&reprap.step_y),
-			stepper_get_position_mm(&reprap.step_z));
-	c3mat4 headmove = translation3D(headp);
-	c3transform_set(head->transform.e[0], &headmove);
+	int start = glutGet(GLUT_ELAPSED_TIME);
+
+	if (reprap->config.deposition)
+		deposition_gl_update(&plastic);
+
+	/*
+	 * The shadow map stays valid until something that casts a shadow
+	 * moves; the camera doesn't. In 'd' mode the light view is what's
+	 * on screen, so it's always drawn
+	 */
+	int shadowDirty = c3->root->dirty || c3->views.e[1].dirty ||
+			plastic.done != shown.plastic || visible_views != 0xffff;
+	shown.plastic = plastic.done;
 
 	int drawIndexes[] = { 1, 0 };
-//	int drawViewStart = c3->views.e[1].dirty || c3->root->dirty ? 0 : 1;
-	int drawViewStart = 0;
+	int drawViewStart = shadowDirty ? 0 : 1;
 
 	for (int vi = drawViewStart; vi < 2; vi++)  if (visible_views & (1<<drawIndexes[vi])) {
 		c3context_view_set(c3, drawIndexes[vi]);
@@ -278,7 +352,16 @@ _gl_display_cb(void)		/* function called whenever redisplay needed */
 			GLCHECK(glUseProgram(0));
 		}
 
-		c3context_draw(c3);
+		if (view->type == C3_CONTEXT_VIEW_LIGHT) {
+			_gl_shadow_draw(view);
+		} else {
+			c3context_draw(c3);
+			glMatrixMode(GL_MODELVIEW);
+			glLoadMatrixf(view->cam.mtx.n);
+			GLCHECK(glUseProgram(C3APIO_INT(scene->pid)));
+			deposition_gl_draw(&plastic, 0, plastic.done);
+			glUseProgram(0);
+		}
 #if 0
 		if (c3->current == 0) {
 			glLoadMatrixf(view->cam.mtx.n);
@@ -330,6 +413,7 @@ _gl_display_cb(void)		/* function called whenever redisplay needed */
 	c3context_draw(hud);
 
     glutSwapBuffers();
+    shown.frame_ms = glutGet(GLUT_ELAPSED_TIME) - start;
 }
 
 #if !defined(GLUT_WHEEL_UP)
@@ -363,6 +447,7 @@ void _gl_button_cb(
 				c3cam_set_distance(&view->cam,
 						view->cam.distance * ((b == GLUT_WHEEL_DOWN) ? (1.0+d) : (1.0-d)));
 				view->dirty = 1;	// resort the array
+				glutPostRedisplay();
 			}
 			break;
 	}
@@ -405,13 +490,49 @@ _gl_motion_cb(
 	move = m;
 }
 
-// gl timer. if the lcd is dirty, refresh display
+/*
+ * Move the head where the printer has it, returns nonzero if it moved
+ */
+static int
+_gl_head_update(void)
+{
+	c3vec3 headp = c3vec3f(
+			stepper_get_position_mm(&reprap->step_x),
+			stepper_get_position_mm(&reprap->step_y),
+			stepper_get_position_mm(&reprap->step_z));
+	if (c3vec3_equal(headp, shown.head))
+		return 0;
+	shown.head = headp;
+	c3mat4 headmove = translation3D(headp);
+	c3transform_set(head->transform.e[0], &headmove);
+	return 1;
+}
+
+// gl timer. if anything is dirty, refresh display
 static void
 _gl_timer_cb(
 		int i)
 {
-	glutTimerFunc(1000 / 24, _gl_timer_cb, 0);
-	glutPostRedisplay();
+	int changed = _gl_head_update();
+	if (reprap->config.deposition &&
+			deposition_count(&reprap->deposition) != plastic.done)
+		changed++;
+	if (c3->root->dirty || hud->root->dirty ||
+			c3->views.e[0].dirty || c3->views.e[1].dirty)
+		changed++;
+
+	if (changed) {
+		glutPostRedisplay();
+		shown.period = REDRAW_MIN_MS;
+	} else if (shown.period < REDRAW_IDLE_MS) {
+		shown.period *= 2;
+		if (shown.period > REDRAW_IDLE_MS)
+			shown.period = REDRAW_IDLE_MS;
+	}
+	int period = shown.period;
+	if (period < shown.frame_ms * 2)
+		period = shown.frame_ms * 2;
+	glutTimerFunc(period, _gl_timer_cb, 0);
 }
 
 static c3pixels_p
@@ -420,6 +541,14 @@ _c3pixels_load_image(
 		const char * filename,
 		int type)
 {
+	// decoding the PNGs is most of the startup, keep them decoded
+	str_p cache = c3cache_name(filename);
+	c3pixels_p dst = c3cache_load_pixels(cache->str, filename, type);
+	if (dst) {
+		str_free(cache);
+		c3pixels_array_add(&context->pixels, dst);
+		return dst;
+	}
 	ILuint ImageName = 0;
 	ilBindImage(ImageName);
 	ilLoadImage(filename);
@@ -437,7 +566,7 @@ _c3pixels_load_image(
 
 	int rowsize = map[type].bpp * ilGetInteger(IL_IMAGE_WIDTH);
 	printf("pad = %d = %d\n", rowsize, rowsize % 4);
-	c3pixels_p dst = c3pixels_new(
+	dst = c3pixels_new(
 			ilGetInteger(IL_IMAGE_WIDTH),
 	        ilGetInteger(IL_IMAGE_HEIGHT),
 	        map[type].bpp,
@@ -448,6 +577,8 @@ _c3pixels_load_image(
 			map[type].iltype, IL_UNSIGNED_BYTE, dst->base);
 	printf("loaded %s %dx%dx%d pix %p\n", filename, dst->w, dst->h, dst->psize, dst->base);
 	dst->name = str_new(filename);
+	c3cache_save_pixels(cache->str, filename, dst);
+	str_free(cache);
 	c3pixels_array_add(&context->pixels, dst);
 	return dst;
 }
@@ -457,8 +588,10 @@ const c3driver_context_t * c3_driver_list[3] = { NULL, NULL };
 int
 gl_init(
 		int argc,
-		char *argv[] )
+		char *argv[],
+		struct reprap_t * r )
 {
+	reprap = r;
 	glutInit(&argc, argv);		/* initialize GLUT system */
 
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH/* | GLUT_ALPHA*/);
@@ -467,7 +600,8 @@ gl_init(
 
 	glutDisplayFunc(_gl_display_cb);		/* set window's display callback */
 	glutKeyboardFunc(_gl_key_cb);		/* set window's key callback */
-	glutTimerFunc(1000 / 24, _gl_timer_cb, 0);
+	shown.period = REDRAW_MIN_MS;
+	glutTimerFunc(shown.period, _gl_timer_cb, 0);
 
 	glutMouseFunc(_gl_button_cb);
 	glutMotionFunc(_gl_motion_cb);
@@ -561,6 +695,7 @@ gl_init(
 	{
 		c3vec2 size = c3vec2f(1024, 1024);
 		c3gl_fbo_create(&shadow, size, (1 << C3GL_FBO_DEPTH_TEX));
+		c3gl_fbo_create(&shadow_static, size, (1 << C3GL_FBO_DEPTH_TEX));
 
 		c3context_view_t v = {
 				.type = C3_CONTEXT_VIEW_LIGHT,
@@ -617,6 +752,8 @@ gl_init(
         		c3lines_init(g, p, 4, 0.18);
         	}
         }
+        // all the same material, make it one draw call
+        c3object_batch(grid);
     }
 
    if (0) {
@@ -633,12 +770,26 @@ gl_init(
 				g->vertice.count, p, 2);
 
     }
-    head = c3obj_load("gfx/buserror-nozzle-model.obj", c3->root);
+    {
+    	// the cache has it already welded
+    	const char *path = "gfx/buserror-nozzle-model.obj";
+    	str_p cache = c3cache_name(path);
+    	head = c3cache_load_object(cache->str, path, c3->root);
+    	if (!head) {
+    		head = c3obj_load(path, c3->root);
+    		if (head->geometry.count > 0)
+    			c3geometry_factor(head->geometry.e[0], 0.1, (25 * M_PI) / 180.0);
+    		c3cache_save_object(cache->str, path, head);
+    	}
+    	str_free(cache);
+    }
     c3transform_new(head);
+    // the head moves all the time, keep it out of the static shadow map
+    c3object_get_geometry(head, &head_casters);
+    head->hidden = (1 << 1);
 
     if (head->geometry.count > 0) {
     	c3geometry_p g = head->geometry.e[0];
-    	c3geometry_factor(g, 0.1, (25 * M_PI) / 180.0);
     //	g->mat.color = c3vec4f(0.6, 0.5, 0.0, 1.0);
     //	g->mat.texture = white_tex;
     //	head->geometry.e[0]->mat.color = c3vec4f(1.0, 1.0, 1.0, 1.0);
@@ -721,10 +872,20 @@ gl_init(
 		GLCHECK(glUniform2fv(
 				C3APIO_INT(scene->params.e[uniform_pixelOffset].pid), 1,
 					isize.n));
+		GLCHECK(glUniform1i(
+				C3APIO_INT(scene->params.e[uniform_staticShadowMap].pid), 6));
 		glActiveTexture(GL_TEXTURE7);
 		GLCHECK(glBindTexture(GL_TEXTURE_2D,
 				C3APIO_INT(shadow.buffers[C3GL_FBO_DEPTH_TEX].bid)));
+		glActiveTexture(GL_TEXTURE6);
+		GLCHECK(glBindTexture(GL_TEXTURE_2D,
+				C3APIO_INT(shadow_static.buffers[C3GL_FBO_DEPTH_TEX].bid)));
 		glActiveTexture(GL_TEXTURE0);
+
+		// the grid is in the scene, it gets the shadows; as it has a
+		// program, the lines are expanded once, not instanced
+		for (int i = 0; i < grid->geometry.count; i++)
+			grid->geometry.e[i]->mat.program = scene;
     }
     {
 		c3vec3 p[4] = {
@@ -764,6 +925,10 @@ gl_init(
     	c3text_set(t, c3vec2f(1, 20), "Hello World!");
     	t->geometry.mat.color = c3vec4f(0.5,0.5,0.5,1.0);
     }
+	if (reprap->config.deposition) {
+		const float orange[4] = { 1.0, 0.55, 0.1, 1.0 };
+		deposition_gl_init(&plastic, &reprap->deposition, orange);
+	}
 	return 1;
 }
 
@@ -773,6 +938,11 @@ gl_dispose()
 	c3context_dispose(c3);
 	c3context_dispose(hud);
 	c3gl_fbo_dispose(&fbo);
+	c3gl_fbo_dispose(&shadow);
+	c3gl_fbo_dispose(&shadow_static);
+	c3geometry_array_free(&head_casters);
+	if (reprap->config.deposition)
+		deposition_gl_dispose(&plastic);
 }
 
 int
@@ -23,10 +23,13 @@
 #ifndef __REPRAP_GL_H___
 #define __REPRAP_GL_H___
 
+struct reprap_t;
+
 int
 gl_init(
 		int argc,
-		char *argv[] );
+		char *argv[],
+		struct reprap_t * r );
 
 int
 gl_runloop();
@@ -0,0 +1,178 @@
+/*
+	scenario.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "scenario.h"
+
+typedef struct scenario_child_t {
+	pid_t		pid;	// zero when the slot is free
+	int			fd;		// read side of the result pipe
+	int			index;
+	size_t		got;
+	uint8_t *	result;
+} scenario_child_t;
+
+static void
+scenario_child(
+		int fd,
+		int index,
+		size_t result_size,
+		scenario_run_p run,
+		void * param )
+{
+	uint8_t * result = calloc(1, result_size);
+	int res = run(param, index, result);
+
+	// less than PIPE_BUF, the parent gets it in one go anyway
+	size_t done = 0;
+	while (done < result_size) {
+		ssize_t w = write(fd, result + done, result_size - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			break;
+		done += w;
+	}
+	fflush(NULL);
+	_exit(res ? 1 : 0);
+}
+
+int
+scenario_fork(
+		int count,
+		int parallel,
+		size_t result_size,
+		scenario_run_p run,
+		scenario_done_p done,
+		void * param )
+{
+	if (parallel < 1)
+		parallel = 1;
+	if (parallel > count)
+		parallel = count;
+	if (!count)
+		return 0;
+
+	scenario_child_t child[parallel];
+	struct pollfd pfd[parallel];
+	memset(child, 0, sizeof(child));
+	for (int ci = 0; ci < parallel; ci++)
+		child[ci].result = malloc(result_size);
+
+	int next = 0, running = 0, failed = 0, res = 0;
+	while ((next < count && !res) || running) {
+		// start as many children as allowed
+		for (int ci = 0; ci < parallel && next < count && !res; ci++) {
+			if (child[ci].pid)
+				continue;
+			int fds[2];
+			if (pipe(fds)) {
+				perror(__func__);
+				res = -1;
+				break;
+			}
+			// don't let the children inherit our stdio buffers
+			fflush(NULL);
+			pid_t pid = fork();
+			if (pid < 0) {
+				perror(__func__);
+				close(fds[0]);
+				close(fds[1]);
+				res = -1;
+				break;
+			}
+			if (pid == 0) {
+				close(fds[0]);
+				for (int oi = 0; oi < parallel; oi++)
+					if (child[oi].pid)
+						close(child[oi].fd);
+				scenario_child(fds[1], next, result_size, run, param);
+			}
+			close(fds[1]);
+			child[ci].pid = pid;
+			child[ci].fd = fds[0];
+			child[ci].index = next++;
+			child[ci].got = 0;
+			running++;
+		}
+		if (!running)
+			break;
+
+		int n = 0;
+		for (int ci = 0; ci < parallel; ci++)
+			if (child[ci].pid) {
+				pfd[n].fd = child[ci].fd;
+				pfd[n].events = POLLIN;
+				pfd[n].revents = 0;
+				n++;
+			}
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(__func__);
+			res = -1;
+			break;
+		}
+		for (int ci = 0, pi = 0; ci < parallel; ci++) {
+			scenario_child_t * c = &child[ci];
+			if (!c->pid)
+				continue;
+			if (!pfd[pi++].revents)
+				continue;
+			ssize_t r = 0;
+			if (c->got < result_size)
+				r = read(c->fd, c->result + c->got, result_size - c->got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r > 0) {
+				c->got += r;
+				continue;
+			}
+			// end of file, the child is done
+			int status = 0;
+			close(c->fd);
+			while (waitpid(c->pid, &status, 0) < 0 && errno == EINTR)
+				;
+			if (c->got != result_size) {
+				memset(c->result, 0, result_size);
+				if (!status)
+					status = -1;
+			}
+			if (status)
+				failed++;
+			if (done)
+				done(param, c->index, status, c->result);
+			c->pid = 0;
+			running--;
+		}
+	}
+	for (int ci = 0; ci < parallel; ci++)
+		free(child[ci].result);
+	return res ? res : failed;
+}
@@ -0,0 +1,67 @@
+/*
+	scenario.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 'count' scenarios from a warm machine, each in a fork()ed child, so
+ * they all start from the parent's state, sharing it's pages copy-on-write.
+ * At most 'parallel' children run at any time.
+ *
+ * Each child calls 'run', which fills a fixed size result that is sent back
+ * to the parent over a pipe. The parent gets a 'done' callback per child;
+ * one that crashed, or exited without sending a full result, is reported
+ * with a non zero status.
+ */
+#ifndef __SCENARIO_H___
+#define __SCENARIO_H___
+
+#include <stddef.h>
+
+/*
+ * Called in the child, returns 0 on success
+ */
+typedef int (*scenario_run_p)(
+		void * param,
+		int index,
+		void * result );
+/*
+ * Called in the parent for every child, status 0 with a full result,
+ * otherwise the wait() status, or -1 if the result was short. The result
+ * is zeroed when it's not complete
+ */
+typedef void (*scenario_done_p)(
+		void * param,
+		int index,
+		int status,
+		void * result );
+
+/*
+ * Returns the number of scenarios that failed, or -1 on error
+ */
+int
+scenario_fork(
+		int count,
+		int parallel,
+		size_t result_size,
+		scenario_run_p run,
+		scenario_done_p done,
+		void * param );
+
+#endif /* __SCENARIO_H___ */
@@ -0,0 +1,966 @@
+/*
+	simreprap.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The printer itself: AVR, firmware and parts, with no global state so
+ * a program can run as many as it likes. The GUI (reprap.c) is just one
+ * user of it.
+ */
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "avr_ioport.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_gdb.h"
+#include "avr_uart.h"
+#include "avr_eeprom.h"
+#include "avr_flash.h"
+#include "sim_snapshot.h"
+#include "sim_time.h"
+
+#include "reprap.h"
+#include "arduidiot_pins.h"
+
+#define __AVR_ATmega644__
+#include "marlin/pins.h"
+
+#include <stdbool.h>
+#define PROGMEM
+#include "marlin/Configuration.h"
+
+/*
+ * these are the sources of heat and cold to register to the heatpots
+ */
+enum {
+	TALLY_AMBIANT = 1,
+	TALLY_HOTEND_PWM,
+	TALLY_HOTBED,
+	TALLY_HOTEND_FAN,
+};
+
+// gnu hackery to make sure the parameter is expanded
+#define _TERMISTOR_TABLE(num) \
+		temptable_##num
+#define TERMISTOR_TABLE(num) \
+		_TERMISTOR_TABLE(num)
+
+#define MEGA644_GPIOR0 0x3e
+
+static void
+hotbed_change_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	heatpot_tally(
+			&r->hotbed,
+			TALLY_HOTEND_PWM,
+			value ? r->plant.hotbed.power : 0 );
+}
+static void
+hotend_change_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	heatpot_tally(
+			&r->hotend,
+			TALLY_HOTBED,
+			value ? r->plant.hotend.power : 0 );
+}
+static void
+hotend_fan_change_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	if (!r->config.quiet)
+		printf("%s %d\n", __func__, value);
+	heatpot_tally(
+			&r->hotend,
+			TALLY_HOTEND_FAN,
+			value ? r->plant.hotend.fan : 0 );
+}
+
+/*
+ * Map 'size' bytes of 'path', creating it if needed. If the file was
+ * shorter, the new part is initialized from 'fill'
+ */
+static uint8_t *
+reprap_map_file(
+		const char * path,
+		uint32_t size,
+		const uint8_t * fill,
+		int * fdp)
+{
+	struct stat st;
+	int fd = open(path, O_RDWR|O_CREAT, 0644);
+
+	if (fd < 0 || fstat(fd, &st) || ftruncate(fd, size)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	uint8_t * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < size)
+		memcpy(map + st.st_size, fill + st.st_size, size - st.st_size);
+	*fdp = fd;
+	return map;
+}
+
+static void
+reprap_dirty(
+		reprap_dirty_t * d,
+		uint32_t start,
+		uint32_t len)
+{
+	if (d->start >= d->end) {
+		d->start = start;
+		d->end = start + len;
+		return;
+	}
+	if (start < d->start)
+		d->start = start;
+	if (start + len > d->end)
+		d->end = start + len;
+}
+
+static int
+reprap_msync(
+		uint8_t * base,
+		reprap_dirty_t * d,
+		int wait)
+{
+	if (d->start >= d->end)
+		return 0;
+	// 'base' comes from mmap(), so it's page aligned
+	uint32_t page = sysconf(_SC_PAGESIZE);
+	uint32_t start = d->start & ~(page - 1);
+	uint32_t len = d->end - start;
+	d->start = d->end = 0;
+	if (msync(base + start, len, wait ? MS_SYNC : MS_ASYNC)) {
+		perror(__func__);
+		return -1;
+	}
+	return 0;
+}
+
+int
+reprap_sync(
+		reprap_p r,
+		int wait )
+{
+	int res = 0;
+	if (r->flash_fd >= 0)
+		res |= reprap_msync(r->avr->flash, &r->flash_dirty, wait);
+	if (r->eeprom)
+		res |= reprap_msync(r->eeprom, &r->eeprom_dirty, wait);
+	return res;
+}
+
+static avr_cycle_count_t
+reprap_sync_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	reprap_sync(r, 0);
+	return when + avr_usec_to_cycles(avr, r->config.sync_usec);
+}
+
+static void
+reprap_flash_write_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	uint32_t size = r->avr->flashend + 1;
+	// biggest SPM page there is, no need to be exact
+	reprap_dirty(&r->flash_dirty, value, value + 256 > size ? size - value : 256);
+}
+
+static void
+reprap_eeprom_write_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	reprap_dirty(&r->eeprom_dirty, value, 1);
+}
+
+// avr special flash initalization
+// here: map a file to enable a persistent storage for the flash memory
+static void
+reprap_flash_init(
+		avr_t * avr,
+		void * data)
+{
+	reprap_p r = (reprap_p)data;
+	// a new file starts as erased flash, from what avr_init() allocated
+	uint8_t * map = reprap_map_file(r->config.flash_file, avr->flashend + 1,
+			avr->flash, &r->flash_fd);
+	if (!map)
+		return;	// keep going, without persistence
+	free(avr->flash);
+	avr->flash = map;
+}
+
+// avr special flash deinitalization
+// here: flush and unmap the persistent storage
+static void
+reprap_flash_deinit(
+		avr_t * avr,
+		void * data)
+{
+	reprap_p r = (reprap_p)data;
+
+	if (r->flash_fd < 0)
+		return;
+	reprap_msync(avr->flash, &r->flash_dirty, 1);
+	munmap(avr->flash, avr->flashend + 1);
+	avr->flash = NULL;
+	close(r->flash_fd);
+	r->flash_fd = -1;
+}
+
+/*
+ * Map config.eeprom_file as the eeprom, so Marlin's M500 settings stay
+ * around. A new file gets what the firmware had in it's .eeprom section
+ */
+static int
+reprap_eeprom_init(
+		reprap_p r)
+{
+	avr_t * avr = r->avr;
+	avr_eeprom_desc_t d = { .ee = NULL, .offset = 0, .size = avr->e2end + 1 };
+
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d);
+	if (!d.ee)
+		return -1;
+	uint8_t * map = reprap_map_file(r->config.eeprom_file, d.size, d.ee,
+			&r->eeprom_fd);
+	if (!map)
+		return -1;
+	d.ee = map;
+	if (avr_ioctl(avr, AVR_IOCTL_EEPROM_MAP, &d)) {
+		munmap(map, d.size);
+		close(r->eeprom_fd);
+		r->eeprom_fd = -1;
+		return -1;
+	}
+	r->eeprom = map;
+	avr_irq_register_notify(
+			avr_io_getirq(avr, AVR_IOCTL_EEPROM_GETIRQ, EEPROM_IRQ_WRITE),
+			reprap_eeprom_write_hook, r);
+	return 0;
+}
+
+/*
+ * Marlin doesn't loop, sleep, so we don't know when it's idle
+ * I changed Marlin to do a spurious write to the GPIOR0 register so we can trap it
+ */
+static void
+reprap_relief_callback(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	reprap_p r = (reprap_p)param;
+	if (!(r->relief_tick++ & 0xf))
+		usleep(100);
+}
+
+int
+reprap_snapshot(
+		reprap_p r,
+		const char * filename,
+		int restore)
+{
+	avr_snapshot_t s;
+
+	avr_snapshot_begin(r->avr, &s, filename, restore);
+	thermistor_snapshot(&r->therm_hotend, &s);
+	thermistor_snapshot(&r->therm_hotbed, &s);
+	thermistor_snapshot(&r->therm_spare, &s);
+	heatpot_snapshot(&r->hotend, &s);
+	heatpot_snapshot(&r->hotbed, &s);
+	stepper_snapshot(&r->step_x, &s);
+	stepper_snapshot(&r->step_y, &s);
+	stepper_snapshot(&r->step_z, &s);
+	stepper_snapshot(&r->step_e, &s);
+	if (r->config.report)
+		print_report_snapshot(&r->report, &s);
+	avr_snapshot_timer(&s, reprap_sync_timer, r);
+	int res = avr_snapshot_end(&s);
+	// the memories were overwritten behind our back
+	if (restore) {
+		reprap_dirty(&r->flash_dirty, 0, r->avr->flashend + 1);
+		if (r->eeprom)
+			reprap_dirty(&r->eeprom_dirty, 0, r->avr->e2end + 1);
+	}
+	fprintf(stderr, "%s %s %s at cycle %llu%s\n", __func__,
+			restore ? "restored" : "saved", filename,
+			(unsigned long long)r->avr->cycle, res ? " FAILED" : "");
+	return res;
+}
+
+/*
+ * One instruction (or sleep), then save the checkpoint if it's due;
+ * between two instructions, nothing is half done
+ */
+static int
+reprap_step(
+		reprap_p r)
+{
+	int state = avr_run(r->avr);
+	if (r->config.checkpoint_file &&
+			r->avr->cycle >= r->config.checkpoint_cycle) {
+		reprap_snapshot(r, r->config.checkpoint_file, 0);
+		r->config.checkpoint_file = NULL;
+	}
+	return state;
+}
+
+int
+reprap_run_for(
+		reprap_p r,
+		avr_cycle_count_t cycles)
+{
+	avr_cycle_count_t limit = r->avr->cycle + cycles;
+	int state = r->avr->state;
+	while (r->avr->cycle < limit) {
+		state = reprap_step(r);
+		if (state == cpu_Done || state == cpu_Crashed)
+			break;
+	}
+	return state;
+}
+
+int
+reprap_run_gcode(
+		reprap_p r,
+		avr_cycle_count_t cycles)
+{
+	avr_cycle_count_t limit = r->avr->cycle + cycles;
+	int state = r->avr->state;
+	while (!r->gcode_host.done && r->avr->cycle < limit) {
+		state = reprap_step(r);
+		if (state == cpu_Done || state == cpu_Crashed)
+			break;
+	}
+	return state;
+}
+
+static int
+reprap_init(
+		avr_t * avr,
+		reprap_p r)
+{
+	reprap_config_t * c = &r->config;
+
+	if (c->stimulus_mode) {
+		if (stimulus_init(avr, &r->stimulus, c->stimulus_file,
+				c->stimulus_mode, c->seed))
+			return -1;
+		c->seed = r->stimulus.seed;
+	}
+	// when replaying, the UART input comes from the recording only
+	if (c->stimulus_mode == STIMULUS_REPLAY)
+		;
+	else if (c->gcode_file) {
+		// a restored firmware has long printed it's "start"
+		if (gcode_host_init(avr, &r->gcode_host, c->gcode_file,
+				GCODE_HOST_FLAG_CHECKSUM |
+				(c->restore_file ? 0 : GCODE_HOST_FLAG_WAIT_START)))
+			return -1;
+		r->host = REPRAP_HOST_GCODE;
+		gcode_host_connect(&r->gcode_host, '0');
+	} else if (c->tcp_port) {
+		if (uart_tcp_init(avr, &r->uart_tcp, c->tcp_port))
+			return -1;
+		r->host = REPRAP_HOST_TCP;
+		uart_tcp_connect(&r->uart_tcp, '0');
+	} else {
+		r->host = REPRAP_HOST_PTY;
+		uart_pty_init(avr, &r->uart_pty);
+		uart_pty_connect(&r->uart_pty, '0');
+	}
+
+	thermistor_init(avr, &r->therm_hotend, 0,
+			(short*)TERMISTOR_TABLE(TEMP_SENSOR_0),
+			sizeof(TERMISTOR_TABLE(TEMP_SENSOR_0)) / sizeof(short) / 2,
+			OVERSAMPLENR, 25.0f);
+	thermistor_init(avr, &r->therm_hotbed, 2,
+			(short*)TERMISTOR_TABLE(TEMP_SENSOR_BED),
+			sizeof(TERMISTOR_TABLE(TEMP_SENSOR_BED)) / sizeof(short) / 2,
+			OVERSAMPLENR, 30.0f);
+	thermistor_init(avr, &r->therm_spare, 1,
+			(short*)temptable_5, sizeof(temptable_5) / sizeof(short) / 2,
+			OVERSAMPLENR, 10.0f);
+
+	reprap_plant_t * pl = &r->plant;
+	heatpot_init(avr, &r->hotend, "hotend", pl->hotend.ambient);
+	heatpot_init(avr, &r->hotbed, "hotbed", pl->hotbed.ambient);
+	if (c->seed) {
+		heatpot_seed(&r->hotend, c->seed);
+		heatpot_seed(&r->hotbed, c->seed * 31 + 1);
+	}
+
+	heatpot_tally(&r->hotend, TALLY_AMBIANT, pl->hotend.loss);
+	heatpot_tally(&r->hotbed, TALLY_AMBIANT, pl->hotbed.loss);
+
+	/* connect heatpot temp output to thermistors */
+	avr_connect_irq(r->hotend.irq + IRQ_HEATPOT_TEMP_OUT,
+			r->therm_hotend.irq + IRQ_TERM_TEMP_VALUE_IN);
+	avr_connect_irq(r->hotbed.irq + IRQ_HEATPOT_TEMP_OUT,
+			r->therm_hotbed.irq + IRQ_TERM_TEMP_VALUE_IN);
+
+	avr_irq_register_notify(
+			get_ardu_irq(avr, HEATER_0_PIN, arduidiot_644),
+			hotend_change_hook, r);
+	avr_irq_register_notify(
+			get_ardu_irq(avr, FAN_PIN, arduidiot_644),
+			hotend_fan_change_hook, r);
+	avr_irq_register_notify(
+			get_ardu_irq(avr, HEATER_BED_PIN, arduidiot_644),
+			hotbed_change_hook, r);
+
+	{
+		avr_irq_t * e = get_ardu_irq(avr, X_ENABLE_PIN, arduidiot_644);
+		avr_irq_t * s = get_ardu_irq(avr, X_STEP_PIN, arduidiot_644);
+		avr_irq_t * d = get_ardu_irq(avr, X_DIR_PIN, arduidiot_644);
+		avr_irq_t * m = get_ardu_irq(avr, X_MIN_PIN, arduidiot_644);
+
+		reprap_axis_plant_t * a = &pl->axis[0];
+		stepper_init(avr, &r->step_x, "X", a->steps_per_mm, a->start, a->max, a->endstop);
+		stepper_connect(&r->step_x, s, d, e, m, stepper_endstop_inverted);
+	}
+	{
+		avr_irq_t * e = get_ardu_irq(avr, Y_ENABLE_PIN, arduidiot_644);
+		avr_irq_t * s = get_ardu_irq(avr, Y_STEP_PIN, arduidiot_644);
+		avr_irq_t * d = get_ardu_irq(avr, Y_DIR_PIN, arduidiot_644);
+		avr_irq_t * m = get_ardu_irq(avr, Y_MIN_PIN, arduidiot_644);
+
+		reprap_axis_plant_t * a = &pl->axis[1];
+		stepper_init(avr, &r->step_y, "Y", a->steps_per_mm, a->start, a->max, a->endstop);
+		stepper_connect(&r->step_y, s, d, e, m, stepper_endstop_inverted);
+	}
+	{
+		avr_irq_t * e = get_ardu_irq(avr, Z_ENABLE_PIN, arduidiot_644);
+		avr_irq_t * s = get_ardu_irq(avr, Z_STEP_PIN, arduidiot_644);
+		avr_irq_t * d = get_ardu_irq(avr, Z_DIR_PIN, arduidiot_644);
+		avr_irq_t * m = get_ardu_irq(avr, Z_MIN_PIN, arduidiot_644);
+
+		reprap_axis_plant_t * a = &pl->axis[2];
+		stepper_init(avr, &r->step_z, "Z", a->steps_per_mm, a->start, a->max, a->endstop);
+		stepper_connect(&r->step_z, s, d, e, m, stepper_endstop_inverted);
+	}
+	{
+		avr_irq_t * e = get_ardu_irq(avr, E0_ENABLE_PIN, arduidiot_644);
+		avr_irq_t * s = get_ardu_irq(avr, E0_STEP_PIN, arduidiot_644);
+		avr_irq_t * d = get_ardu_irq(avr, E0_DIR_PIN, arduidiot_644);
+
+		reprap_axis_plant_t * a = &pl->axis[3];
+		stepper_init(avr, &r->step_e, "E", a->steps_per_mm, a->start, a->max, a->endstop);
+		stepper_connect(&r->step_e, s, d, e, NULL, 0);
+	}
+
+	if (c->deposition) {
+		deposition_init(avr, &r->deposition, &r->step_x, &r->step_y,
+				&r->step_z, &r->step_e, pl->filament_diameter);
+		deposition_connect(&r->deposition, r->step_e.irq + IRQ_STEPPER_STEP_IN);
+	}
+	if (c->report) {
+		print_report_init(avr, &r->report, &r->step_z, &r->step_e,
+				r->host == REPRAP_HOST_GCODE ? &r->gcode_host : NULL);
+		print_report_connect(&r->report,
+				get_ardu_irq(avr, HEATER_0_PIN, arduidiot_644),
+				get_ardu_irq(avr, HEATER_BED_PIN, arduidiot_644));
+	}
+
+	// the serial ports are the printer's external inputs; anything else
+	// that pokes at the AVR should go through stimulus_inject()
+	if (c->stimulus_mode) {
+		for (char u = '0'; u <= '3'; u++) {
+			avr_irq_t * irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(u), UART_IRQ_INPUT);
+			char name[16];
+			snprintf(name, sizeof(name), "uart%c.in", u);
+			if (irq)
+				stimulus_add(&r->stimulus, name, irq);
+		}
+		stimulus_start(&r->stimulus);
+	}
+	return 0;
+}
+
+/*
+ * Decoded firmwares, shared by all the printers of the process. The flash
+ * image lives in an unlinked temp file that each printer maps MAP_PRIVATE,
+ * so they all share the same pages, until one of them writes to it's own
+ * flash with SPM, and the kernel gives it a copy of that page only.
+ * Images are never freed, there is one per firmware file at most.
+ */
+typedef struct reprap_image_t {
+	struct reprap_image_t * next;
+	char *		firmware;	// NULL for the default Marlin
+	uint32_t	flash_size;
+	int			fd;
+	const uint8_t *	flash;	// read only view of 'fd'
+	uint32_t	base, size;	// the part of the flash the firmware covers
+	uint32_t	pc;
+	avr_flashaddr_t	codeend;
+	elf_firmware_t *	elf;	// for the other ELF sections, NULL for .hex
+	uint16_t	planner_head, planner_tail;
+} reprap_image_t;
+
+static pthread_mutex_t reprap_image_lock = PTHREAD_MUTEX_INITIALIZER;
+static reprap_image_t * reprap_images = NULL;
+
+/*
+ * Decode 'firmware', .hex or ELF. Without one, use the default Marlin
+ * build: the ELF from the Marlin tree if it's there, otherwise our .hex
+ */
+static int
+reprap_image_decode(
+		reprap_image_t * im,
+		uint8_t * flash,
+		int quiet)
+{
+	const char * fname = im->firmware;
+	const char * ext = fname ? strrchr(fname, '.') : NULL;
+	int is_hex = ext && !strcmp(ext, ".hex");
+	elf_firmware_t * f = calloc(1, sizeof(*f));
+
+	if (!fname)
+		fname = "/opt/reprap/tvrrug/Marlin/Marlin/applet/Marlin.elf";
+	if (!is_hex && elf_read_firmware(fname, f) == 0) {
+		if (!quiet)
+			fprintf(stderr, "firmware %s f=%d mmcu=%s\n", fname, (int)f->frequency, f->mmcu);
+		if (f->flashbase + f->flashsize > im->flash_size) {
+			fprintf(stderr, "%s: %s doesn't fit in flash\n", __func__, fname);
+			free(f);
+			return -1;
+		}
+		memcpy(flash + f->flashbase, f->flash, f->flashsize);
+		im->base = f->flashbase;
+		im->size = f->flashsize;
+		im->codeend = f->flashsize + f->flashbase - f->datasize;
+		im->elf = f;
+#if ELF_SYMBOLS
+		// look for the planner ring buffer, for the gcode host stats
+		for (int si = 0; si < f->symbolcount; si++) {
+			if (!strcmp(f->symbol[si]->symbol, "block_buffer_head"))
+				im->planner_head = f->symbol[si]->addr & 0xffff;
+			else if (!strcmp(f->symbol[si]->symbol, "block_buffer_tail"))
+				im->planner_tail = f->symbol[si]->addr & 0xffff;
+		}
+#endif
+		return 0;
+	}
+	free(f);
+	if (!im->firmware)
+		fname = "marlin/Marlin.hex";
+	else if (!is_hex) {
+		fprintf(stderr, "%s: Unable to load %s\n", __func__, fname);
+		return -1;
+	}
+	uint32_t base, size;
+	uint8_t * boot = read_ihex_file(fname, &size, &base);
+	if (!boot || base + size > im->flash_size) {
+		fprintf(stderr, "%s: Unable to load %s\n", __func__, fname);
+		free(boot);
+		return -1;
+	}
+	if (!quiet)
+		fprintf(stderr, "Firmware %04x(%04x in AVR talk): %d bytes (%d words)\n", base, base/2, size, size/2);
+	memcpy(flash + base, boot, size);
+	free(boot);
+	im->base = base;
+	im->size = size;
+	im->pc = base;
+	im->codeend = im->flash_size - 1;
+	return 0;
+}
+
+static reprap_image_t *
+reprap_image_new(
+		const char * firmware,
+		uint32_t flash_size,
+		int quiet)
+{
+	reprap_image_t * im = calloc(1, sizeof(*im));
+	uint8_t * flash = malloc(flash_size);
+
+	im->firmware = firmware ? strdup(firmware) : NULL;
+	im->flash_size = flash_size;
+	im->fd = -1;
+	memset(flash, 0xff, flash_size);
+	if (reprap_image_decode(im, flash, quiet))
+		goto error;
+
+	const char * tmp = getenv("TMPDIR");
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/simreprap-XXXXXX", tmp ? tmp : "/tmp");
+	im->fd = mkstemp(path);
+	if (im->fd < 0) {
+		perror(path);
+		goto error;
+	}
+	unlink(path);
+	if (write(im->fd, flash, flash_size) != flash_size) {
+		perror(__func__);
+		goto error;
+	}
+	im->flash = mmap(NULL, flash_size, PROT_READ, MAP_SHARED, im->fd, 0);
+	if (im->flash == MAP_FAILED) {
+		perror(__func__);
+		goto error;
+	}
+	free(flash);
+	return im;
+error:
+	if (im->fd >= 0)
+		close(im->fd);
+	free(im->elf);
+	free(im->firmware);
+	free(im);
+	free(flash);
+	return NULL;
+}
+
+static reprap_image_t *
+reprap_image_get(
+		const char * firmware,
+		uint32_t flash_size,
+		int quiet)
+{
+	reprap_image_t * im;
+
+	pthread_mutex_lock(&reprap_image_lock);
+	for (im = reprap_images; im; im = im->next)
+		if (im->flash_size == flash_size &&
+				(firmware && im->firmware ?
+						!strcmp(firmware, im->firmware) :
+						firmware == im->firmware))
+			break;
+	if (!im) {
+		im = reprap_image_new(firmware, flash_size, quiet);
+		if (im) {
+			im->next = reprap_images;
+			reprap_images = im;
+		}
+	}
+	pthread_mutex_unlock(&reprap_image_lock);
+	return im;
+}
+
+/*
+ * Load the firmware, from the shared image. Unless the flash is backed by
+ * a file, the one avr_init() allocated is replaced by a private mapping of
+ * the image, that already holds the code. The flash is in place before the
+ * ELF is loaded, and avr_loadcode() leaves the pages that match alone, so
+ * the code is never copied twice, and the file pages stay clean
+ */
+static int
+reprap_load_firmware(
+		reprap_p r,
+		uint16_t * planner_head,
+		uint16_t * planner_tail)
+{
+	avr_t * avr = r->avr;
+	uint32_t flash_size = avr->flashend + 1;
+	reprap_image_t * im = reprap_image_get(r->config.firmware, flash_size,
+			r->config.quiet);
+
+	if (!im)
+		return -1;
+	if (!r->config.flash_file) {
+		void * map = mmap(NULL, flash_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE, im->fd, 0);
+		if (map != MAP_FAILED) {
+			free(avr->flash);
+			avr->flash = map;
+			r->flash_mapped = 1;
+		} else
+			perror(__func__);
+	}
+	/*
+	 * persistent flash (or no mmap), keep our own copy, firmware on top;
+	 * only touch what differs, so the file pages stay clean
+	 */
+	if (!r->flash_mapped)
+		for (uint32_t o = im->base; o < im->base + im->size; o += 256) {
+			uint32_t l = im->base + im->size - o < 256 ? im->base + im->size - o : 256;
+			if (memcmp(avr->flash + o, im->flash + o, l)) {
+				memcpy(avr->flash + o, im->flash + o, l);
+				reprap_dirty(&r->flash_dirty, o, l);
+			}
+		}
+	// the rest of the ELF sections, eeprom and so on; the code is there
+	if (im->elf)
+		avr_load_firmware(avr, im->elf);
+	avr->pc = im->pc;
+	avr->codeend = im->codeend;
+	*planner_head = im->planner_head;
+	*planner_tail = im->planner_tail;
+	return 0;
+}
+
+void
+reprap_plant_defaults(
+		reprap_plant_t * plant )
+{
+	float axis_pp_per_mm[4] = DEFAULT_AXIS_STEPS_PER_UNIT;	// from Marlin!
+	reprap_plant_t d = {
+		.hotend = { .ambient = 28.0f, .power = 1.0f, .loss = -0.5f, .fan = -0.05f },
+		.hotbed = { .ambient = 25.0f, .power = 1.0f, .loss = -0.3f },
+		.axis = {
+			{ axis_pp_per_mm[0], 100, 200, 0 },
+			{ axis_pp_per_mm[1], 100, 200, 0 },
+			{ axis_pp_per_mm[2], 20, 130, 0 },
+			{ axis_pp_per_mm[3], 0, 0, 0 },
+		},
+		.filament_diameter = 3.0f,
+		.uart_cycles = 16,
+	};
+	*plant = d;
+}
+
+reprap_p
+reprap_new(
+		const reprap_config_t * config )
+{
+	reprap_p r = calloc(1, sizeof(*r));
+	r->config = *config;
+	if (config->plant)
+		r->plant = *config->plant;
+	else
+		reprap_plant_defaults(&r->plant);
+	r->config.plant = &r->plant;
+	r->flash_fd = -1;
+	r->eeprom_fd = -1;
+
+	avr_t * avr = r->avr = avr_make_mcu_by_name("atmega644");
+	if (!avr) {
+		fprintf(stderr, "%s: Error creating the AVR core\n", __func__);
+		free(r);
+		return NULL;
+	}
+	if (r->config.flash_file) {
+		avr->special_init = reprap_flash_init;
+		avr->special_deinit = reprap_flash_deinit;
+		avr->special_data = r;
+	}
+	avr_init(avr);
+	avr->frequency = 20000000;
+	avr->aref = avr->avcc = avr->vcc = 5 * 1000;	// needed for ADC
+
+	uint16_t planner_head = 0, planner_tail = 0;
+	if (reprap_load_firmware(r, &planner_head, &planner_tail))
+		goto error;
+	if (r->config.eeprom_file && reprap_eeprom_init(r)) {
+		fprintf(stderr, "%s: Unable to map %s\n", __func__, r->config.eeprom_file);
+		goto error;
+	}
+	if (r->flash_fd >= 0) {
+		avr_irq_t * irq = avr_io_getirq(avr, AVR_IOCTL_FLASH_GETIRQ, FLASH_IRQ_WRITE);
+		if (irq)
+			avr_irq_register_notify(irq, reprap_flash_write_hook, r);
+	}
+	if (r->config.sync_usec && (r->flash_fd >= 0 || r->eeprom))
+		avr_cycle_timer_register_usec(avr, r->config.sync_usec, reprap_sync_timer, r);
+	//avr->trace = 1;
+
+	// even if not setup at startup, activate gdb if crashing; every
+	// printer of the process gets it's own port
+	static volatile int instances = 0;
+	int instance = __sync_fetch_and_add(&instances, 1);
+	avr->gdb_port = r->config.gdb_port ? r->config.gdb_port : 1234 + instance;
+	if (r->config.gdb) {
+		fprintf(stderr, "AVR is stopped, waiting on gdb on port %d. Use 'target remote :%d' in avr-gdb\n",
+				avr->gdb_port, avr->gdb_port);
+		avr->state = cpu_Stopped;
+		avr_gdb_init(avr);
+	}
+	if (r->config.throttle)
+		avr_register_io_write(avr, MEGA644_GPIOR0, reprap_relief_callback, r);
+
+	if (reprap_init(avr, r))
+		goto error;
+	if (r->host == REPRAP_HOST_GCODE && planner_head && planner_tail)
+		gcode_host_set_planner_probe(&r->gcode_host,
+				planner_head, planner_tail, BLOCK_BUFFER_SIZE);
+
+	// don't bother with the wire timing of the serial port, just
+	// let the firmware chew bytes as fast as it can
+	if (r->config.fast_uart) {
+		uint32_t f = 0, cycles = r->plant.uart_cycles;
+		avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &f);
+		f |= AVR_UART_FLAG_FAST;
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &f);
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FAST_CYCLES('0'), &cycles);
+	}
+
+	// the machine is all set up, now overlay the saved state on it
+	if (r->config.restore_file) {
+		int state = avr->state;
+		if (reprap_snapshot(r, r->config.restore_file, 1))
+			goto error;
+		if (r->config.gdb)
+			avr->state = state;	// still wait for gdb
+	}
+	return r;
+error:
+	reprap_free(r);
+	return NULL;
+}
+
+static void
+reprap_json_string(
+		FILE * out,
+		const char * s)
+{
+	fputc('"', out);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < ' ')
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	fputc('"', out);
+}
+
+void
+reprap_json_summary(
+		reprap_p r,
+		const char * reason,
+		double wall,
+		FILE * out)
+{
+	gcode_host_stats_t * s = &r->gcode_host.stats;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"reason\": \"%s\",\n", reason);
+	fprintf(out, "  \"cycles\": %llu,\n", (unsigned long long)r->avr->cycle);
+	fprintf(out, "  \"simulated_sec\": %.6f,\n",
+			avr_cycles_to_nsec(r->avr, r->avr->cycle) / 1E9);
+	fprintf(out, "  \"wall_sec\": %.6f,\n", wall);
+	fprintf(out, "  \"cpu_state\": %d,\n", r->avr->state);
+	if (r->host == REPRAP_HOST_GCODE) {
+		fprintf(out, "  \"gcode\": { \"file\": ");
+		reprap_json_string(out, r->config.gcode_file);
+		fprintf(out, ", \"done\": %s, \"lines\": %u, \"errors\": %u, \"resends\": %u },\n",
+				r->gcode_host.done ? "true" : "false",
+				s->lines, s->errors, s->resends);
+	}
+	fprintf(out, "  \"position\": { \"x\": %.3f, \"y\": %.3f, \"z\": %.3f, \"e\": %.3f },\n",
+			stepper_get_position_mm(&r->step_x), stepper_get_position_mm(&r->step_y),
+			stepper_get_position_mm(&r->step_z), stepper_get_position_mm(&r->step_e));
+	fprintf(out, "  \"hotend\": %.2f,\n", r->hotend.current);
+	fprintf(out, "  \"hotbed\": %.2f%s\n", r->hotbed.current,
+			r->config.report ? "," : "");
+	if (r->config.report) {
+		print_report_finish(&r->report);
+		fprintf(out, "  \"report\": ");
+		print_report_json(&r->report, out);
+		fprintf(out, "\n");
+	}
+	fprintf(out, "}\n");
+}
+
+void
+reprap_free(
+		reprap_p r )
+{
+	if (!r)
+		return;
+	if (r->config.stimulus_mode)
+		stimulus_dispose(&r->stimulus);
+	switch (r->host) {
+		case REPRAP_HOST_GCODE:
+			// once, at the end, done or not
+			if (!r->config.quiet)
+				gcode_host_report(&r->gcode_host, stdout);
+			gcode_host_dispose(&r->gcode_host);
+			break;
+		case REPRAP_HOST_TCP:
+			uart_tcp_stop(&r->uart_tcp);
+			break;
+		case REPRAP_HOST_PTY:
+			uart_pty_stop(&r->uart_pty);
+			break;
+	}
+	// the parts allocated their irqs from the AVR pool
+	avr_free_irq(r->step_x.irq, IRQ_STEPPER_COUNT);
+	avr_free_irq(r->step_y.irq, IRQ_STEPPER_COUNT);
+	avr_free_irq(r->step_z.irq, IRQ_STEPPER_COUNT);
+	avr_free_irq(r->step_e.irq, IRQ_STEPPER_COUNT);
+	avr_free_irq(r->hotend.irq, IRQ_HEATPOT_COUNT);
+	avr_free_irq(r->hotbed.irq, IRQ_HEATPOT_COUNT);
+	avr_free_irq(r->therm_hotend.irq, IRQ_TERM_COUNT);
+	avr_free_irq(r->therm_hotbed.irq, IRQ_TERM_COUNT);
+	avr_free_irq(r->therm_spare.irq, IRQ_TERM_COUNT);
+	if (r->config.report) {
+		print_report_dispose(&r->report);
+		avr_free_irq(r->report.irq, IRQ_PRINT_REPORT_COUNT);
+	}
+	if (r->config.deposition) {
+		deposition_dispose(&r->deposition);
+		avr_free_irq(r->deposition.irq, IRQ_DEPOSITION_COUNT);
+	}
+	// the shared firmware image isn't ours to free()
+	if (r->flash_mapped) {
+		munmap(r->avr->flash, r->avr->flashend + 1);
+		r->avr->flash = NULL;
+	}
+	avr_terminate(r->avr);
+	// the eeprom module left the mapping alone
+	if (r->eeprom) {
+		reprap_msync(r->eeprom, &r->eeprom_dirty, 1);
+		munmap(r->eeprom, r->avr->e2end + 1);
+		close(r->eeprom_fd);
+	}
+	free(r->avr->irq_pool.irq);
+	free(r->avr);
+	free(r);
+}
@@ -25,6 +25,7 @@
 
 #include "sim_avr.h"
 #include "sim_time.h"
+#include "sim_snapshot.h"
 #include "stepper.h"
 
 static avr_cycle_count_t
@@ -51,7 +52,7 @@ stepper_dir_hook(
 		void * param )
 {
 	stepper_p p = (stepper_p)param;
-	printf("%s (%s) %d\n", __func__, p->name, value);
+	fprintf(stderr, "%s (%s) %d\n", __func__, p->name, value);
 	p->dir = !!value;
 }
 
@@ -63,7 +64,7 @@ stepper_enable_hook(
 {
 	stepper_p p = (stepper_p)param;
 	p->enable = !!value;
-	printf("%s (%s) %d pos %.4f\n", __func__, p->name,
+	fprintf(stderr, "%s (%s) %d pos %.4f\n", __func__, p->name,
 			p->enable != 0, p->position / p->steps_per_mm);
 	avr_raise_irq(p->irq + IRQ_STEPPER_ENDSTOP_OUT, p->position == p->endstop);
 }
@@ -147,3 +148,20 @@ stepper_get_position_mm(
 	return p->position / p->steps_per_mm;
 }
 
+
+void
+stepper_snapshot(
+		stepper_p p,
+		avr_snapshot_t * s)
+{
+	// these are bitfields, can't point at them
+	int8_t bits[2] = { p->enable, p->dir };
+
+	AVR_SNAPSHOT(s, bits);
+	AVR_SNAPSHOT(s, p->position);
+	avr_snapshot_timer(s, stepper_update_timer, p);
+	if (s->restore) {
+		p->enable = bits[0];
+		p->dir = bits[1];
+	}
+}
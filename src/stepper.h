@@ -25,6 +25,8 @@
 
 #include "sim_irq.h"
 
+struct avr_snapshot_t;
+
 enum {
 	IRQ_STEPPER_DIR_IN = 0,
 	IRQ_STEPPER_STEP_IN,
@@ -72,4 +74,12 @@ float
 stepper_get_position_mm(
 		stepper_p p);
 
+/*
+ * Save/restore the position and state, see sim_snapshot.h
+ */
+void
+stepper_snapshot(
+		stepper_p p,
+		struct avr_snapshot_t * s);
+
 #endif /* __STEPPER_H___ */
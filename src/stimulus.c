@@ -0,0 +1,296 @@
+/*
+	stimulus.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "sim_cycle_timers.h"
+
+#include "stimulus.h"
+
+static const char magic[8] = "SIMRSTIM";
+
+static void
+stimulus_put_varint(
+		FILE * f,
+		uint64_t v)
+{
+	do {
+		uint8_t b = v & 0x7f;
+		v >>= 7;
+		fputc(b | (v ? 0x80 : 0), f);
+	} while (v);
+}
+
+static int
+stimulus_get_varint(
+		FILE * f,
+		uint64_t * v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int b = fgetc(f);
+		if (b == EOF)
+			return -1;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static void
+stimulus_put_u32(
+		FILE * f,
+		uint32_t v)
+{
+	uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+	fwrite(b, 1, 4, f);
+}
+
+static int
+stimulus_get_u32(
+		FILE * f,
+		uint32_t * v)
+{
+	uint8_t b[4];
+	if (fread(b, 1, 4, f) != 4)
+		return -1;
+	*v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+	return 0;
+}
+
+/*
+ * Something was raised on a recorded channel
+ */
+static void
+stimulus_record_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	stimulus_channel_t * c = (stimulus_channel_t *)param;
+	stimulus_p p = c->p;
+
+	stimulus_put_varint(p->f, p->avr->cycle - p->cycle);
+	fputc(c->index, p->f);
+	stimulus_put_varint(p->f, value);
+	p->cycle = p->avr->cycle;
+	p->events++;
+}
+
+/*
+ * Read the next record from the file, returns 0 at the end of it
+ */
+static int
+stimulus_read_next(
+		stimulus_p p)
+{
+	uint64_t delta, value;
+	int c;
+	if (stimulus_get_varint(p->f, &delta) ||
+			(c = fgetc(p->f)) == EOF ||
+			stimulus_get_varint(p->f, &value))
+		return 0;
+	p->cycle += delta;
+	p->next_channel = c;
+	p->next_value = value;
+	return 1;
+}
+
+static avr_cycle_count_t
+stimulus_replay_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	stimulus_p p = (stimulus_p)param;
+
+	do {
+		if (p->next_channel == STIMULUS_CHANNEL_END) {
+			fprintf(stderr, "%s replay done, %u events, at cycle %llu\n", __func__,
+					p->events, (unsigned long long)avr->cycle);
+			avr_raise_irq(p->irq + IRQ_STIMULUS_END, 1);
+			return 0;
+		}
+		avr_irq_t * irq = NULL;
+		for (int ci = 0; ci < p->count && !irq; ci++)
+			if (p->channel[ci].index == p->next_channel)
+				irq = p->channel[ci].irq;
+		if (irq)
+			avr_raise_irq(irq, p->next_value);
+		p->events++;
+		if (!stimulus_read_next(p)) {
+			fprintf(stderr, "%s: truncated file, replay stopped\n", __func__);
+			avr_raise_irq(p->irq + IRQ_STIMULUS_END, 1);
+			return 0;
+		}
+	} while (p->cycle <= avr->cycle);
+
+	return p->cycle;
+}
+
+static const char * irq_names[IRQ_STIMULUS_COUNT] = {
+	[IRQ_STIMULUS_END] = "1>stimulus.end",
+};
+
+int
+stimulus_init(
+		struct avr_t * avr,
+		stimulus_p p,
+		const char * filename,
+		int mode,
+		uint32_t seed )
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->mode = mode;
+	p->seed = seed;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_STIMULUS_COUNT, irq_names);
+
+	p->f = fopen(filename, mode == STIMULUS_RECORD ? "wb" : "rb");
+	if (!p->f) {
+		perror(filename);
+		return -1;
+	}
+	if (mode == STIMULUS_RECORD)
+		return 0;
+
+	char m[8];
+	uint32_t version, frequency, count;
+	if (fread(m, 1, sizeof(m), p->f) != sizeof(m) || memcmp(m, magic, sizeof(m)) ||
+			stimulus_get_u32(p->f, &version) || version != STIMULUS_VERSION ||
+			stimulus_get_u32(p->f, &p->seed) ||
+			stimulus_get_u32(p->f, &frequency) ||
+			stimulus_get_u32(p->f, &count) || count > STIMULUS_MAX_CHANNELS) {
+		fprintf(stderr, "%s: %s is not a stimulus file (version %d)\n",
+				__func__, filename, STIMULUS_VERSION);
+		fclose(p->f);
+		p->f = NULL;
+		return -1;
+	}
+	if (frequency != avr->frequency)
+		fprintf(stderr, "%s: WARNING recorded at %dHz, running at %dHz\n", __func__,
+				frequency, avr->frequency);
+	p->file_count = count;
+	for (int ci = 0; ci < count; ci++) {
+		int l = fgetc(p->f);
+		if (l == EOF || l >= sizeof(p->file_name[ci]) ||
+				fread(p->file_name[ci], 1, l, p->f) != l) {
+			fprintf(stderr, "%s: %s truncated header\n", __func__, filename);
+			fclose(p->f);
+			p->f = NULL;
+			return -1;
+		}
+		p->file_name[ci][l] = 0;
+	}
+	fprintf(stderr, "%s replaying %s, seed %08x\n", __func__, filename, p->seed);
+	return 0;
+}
+
+int
+stimulus_add(
+		stimulus_p p,
+		const char * name,
+		avr_irq_t * irq )
+{
+	if (p->count == STIMULUS_MAX_CHANNELS || !irq)
+		return -1;
+	int ci = p->count++;
+	snprintf(p->channel[ci].name, sizeof(p->channel[ci].name), "%s", name);
+	p->channel[ci].irq = irq;
+	p->channel[ci].p = p;
+	p->channel[ci].index = ci;
+
+	if (p->mode == STIMULUS_RECORD) {
+		avr_irq_register_notify(irq, stimulus_record_hook, &p->channel[ci]);
+		return ci;
+	}
+	p->channel[ci].index = -1;
+	for (int fi = 0; fi < p->file_count; fi++)
+		if (!strcmp(p->file_name[fi], p->channel[ci].name))
+			p->channel[ci].index = fi;
+	if (p->channel[ci].index == -1)
+		fprintf(stderr, "%s: channel %s isn't in the recording\n", __func__, name);
+	return ci;
+}
+
+int
+stimulus_inject(
+		stimulus_p p,
+		int channel,
+		uint32_t value )
+{
+	if (channel < 0 || channel >= p->count)
+		return -1;
+	if (p->mode == STIMULUS_REPLAY)
+		return -1;
+	// the record hook sees it go by
+	avr_raise_irq(p->channel[channel].irq, value);
+	return 0;
+}
+
+void
+stimulus_start(
+		stimulus_p p )
+{
+	if (!p->f)
+		return;
+	// cycles are stored relative to the start of the run
+	p->cycle = 0;
+	if (p->mode == STIMULUS_RECORD) {
+		fwrite(magic, 1, sizeof(magic), p->f);
+		stimulus_put_u32(p->f, STIMULUS_VERSION);
+		stimulus_put_u32(p->f, p->seed);
+		stimulus_put_u32(p->f, p->avr->frequency);
+		stimulus_put_u32(p->f, p->count);
+		for (int ci = 0; ci < p->count; ci++) {
+			int l = strlen(p->channel[ci].name);
+			fputc(l, p->f);
+			fwrite(p->channel[ci].name, 1, l, p->f);
+		}
+		return;
+	}
+	if (stimulus_read_next(p))
+		avr_cycle_timer_register(p->avr,
+				p->cycle > p->avr->cycle ? p->cycle - p->avr->cycle : 0,
+				stimulus_replay_timer, p);
+}
+
+void
+stimulus_dispose(
+		stimulus_p p )
+{
+	if (!p->f)
+		return;
+	if (p->mode == STIMULUS_RECORD) {
+		stimulus_put_varint(p->f, p->avr->cycle - p->cycle);
+		fputc(STIMULUS_CHANNEL_END, p->f);
+		stimulus_put_varint(p->f, 0);
+		fprintf(stderr, "%s recorded %u events, %llu cycles\n", __func__,
+				p->events, (unsigned long long)p->avr->cycle);
+	} else
+		avr_cycle_timer_cancel(p->avr, stimulus_replay_timer, p);
+	fclose(p->f);
+	p->f = NULL;
+}
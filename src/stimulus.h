@@ -0,0 +1,126 @@
+/*
+	stimulus.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Records every external stimulus (anything raised on a set of IRQs, like
+ * the UART inputs, or what a test injects with stimulus_inject()) with the
+ * avr->cycle it happened at, plus the noise seed,
+ * and replays them at the exact same cycles, so a run can be reproduced
+ * bit for bit without the pty/host that generated them in the first place.
+ *
+ * File format, little endian:
+ *	"SIMRSTIM", uint32 version, uint32 seed, uint32 frequency, uint32 channels
+ *	for each channel: uint8 name length, name
+ *	then records: varint cycle delta, uint8 channel, varint value
+ *	channel 0xff is the end of the recording
+ */
+#ifndef __STIMULUS_H___
+#define __STIMULUS_H___
+
+#include <stdio.h>
+#include "sim_irq.h"
+
+enum {
+	IRQ_STIMULUS_END = 0,		// raised when the replay reached the end
+	IRQ_STIMULUS_COUNT
+};
+
+enum {
+	STIMULUS_RECORD = 1,
+	STIMULUS_REPLAY,
+};
+
+#define STIMULUS_VERSION		1
+#define STIMULUS_MAX_CHANNELS	16
+#define STIMULUS_CHANNEL_END	0xff
+
+typedef struct stimulus_channel_t {
+	char		name[32];
+	avr_irq_t *	irq;
+	struct stimulus_t * p;	// so the hooks find us back
+	int			index;		// in the file, for replay
+} stimulus_channel_t;
+
+typedef struct stimulus_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t *avr;
+	int			mode;
+	FILE *		f;
+	uint32_t	seed;
+
+	int			count;
+	stimulus_channel_t	channel[STIMULUS_MAX_CHANNELS];
+
+	// replay: names from the file header, and the next pending record
+	int			file_count;
+	char		file_name[STIMULUS_MAX_CHANNELS][32];
+	avr_cycle_count_t	cycle;	// of the last record read/written
+	uint8_t		next_channel;
+	uint32_t	next_value;
+
+	uint32_t	events;
+} stimulus_t, *stimulus_p;
+
+/*
+ * Open 'filename' for recording or replaying. When replaying, the seed is
+ * read from the file, otherwise 'seed' is stored in it. Returns 0 on success
+ */
+int
+stimulus_init(
+		struct avr_t * avr,
+		stimulus_p p,
+		const char * filename,
+		int mode,
+		uint32_t seed );
+
+/*
+ * Add an IRQ to record/replay. The name is what matches the channel
+ * between record and replay. Returns the channel number, or -1
+ */
+int
+stimulus_add(
+		stimulus_p p,
+		const char * name,
+		avr_irq_t * irq );
+
+/*
+ * Raise 'value' on a channel from outside the AVR (fault injection, a
+ * test...), and record it. When replaying, the recording raises it at the
+ * right cycle instead, so this does nothing. Returns 0 if raised/recorded
+ */
+int
+stimulus_inject(
+		stimulus_p p,
+		int channel,
+		uint32_t value );
+
+/*
+ * Call once all the channels are added
+ */
+void
+stimulus_start(
+		stimulus_p p );
+
+void
+stimulus_dispose(
+		stimulus_p p );
+
+#endif /* __STIMULUS_H___ */
@@ -0,0 +1,434 @@
+/*
+	sweep.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the same firmware and gcode on many variants of the simulated
+ * hardware (see reprap_plant_t), all the combinations of the parameter
+ * ranges given, or a latin hypercube sample of them, and prints a line
+ * per variant, as CSV.
+ *
+ *	sweep -p hotend.power=0.6:1.2:4 -p z.steps_per_mm=2560,4000 test.g
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_time.h"
+
+#include "reprap.h"
+#include "workpool.h"
+
+#define SWEEP_MAX_VALUES	256
+
+// where each parameter lives in the plant
+typedef struct sweep_field_t {
+	const char *	name;
+	size_t		offset;
+	int			is_int;
+} sweep_field_t;
+
+#define SWEEP_HEATER(_h) \
+	{ #_h ".ambient", offsetof(reprap_plant_t, _h.ambient) }, \
+	{ #_h ".power", offsetof(reprap_plant_t, _h.power) }, \
+	{ #_h ".loss", offsetof(reprap_plant_t, _h.loss) }, \
+	{ #_h ".fan", offsetof(reprap_plant_t, _h.fan) }
+#define SWEEP_AXIS(_a, _i) \
+	{ #_a ".steps_per_mm", offsetof(reprap_plant_t, axis[_i].steps_per_mm) }, \
+	{ #_a ".start", offsetof(reprap_plant_t, axis[_i].start) }, \
+	{ #_a ".max", offsetof(reprap_plant_t, axis[_i].max) }, \
+	{ #_a ".endstop", offsetof(reprap_plant_t, axis[_i].endstop) }
+
+static const sweep_field_t sweep_fields[] = {
+	SWEEP_HEATER(hotend),
+	SWEEP_HEATER(hotbed),
+	SWEEP_AXIS(x, 0),
+	SWEEP_AXIS(y, 1),
+	SWEEP_AXIS(z, 2),
+	SWEEP_AXIS(e, 3),
+	{ "filament_diameter", offsetof(reprap_plant_t, filament_diameter) },
+	{ "uart_cycles", offsetof(reprap_plant_t, uart_cycles), 1 },
+	{ "ambient", 0 },	// both heaters, handled by sweep_set()
+	{ NULL },
+};
+
+typedef struct sweep_param_t {
+	const char *	name;
+	const sweep_field_t * field;
+	int			range;		// lo:hi:count, rather than a list
+	float		lo, hi;
+	int			count;
+	float		value[SWEEP_MAX_VALUES];
+} sweep_param_t;
+
+typedef struct sweep_job_t {
+	reprap_plant_t	plant;
+	float *		value;		// one per parameter
+	reprap_p	r;			// only while it runs
+	const char *	status;
+	double		sim, wall;
+	uint64_t	start;
+	gcode_host_stats_t	stats;
+	float		position[4];
+	float		hotend, hotbed;
+	double		print_sec, filament, wait_sec;
+	float		duty[PRINT_REPORT_HEATERS];
+} sweep_job_t;
+
+typedef struct sweep_t {
+	reprap_config_t	config;
+	avr_cycle_count_t	slice;
+	double		timeout;
+	int			param_count;
+	sweep_param_t	param[32];
+	int			count;
+	sweep_job_t *	job;
+} sweep_t;
+
+static void
+sweep_set(
+		reprap_plant_t * plant,
+		const sweep_field_t * f,
+		float value)
+{
+	if (!strcmp(f->name, "ambient")) {
+		plant->hotend.ambient = plant->hotbed.ambient = value;
+		return;
+	}
+	void * dst = (uint8_t *)plant + f->offset;
+	if (f->is_int)
+		*(uint32_t *)dst = value;
+	else
+		*(float *)dst = value;
+}
+
+/*
+ * name=lo:hi:count, or name=v1,v2,...
+ */
+static int
+sweep_parse(
+		sweep_param_t * p,
+		char * arg)
+{
+	char * eq = strchr(arg, '=');
+	if (!eq)
+		return -1;
+	*eq++ = 0;
+	p->name = arg;
+	for (p->field = sweep_fields; p->field->name; p->field++)
+		if (!strcmp(p->field->name, arg))
+			break;
+	if (!p->field->name) {
+		fprintf(stderr, "sweep: unknown parameter '%s', one of:\n", arg);
+		for (const sweep_field_t * f = sweep_fields; f->name; f++)
+			fprintf(stderr, "  %s\n", f->name);
+		return -1;
+	}
+	float lo, hi;
+	int count;
+	if (strchr(eq, ':')) {
+		if (sscanf(eq, "%f:%f:%d", &lo, &hi, &count) != 3 ||
+				count < 1 || count > SWEEP_MAX_VALUES)
+			return -1;
+		p->range = 1;
+		p->lo = lo;
+		p->hi = hi;
+		p->count = count;
+		for (int i = 0; i < count; i++)
+			p->value[i] = count == 1 ? lo : lo + (hi - lo) * i / (count - 1);
+	} else {
+		for (char * v = strtok(eq, ","); v; v = strtok(NULL, ",")) {
+			if (p->count == SWEEP_MAX_VALUES)
+				return -1;
+			p->value[p->count++] = atof(v);
+		}
+		if (!p->count)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * All the combinations, the first parameter changes the slowest
+ */
+static void
+sweep_product(
+		sweep_t * s)
+{
+	for (int j = 0; j < s->count; j++) {
+		int n = j;
+		for (int i = s->param_count - 1; i >= 0; i--) {
+			sweep_param_t * p = &s->param[i];
+			s->job[j].value[i] = p->value[n % p->count];
+			n /= p->count;
+		}
+	}
+}
+
+/*
+ * Latin hypercube: each parameter range is cut in 'count' strata, and
+ * each stratum is used by exactly one job. Ranges are sampled at random
+ * in the stratum, lists of values are picked from
+ */
+static void
+sweep_hypercube(
+		sweep_t * s,
+		uint32_t seed)
+{
+	int * perm = malloc(s->count * sizeof(int));
+
+	for (int i = 0; i < s->param_count; i++) {
+		sweep_param_t * p = &s->param[i];
+		for (int j = 0; j < s->count; j++)
+			perm[j] = j;
+		for (int j = s->count - 1; j > 0; j--) {
+			int k = rand_r(&seed) % (j + 1);
+			int t = perm[j]; perm[j] = perm[k]; perm[k] = t;
+		}
+		for (int j = 0; j < s->count; j++) {
+			float u = (perm[j] + (float)rand_r(&seed) / RAND_MAX) / s->count;
+			if (u >= 1)
+				u = 0.9999f;
+			s->job[j].value[i] = p->range ?
+					p->lo + (p->hi - p->lo) * u :
+					p->value[(int)(u * p->count)];
+		}
+	}
+	free(perm);
+}
+
+static void
+sweep_job_finish(
+		sweep_job_t * j,
+		const char * status)
+{
+	reprap_p r = j->r;
+
+	j->status = status;
+	if (!r)
+		return;
+	j->wall = (workpool_now() - j->start) / 1E6;
+	j->sim = avr_cycles_to_nsec(r->avr, r->avr->cycle) / 1E9;
+	j->stats = r->gcode_host.stats;
+	j->position[0] = stepper_get_position_mm(&r->step_x);
+	j->position[1] = stepper_get_position_mm(&r->step_y);
+	j->position[2] = stepper_get_position_mm(&r->step_z);
+	j->position[3] = stepper_get_position_mm(&r->step_e);
+	j->hotend = r->hotend.current;
+	j->hotbed = r->hotbed.current;
+
+	print_report_p p = &r->report;
+	print_report_finish(p);
+	j->print_sec = avr_cycles_to_nsec(r->avr, p->end - p->start) / 1E9;
+	j->filament = p->filament;
+	j->wait_sec = avr_cycles_to_nsec(r->avr, p->wait_cycles) / 1E9;
+	for (int i = 0; i < PRINT_REPORT_HEATERS; i++)
+		j->duty[i] = p->end > p->start ?
+				(float)p->heater[i].on_cycles / (p->end - p->start) : 0;
+	reprap_free(r);
+	j->r = NULL;
+}
+
+static int
+sweep_slice(
+		void * param,
+		int index,
+		int worker,
+		uint64_t * wake)
+{
+	sweep_t * s = (sweep_t *)param;
+	sweep_job_t * j = &s->job[index];
+
+	if (!j->r) {
+		reprap_config_t c = s->config;
+		c.plant = &j->plant;
+		if (c.gdb_port)
+			c.gdb_port += index;
+		j->start = workpool_now();
+		j->r = reprap_new(&c);
+		if (!j->r) {
+			sweep_job_finish(j, "error");
+			return WORKPOOL_DONE;
+		}
+	}
+	reprap_p r = j->r;
+	int state = reprap_run_gcode(r, s->slice);
+
+	if (r->gcode_host.done)
+		sweep_job_finish(j, "done");
+	else if (state == cpu_Crashed)
+		sweep_job_finish(j, "crashed");
+	else if (state == cpu_Done)
+		sweep_job_finish(j, "stopped");
+	else if (avr_cycles_to_usec(r->avr, r->avr->cycle) >= s->timeout * 1000000)
+		sweep_job_finish(j, "timeout");
+	else
+		return WORKPOOL_AGAIN;
+	return WORKPOOL_DONE;
+}
+
+static void
+sweep_report(
+		sweep_t * s,
+		FILE * out)
+{
+	fprintf(out, "variant,");
+	for (int i = 0; i < s->param_count; i++)
+		fprintf(out, "%s,", s->param[i].name);
+	fprintf(out, "status,lines,errors,resends,sim_sec,wall_sec,print_sec,"
+			"filament_mm,wait_sec,hotend_duty,hotbed_duty,hotend,hotbed,x,y,z,e\n");
+	for (int v = 0; v < s->count; v++) {
+		sweep_job_t * j = &s->job[v];
+		fprintf(out, "%d,", v);
+		for (int i = 0; i < s->param_count; i++)
+			fprintf(out, "%g,", j->value[i]);
+		fprintf(out, "%s,%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.4f,%.4f,%.2f,%.2f,"
+				"%.3f,%.3f,%.3f,%.3f\n",
+				j->status, j->stats.lines, j->stats.errors, j->stats.resends,
+				j->sim, j->wall, j->print_sec, j->filament, j->wait_sec,
+				j->duty[PRINT_REPORT_HOTEND], j->duty[PRINT_REPORT_HOTBED],
+				j->hotend, j->hotbed,
+				j->position[0], j->position[1], j->position[2], j->position[3]);
+	}
+}
+
+static void
+usage(
+		const char * name)
+{
+	fprintf(stderr,
+		"Usage: %s [-j threads] [--lhs samples] [--seed n] [--timeout sec]\n"
+		"\t\t[--firmware file] [-f] [-o results.csv]\n"
+		"\t\t-p name=lo:hi:count|name=v1,v2,... [-p ...] <gcode file>\n"
+		"  Runs <gcode file> on every combination of the -p parameters, or on\n"
+		"  a latin hypercube sample of them with --lhs\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	sweep_t s = {
+		.slice = 200000,
+		.timeout = 3600,
+	};
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int samples = 0;
+	uint32_t seed = 1;
+	const char * output = NULL;
+
+	s.config.quiet = 1;
+	s.config.report = 1;
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "-j") && i < argc-1)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--lhs") && i < argc-1)
+			samples = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && i < argc-1)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--timeout") && i < argc-1)
+			s.timeout = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--firmware") && i < argc-1)
+			s.config.firmware = argv[++i];
+		else if (!strcmp(argv[i], "-f"))
+			s.config.fast_uart++;
+		else if (!strcmp(argv[i], "-o") && i < argc-1)
+			output = argv[++i];
+		else if (!strcmp(argv[i], "-p") && i < argc-1) {
+			if (s.param_count == sizeof(s.param) / sizeof(s.param[0]) ||
+					sweep_parse(&s.param[s.param_count++], argv[++i])) {
+				fprintf(stderr, "%s: invalid parameter '%s'\n", argv[0], argv[i]);
+				exit(1);
+			}
+		} else if (argv[i][0] != '-' && !s.config.gcode_file)
+			s.config.gcode_file = argv[i];
+		else
+			usage(argv[0]);
+	if (!s.config.gcode_file || !s.param_count)
+		usage(argv[0]);
+
+	// a uart speed only makes sense if we don't follow the baud rate
+	for (int i = 0; i < s.param_count; i++)
+		if (s.param[i].field->is_int)
+			s.config.fast_uart = 1;
+
+	if (samples > 0)
+		s.count = samples;
+	else {
+		s.count = 1;
+		for (int i = 0; i < s.param_count; i++) {
+			s.count *= s.param[i].count;
+			if (s.count > 1000000) {
+				fprintf(stderr, "%s: too many combinations, try --lhs\n", argv[0]);
+				exit(1);
+			}
+		}
+	}
+	// --lhs isn't bounded, check the size before doing the sums in int
+	size_t nvalues = (size_t)s.count * s.param_count;
+	if (s.count <= 0 || nvalues / s.param_count != (size_t)s.count ||
+			nvalues > SIZE_MAX / sizeof(float)) {
+		fprintf(stderr, "%s: invalid sweep size %d\n", argv[0], s.count);
+		exit(1);
+	}
+	s.job = calloc(s.count, sizeof(sweep_job_t));
+	float * values = calloc(nvalues, sizeof(float));
+	if (!s.job || !values) {
+		fprintf(stderr, "%s: can't allocate %d variants\n", argv[0], s.count);
+		exit(1);
+	}
+	for (int j = 0; j < s.count; j++)
+		s.job[j].value = values + (size_t)j * s.param_count;
+	if (samples > 0)
+		sweep_hypercube(&s, seed);
+	else
+		sweep_product(&s);
+
+	for (int j = 0; j < s.count; j++) {
+		reprap_plant_defaults(&s.job[j].plant);
+		for (int i = 0; i < s.param_count; i++)
+			sweep_set(&s.job[j].plant, s.param[i].field, s.job[j].value[i]);
+	}
+
+	fprintf(stderr, "%s: %d variants on %d threads\n", argv[0], s.count, threads);
+	if (workpool_run(s.count, threads, sweep_slice, &s, NULL))
+		exit(1);
+
+	FILE * out = output ? fopen(output, "w") : stdout;
+	if (!out) {
+		perror(output);
+		out = stdout;
+	}
+	sweep_report(&s, out);
+	if (out != stdout)
+		fclose(out);
+
+	int failed = 0;
+	for (int j = 0; j < s.count; j++)
+		failed += strcmp(s.job[j].status, "done") != 0;
+	fprintf(stderr, "%s: %d variants, %d failed\n", argv[0], s.count, failed);
+	free(values);
+	free(s.job);
+	return failed ? 1 : 0;
+}
@@ -27,6 +27,7 @@
 #include <unistd.h>
 
 #include "avr_adc.h"
+#include "sim_snapshot.h"
 
 #include "thermistor.h"
 
@@ -54,7 +55,7 @@ static void thermistor_in_hook(struct avr_irq_t * irq, uint32_t value, void * pa
 			return;
 		}
 	}
-	printf("%s(%d) temperature out of range (%.2f), we're screwed\n",
+	fprintf(stderr, "%s(%d) temperature out of range (%.2f), we're screwed\n",
 			__func__, p->adc_mux_number, p->current);
 }
 
@@ -100,7 +101,7 @@ thermistor_init(
 		avr_connect_irq(src, p->irq + IRQ_TERM_ADC_TRIGGER_IN);
 		avr_connect_irq(p->irq + IRQ_TERM_ADC_VALUE_OUT, dst);
 	}
-	printf("%s on ADC %d start %.2f\n", __func__, adc_mux_number, p->current);
+	fprintf(stderr, "%s on ADC %d start %.2f\n", __func__, adc_mux_number, p->current);
 }
 
 void
@@ -113,3 +114,11 @@ thermistor_set_temp(
 
 	avr_raise_irq(p->irq + IRQ_TERM_TEMP_VALUE_OUT, value);
 }
+
+void
+thermistor_snapshot(
+		thermistor_p p,
+		avr_snapshot_t * s )
+{
+	AVR_SNAPSHOT(s, p->current);
+}
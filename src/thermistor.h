@@ -25,6 +25,8 @@
 
 #include "sim_irq.h"
 
+struct avr_snapshot_t;
+
 enum {
 	IRQ_TERM_ADC_TRIGGER_IN = 0,
 	IRQ_TERM_ADC_VALUE_OUT,
@@ -60,5 +62,13 @@ thermistor_set_temp(
 		thermistor_p t,
 		float temp );
 
+/*
+ * Save/restore the current temperature, see sim_snapshot.h
+ */
+void
+thermistor_snapshot(
+		thermistor_p t,
+		struct avr_snapshot_t * s );
+
 
 #endif /* __THERMISTOR_H___ */
@@ -0,0 +1,329 @@
+/*
+	workpool.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+/*
+ * A ring of task indexes. Each task is in at most one queue (or parked),
+ * so 'count' entries are always enough
+ */
+typedef struct workpool_queue_t {
+	pthread_mutex_t	lock;
+	int *		task;
+	int			size;
+	int			head, len;
+} workpool_queue_t;
+
+typedef struct workpool_parked_t {
+	int			index;
+	uint64_t	wake;
+} workpool_parked_t;
+
+struct workpool_t;
+
+typedef struct workpool_worker_t {
+	struct workpool_t *	pool;
+	int			index;
+	pthread_t	thread;
+	uint32_t	seed;		// for picking a victim
+	workpool_queue_t	queue;
+	workpool_stats_t	stats;
+} workpool_worker_t;
+
+typedef struct workpool_t {
+	int			count;
+	int			threads;
+	workpool_slice_p	slice;
+	void *		param;
+	volatile int	remaining;	// tasks not done yet
+
+	pthread_mutex_t	lock;		// for the parked list and 'idle'
+	pthread_cond_t	idle;
+	workpool_parked_t *	parked;
+	int			parked_count;
+
+	workpool_worker_t *	worker;
+} workpool_t;
+
+uint64_t
+workpool_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void
+workpool_push(
+		workpool_queue_t * q,
+		int index)
+{
+	pthread_mutex_lock(&q->lock);
+	q->task[(q->head + q->len++) % q->size] = index;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes the oldest task
+static int
+workpool_pop(
+		workpool_queue_t * q)
+{
+	int res = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->len) {
+		res = q->task[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->len--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return res;
+}
+
+// a thief takes the newest, the one that would wait the longest
+static int
+workpool_steal_from(
+		workpool_queue_t * q)
+{
+	int res = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->len) {
+		q->len--;
+		res = q->task[(q->head + q->len) % q->size];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return res;
+}
+
+static int
+workpool_steal(
+		workpool_worker_t * w)
+{
+	workpool_t * p = w->pool;
+
+	w->seed = w->seed * 1103515245 + 12345;
+	int start = (w->seed >> 16) % p->threads;
+	for (int i = 0; i < p->threads; i++) {
+		workpool_worker_t * v = &p->worker[(start + i) % p->threads];
+		if (v == w)
+			continue;
+		int index = workpool_steal_from(&v->queue);
+		if (index >= 0) {
+			w->stats.steals++;
+			return index;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Move the parked tasks that are due to our queue, returns the time
+ * the next one is due, or 0 if none are parked
+ */
+static uint64_t
+workpool_unpark(
+		workpool_worker_t * w,
+		uint64_t now)
+{
+	workpool_t * p = w->pool;
+	uint64_t next = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (int i = 0; i < p->parked_count; ) {
+		if (p->parked[i].wake <= now) {
+			workpool_push(&w->queue, p->parked[i].index);
+			p->parked[i] = p->parked[--p->parked_count];
+			continue;
+		}
+		if (!next || p->parked[i].wake < next)
+			next = p->parked[i].wake;
+		i++;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return next;
+}
+
+static void
+workpool_park(
+		workpool_worker_t * w,
+		int index,
+		uint64_t wake)
+{
+	workpool_t * p = w->pool;
+
+	pthread_mutex_lock(&p->lock);
+	p->parked[p->parked_count].index = index;
+	p->parked[p->parked_count].wake = wake;
+	p->parked_count++;
+	pthread_mutex_unlock(&p->lock);
+	w->stats.parks++;
+}
+
+static void *
+workpool_thread(
+		void * param)
+{
+	workpool_worker_t * w = (workpool_worker_t *)param;
+	workpool_t * p = w->pool;
+	uint64_t next_wake = 0;
+
+	while (p->remaining) {
+		uint64_t now = 0;
+		// don't let parked tasks starve behind a busy queue
+		if (next_wake && next_wake <= (now = workpool_now()))
+			next_wake = workpool_unpark(w, now);
+
+		int index = workpool_pop(&w->queue);
+		if (index < 0)
+			index = workpool_steal(w);
+		if (index < 0) {
+			next_wake = workpool_unpark(w, now ? now : workpool_now());
+			index = workpool_pop(&w->queue);
+		}
+		if (index < 0) {
+			/*
+			 * Nothing to do right now; sleep until the next parked task is
+			 * due, or a little while, as someone's queue might fill up
+			 */
+			uint64_t until = workpool_now() + 1000;
+			if (next_wake && next_wake < until)
+				until = next_wake;
+			struct timespec ts = {
+				.tv_sec = until / 1000000,
+				.tv_nsec = (until % 1000000) * 1000,
+			};
+			pthread_mutex_lock(&p->lock);
+			if (p->remaining)
+				pthread_cond_timedwait(&p->idle, &p->lock, &ts);
+			next_wake = 1;	// have a look at the parked list
+			pthread_mutex_unlock(&p->lock);
+			continue;
+		}
+		uint64_t wake = 0;
+		int res = p->slice(p->param, index, w->index, &wake);
+		w->stats.slices++;
+		switch (res) {
+			case WORKPOOL_DONE:
+				if (__sync_sub_and_fetch(&p->remaining, 1) == 0) {
+					pthread_mutex_lock(&p->lock);
+					pthread_cond_broadcast(&p->idle);
+					pthread_mutex_unlock(&p->lock);
+				}
+				break;
+			case WORKPOOL_PARK:
+				workpool_park(w, index, wake);
+				if (!next_wake || wake < next_wake)
+					next_wake = wake;
+				break;
+			default:
+				workpool_push(&w->queue, index);
+				break;
+		}
+	}
+	return NULL;
+}
+
+int
+workpool_run(
+		int count,
+		int threads,
+		workpool_slice_p slice,
+		void * param,
+		workpool_stats_t * stats )
+{
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	if (count <= 0)
+		return 0;
+	if (threads < 1)
+		threads = 1;
+	if (threads > count)
+		threads = count;
+
+	workpool_t p = {
+		.count = count,
+		.threads = threads,
+		.slice = slice,
+		.param = param,
+		.remaining = count,
+	};
+	pthread_mutex_init(&p.lock, NULL);
+	// the wake times are CLOCK_MONOTONIC, so are the timed waits
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p.idle, &attr);
+	pthread_condattr_destroy(&attr);
+	p.parked = calloc(count, sizeof(p.parked[0]));
+	p.worker = calloc(threads, sizeof(p.worker[0]));
+
+	for (int i = 0; i < threads; i++) {
+		workpool_worker_t * w = &p.worker[i];
+		w->pool = &p;
+		w->index = i;
+		w->seed = i * 2654435761u + 1;
+		pthread_mutex_init(&w->queue.lock, NULL);
+		w->queue.size = count;
+		w->queue.task = calloc(count, sizeof(int));
+	}
+	// deal the tasks like cards, so every worker starts with some
+	for (int i = 0; i < count; i++)
+		workpool_push(&p.worker[i % threads].queue, i);
+
+	int res = 0, started = 0;
+	// the calling thread is worker 0
+	for (int i = 1; i < threads; i++, started++)
+		if (pthread_create(&p.worker[i].thread, NULL, workpool_thread, &p.worker[i])) {
+			perror(__func__);
+			res = -1;
+			break;
+		}
+	if (!res)
+		workpool_thread(&p.worker[0]);
+	else {
+		// the ones that did start must still be able to finish
+		p.remaining = 0;
+	}
+	for (int i = 1; i <= started; i++)
+		pthread_join(p.worker[i].thread, NULL);
+
+	for (int i = 0; i < threads; i++) {
+		workpool_worker_t * w = &p.worker[i];
+		if (stats) {
+			stats->slices += w->stats.slices;
+			stats->steals += w->stats.steals;
+			stats->parks += w->stats.parks;
+		}
+		pthread_mutex_destroy(&w->queue.lock);
+		free(w->queue.task);
+	}
+	free(p.worker);
+	free(p.parked);
+	pthread_cond_destroy(&p.idle);
+	pthread_mutex_destroy(&p.lock);
+	return res;
+}
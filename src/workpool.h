@@ -0,0 +1,81 @@
+/*
+	workpool.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 'count' long lived tasks (printers, typically) on 'threads' worker
+ * threads, one time slice at a time, so a thousand printers don't need a
+ * thousand threads or processes fighting for the cores.
+ *
+ * Each worker has it's own queue of tasks, it runs the oldest one for a
+ * slice, and puts it back at the end, so the tasks stay on the same core
+ * as long as it has enough to do. A worker that runs dry steals from the
+ * tail of another one's queue.
+ *
+ * A task that has nothing to do for a while (a printer throttled to real
+ * time, for example) can be parked until a wall clock time, it doesn't
+ * cost anything until then.
+ */
+#ifndef __WORKPOOL_H___
+#define __WORKPOOL_H___
+
+#include <stdint.h>
+
+enum {
+	WORKPOOL_AGAIN = 0,		// requeue, there is more to do
+	WORKPOOL_DONE,			// task is finished
+	WORKPOOL_PARK,			// don't run again before '*wake'
+};
+
+/*
+ * Run one slice of task 'index', from worker 'worker'. A task is only ever
+ * run by one worker at a time, but not always the same one.
+ * When returning WORKPOOL_PARK, '*wake' is the CLOCK_MONOTONIC time,
+ * in usec, to run it again
+ */
+typedef int (*workpool_slice_p)(
+		void * param,
+		int index,
+		int worker,
+		uint64_t * wake );
+
+typedef struct workpool_stats_t {
+	uint64_t	slices;		// total slices run
+	uint64_t	steals;		// tasks taken from another worker
+	uint64_t	parks;		// times a task was parked
+} workpool_stats_t;
+
+/*
+ * Returns when all the tasks are done, 0 on success, -1 if the workers
+ * could not be started. 'stats' is optional
+ */
+int
+workpool_run(
+		int count,
+		int threads,
+		workpool_slice_p slice,
+		void * param,
+		workpool_stats_t * stats );
+
+// CLOCK_MONOTONIC, in usec
+uint64_t
+workpool_now(void);
+
+#endif /* __WORKPOOL_H___ */